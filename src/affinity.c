@@ -0,0 +1,223 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "logging.h"
+
+struct affinity_config {
+  int has_cpus;
+  cpu_set_t cpus;
+  int has_sched;
+  int policy;
+  int priority;
+  int nice;
+};
+
+static const char *affinity_role_names[THREAD_NUM_ROLES] = {
+  "usb",
+  "worker"
+};
+
+static const uint64_t affinity_bounds[AFFINITY_LATENCY_BUCKETS - 1] = {
+  50, 100, 250, 500, 1000, 2000, 5000, 10000
+};
+
+static struct affinity_config affinity_configs[THREAD_NUM_ROLES];
+static struct affinity_latency affinity_latencies[THREAD_NUM_ROLES];
+
+/* Splits "<role>=<value>", returns the role or -1 */
+static int affinity_parse_role(const char *arg, const char **value)
+{
+  const char *eq = strchr(arg, '=');
+  if (eq == NULL)
+    return -1;
+  for (int i = 0; i < THREAD_NUM_ROLES; i++) {
+    size_t len = strlen(affinity_role_names[i]);
+    if ((size_t)(eq - arg) == len &&
+        strncmp(arg, affinity_role_names[i], len) == 0) {
+      *value = eq + 1;
+      return i;
+    }
+  }
+  return -1;
+}
+
+int affinity_parse_cpus(const char *arg)
+{
+  const char *p;
+  int role = affinity_parse_role(arg, &p);
+  if (role < 0) {
+    ERR("CPU set must be given as usb=<cpus> or worker=<cpus>");
+    return -1;
+  }
+
+  struct affinity_config *config = affinity_configs + role;
+  CPU_ZERO(&config->cpus);
+  do {
+    char *end;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end == p || first < 0)
+      goto error;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first)
+        goto error;
+    }
+    if (last >= CPU_SETSIZE)
+      goto error;
+    for (long cpu = first; cpu <= last; cpu++)
+      CPU_SET((int)cpu, &config->cpus);
+    p = end;
+  } while (*p++ == ',');
+  if (p[-1] != '\0')
+    goto error;
+
+  config->has_cpus = 1;
+  return 0;
+
+ error:
+  ERR("Invalid CPU list in \"%s\"", arg);
+  return -1;
+}
+
+int affinity_parse_sched(const char *arg)
+{
+  const char *p;
+  char *end;
+  int role = affinity_parse_role(arg, &p);
+  if (role < 0) {
+    ERR("Scheduling must be given as usb=<policy> or worker=<policy>");
+    return -1;
+  }
+
+  struct affinity_config *config = affinity_configs + role;
+  config->priority = 0;
+  config->nice = 0;
+  if (strncmp(p, "fifo:", 5) == 0 || strncmp(p, "rr:", 3) == 0) {
+    config->policy = p[0] == 'f' ? SCHED_FIFO : SCHED_RR;
+    p = strchr(p, ':') + 1;
+    config->priority = (int)strtol(p, &end, 10);
+    if (end == p || *end != '\0' ||
+        config->priority < sched_get_priority_min(config->policy) ||
+        config->priority > sched_get_priority_max(config->policy))
+      goto error;
+  } else if (strncmp(p, "nice:", 5) == 0) {
+    config->policy = SCHED_OTHER;
+    p += 5;
+    config->nice = (int)strtol(p, &end, 10);
+    if (end == p || *end != '\0' || config->nice < -20 || config->nice > 19)
+      goto error;
+  } else if (strcmp(p, "other") == 0) {
+    config->policy = SCHED_OTHER;
+  } else
+    goto error;
+
+  config->has_sched = 1;
+  return 0;
+
+ error:
+  ERR("Invalid scheduling \"%s\", expected fifo:<priority>, rr:<priority>, "
+      "nice:<-20..19> or other", arg);
+  return -1;
+}
+
+void affinity_apply(enum thread_role role)
+{
+  struct affinity_config *config = affinity_configs + role;
+  const char *name = affinity_role_names[role];
+  int status;
+
+  if (config->has_cpus) {
+    status = pthread_setaffinity_np(pthread_self(), sizeof(config->cpus),
+                                    &config->cpus);
+    if (status)
+      WARN("Failed to set the CPUs of the %s thread: %s", name,
+           strerror(status));
+  }
+
+  if (config->has_sched) {
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = config->priority;
+    status = pthread_setschedparam(pthread_self(), config->policy, &param);
+    if (status)
+      WARN("Failed to set the scheduling policy of the %s thread: %s", name,
+           strerror(status));
+    /* On Linux the nice value is a property of the thread */
+    if (config->policy == SCHED_OTHER &&
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), config->nice))
+      WARN("Failed to set the nice value of the %s thread: %s", name,
+           strerror(errno));
+  }
+}
+
+uint64_t affinity_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+void affinity_record_latency(enum thread_role role, uint64_t usec)
+{
+  struct affinity_latency *latency = affinity_latencies + role;
+  int bucket = 0;
+  while (bucket < AFFINITY_LATENCY_BUCKETS - 1 &&
+         usec > affinity_bounds[bucket])
+    bucket++;
+
+  __sync_fetch_and_add(&latency->count, 1);
+  __sync_fetch_and_add(&latency->sum_usec, usec);
+  __sync_fetch_and_add(&latency->buckets[bucket], 1);
+  uint64_t max = latency->max_usec;
+  while (usec > max &&
+         !__sync_bool_compare_and_swap(&latency->max_usec, max, usec))
+    max = latency->max_usec;
+}
+
+void affinity_get_latency(enum thread_role role,
+                          struct affinity_latency *latency)
+{
+  struct affinity_latency *from = affinity_latencies + role;
+  latency->count = __sync_fetch_and_add(&from->count, 0);
+  latency->sum_usec = __sync_fetch_and_add(&from->sum_usec, 0);
+  latency->max_usec = __sync_fetch_and_add(&from->max_usec, 0);
+  for (int i = 0; i < AFFINITY_LATENCY_BUCKETS; i++)
+    latency->buckets[i] = __sync_fetch_and_add(&from->buckets[i], 0);
+}
+
+const char *affinity_role_name(enum thread_role role)
+{
+  return affinity_role_names[role];
+}
+
+uint64_t affinity_latency_bound(int bucket)
+{
+  return bucket < AFFINITY_LATENCY_BUCKETS - 1 ? affinity_bounds[bucket]
+                                               : UINT64_MAX;
+}
@@ -0,0 +1,59 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <stdint.h>
+
+/* Kinds of threads whose CPU placement and scheduling can be set apart */
+enum thread_role {
+  /* The thread running libusb's event loop, which completes transfers */
+  THREAD_ROLE_USB,
+  /* The pool workers relaying between the clients and the printer */
+  THREAD_ROLE_WORKER,
+  THREAD_NUM_ROLES
+};
+
+/* Upper bounds of the latency histogram buckets in microseconds, the last
+   bucket collects everything above */
+#define AFFINITY_LATENCY_BUCKETS 9
+
+struct affinity_latency {
+  uint64_t count;
+  uint64_t sum_usec;
+  uint64_t max_usec;
+  uint64_t buckets[AFFINITY_LATENCY_BUCKETS];
+};
+
+/* Parse "<role>=<cpu list>", e.g. "usb=2" or "worker=0-1,4", and
+   "<role>=<policy>" with policy one of "fifo:<priority>", "rr:<priority>",
+   "nice:<n>" or "other". Return 0 on success. */
+int affinity_parse_cpus(const char *arg);
+int affinity_parse_sched(const char *arg);
+
+/* Applies the CPU set and scheduling configured for |role| to the calling
+   thread. Failures, e.g. for lack of privileges, are logged and leave the
+   thread as it was. */
+void affinity_apply(enum thread_role role);
+
+/* Microseconds on the monotonic clock, for latency samples */
+uint64_t affinity_now(void);
+
+/* Adds a sample of how long a thread of |role| took to run after it should
+   have woken up */
+void affinity_record_latency(enum thread_role role, uint64_t usec);
+
+void affinity_get_latency(enum thread_role role,
+                          struct affinity_latency *latency);
+const char *affinity_role_name(enum thread_role role);
+uint64_t affinity_latency_bound(int bucket);
@@ -0,0 +1,807 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+/* Load generator for ippusbxd. A number of concurrent clients issue a mix of
+   IPP, eSCL and web requests against a running daemon, or against one started
+   on top of the fake printer backend, and the throughput and latency of the
+   completed requests are reported per request class. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "../http.h"
+#include "../options.h"
+
+#define BENCH_IO_CHUNK (64 * 1024)
+
+enum bench_class {
+  BENCH_GET_ATTRIBUTES,
+  BENCH_PRINT_JOB,
+  BENCH_ESCL,
+  BENCH_WEB,
+  BENCH_NUM_CLASSES
+};
+
+static const char *bench_class_names[BENCH_NUM_CLASSES] = {
+  "get-printer-attributes",
+  "print-job",
+  "escl",
+  "web"
+};
+
+/* Names of the classes in --mix, the full names are accepted too */
+static const char *bench_mix_names[BENCH_NUM_CLASSES] = {
+  "get",
+  "print",
+  "escl",
+  "web"
+};
+
+struct bench_config {
+  const char *host;
+  uint16_t port;
+  uint32_t clients;
+  uint32_t duration;
+  uint32_t warmup;
+  uint64_t requests;
+  size_t print_size;
+  uint32_t weights[BENCH_NUM_CLASSES];
+  int keep_alive;
+  uint32_t io_timeout;
+  const char *spawn;
+  const char *fake_spec;
+};
+
+struct bench_class_stats {
+  uint64_t completed;
+  uint64_t http_errors;
+  uint64_t bytes;
+  /* Latencies of completed requests in microseconds. */
+  uint32_t *latencies;
+  size_t num_latencies;
+  size_t cap_latencies;
+};
+
+struct bench_client {
+  uint32_t id;
+  pthread_t thread;
+  unsigned int seed;
+  int fd;
+
+  struct bench_class_stats classes[BENCH_NUM_CLASSES];
+  uint64_t connect_failures;
+  /* Requests answered with 503 by the admission control, and the sum of
+     the Retry-After values given */
+  uint64_t refused;
+  uint64_t retry_after_sum;
+  uint64_t no_response;
+  uint64_t timed_out;
+  uint64_t io_errors;
+  uint64_t connections;
+};
+
+static struct bench_config config;
+static struct addrinfo *bench_addr = NULL;
+static uint8_t bench_payload[BENCH_IO_CHUNK];
+static uint32_t bench_request_id = 0;
+static volatile int bench_stop = 0;
+static uint64_t bench_measure_start = 0;
+
+/* Shared by logging.c and http.c */
+struct options g_options;
+
+static uint64_t bench_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/* Request construction ==---------------------------------------------== */
+
+struct bench_buffer {
+  char data[2048];
+  size_t len;
+};
+
+static void put_bytes(struct bench_buffer *buf, const void *data, size_t len)
+{
+  if (buf->len + len > sizeof(buf->data))
+    return;
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+}
+
+static void put_u16(struct bench_buffer *buf, unsigned value)
+{
+  uint8_t be[2] = { (uint8_t)(value >> 8), (uint8_t)value };
+  put_bytes(buf, be, 2);
+}
+
+static void put_attr(struct bench_buffer *buf, uint8_t tag, const char *name,
+                     const char *value)
+{
+  put_bytes(buf, &tag, 1);
+  put_u16(buf, (unsigned)strlen(name));
+  put_bytes(buf, name, strlen(name));
+  put_u16(buf, (unsigned)strlen(value));
+  put_bytes(buf, value, strlen(value));
+}
+
+/* Builds the IPP operation header and operation attributes. */
+static void build_ipp(struct bench_buffer *buf, unsigned op)
+{
+  uint32_t id = __sync_add_and_fetch(&bench_request_id, 1);
+  uint8_t be[4] = { (uint8_t)(id >> 24), (uint8_t)(id >> 16),
+                    (uint8_t)(id >> 8), (uint8_t)id };
+  char uri[128];
+
+  snprintf(uri, sizeof(uri), "ipp://%s:%u/ipp/print", config.host,
+           config.port);
+  buf->len = 0;
+  put_u16(buf, 0x0200);
+  put_u16(buf, op);
+  put_bytes(buf, be, 4);
+  put_bytes(buf, "\x01", 1);
+  put_attr(buf, 0x47, "attributes-charset", "utf-8");
+  put_attr(buf, 0x48, "attributes-natural-language", "en");
+  put_attr(buf, 0x45, "printer-uri", uri);
+  put_attr(buf, 0x42, "requesting-user-name", "bench");
+  if (op == 0x000b) {
+    put_attr(buf, 0x44, "requested-attributes", "all");
+  } else {
+    put_attr(buf, 0x42, "job-name", "bench");
+    put_attr(buf, 0x49, "document-format", "application/octet-stream");
+  }
+  put_bytes(buf, "\x03", 1);
+}
+
+/* Formats the request head for |cls| into |head| and the IPP part of the body
+   into |ipp|. Returns the total body length. */
+static uint64_t build_request(struct bench_client *client,
+                              enum bench_class cls, char *head,
+                              size_t head_size, struct bench_buffer *ipp,
+                              int *is_head)
+{
+  const char *connection = config.keep_alive ? "keep-alive" : "close";
+  uint64_t body_len = 0;
+
+  ipp->len = 0;
+  *is_head = 0;
+  switch (cls) {
+  case BENCH_GET_ATTRIBUTES:
+  case BENCH_PRINT_JOB:
+    build_ipp(ipp, cls == BENCH_PRINT_JOB ? 0x0002 : 0x000b);
+    body_len = ipp->len;
+    if (cls == BENCH_PRINT_JOB)
+      body_len += config.print_size;
+    snprintf(head, head_size,
+             "POST /ipp/print HTTP/1.1\r\n"
+             "Host: %s:%u\r\n"
+             "Content-Type: application/ipp\r\n"
+             "Content-Length: %llu\r\n"
+             "Connection: %s\r\n"
+             "\r\n",
+             config.host, config.port, (unsigned long long)body_len,
+             connection);
+    break;
+  case BENCH_ESCL:
+    snprintf(head, head_size,
+             "GET /eSCL/%s HTTP/1.1\r\n"
+             "Host: %s:%u\r\n"
+             "Connection: %s\r\n"
+             "\r\n",
+             rand_r(&client->seed) % 2 ? "ScannerStatus"
+                                       : "ScannerCapabilities",
+             config.host, config.port, connection);
+    break;
+  case BENCH_WEB:
+  default:
+    snprintf(head, head_size,
+             "GET / HTTP/1.1\r\n"
+             "Host: %s:%u\r\n"
+             "Accept: text/html\r\n"
+             "Connection: %s\r\n"
+             "\r\n",
+             config.host, config.port, connection);
+    break;
+  }
+
+  return body_len;
+}
+
+static enum bench_class pick_class(struct bench_client *client)
+{
+  uint32_t total = 0;
+  for (int i = 0; i < BENCH_NUM_CLASSES; i++)
+    total += config.weights[i];
+
+  uint32_t pick = (uint32_t)rand_r(&client->seed) % total;
+  for (int i = 0; i < BENCH_NUM_CLASSES; i++) {
+    if (pick < config.weights[i])
+      return (enum bench_class)i;
+    pick -= config.weights[i];
+  }
+  return BENCH_WEB;
+}
+
+/* Connection handling ==----------------------------------------------== */
+
+static int bench_connect(struct bench_client *client)
+{
+  struct timeval tv = { (time_t)config.io_timeout, 0 };
+  int one = 1;
+
+  int fd = socket(bench_addr->ai_family, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(fd, bench_addr->ai_addr, bench_addr->ai_addrlen)) {
+    close(fd);
+    return -1;
+  }
+
+  client->fd = fd;
+  client->connections++;
+  return 0;
+}
+
+static void bench_disconnect(struct bench_client *client)
+{
+  if (client->fd >= 0)
+    close(client->fd);
+  client->fd = -1;
+}
+
+static int send_all(int fd, const void *data, size_t len)
+{
+  const uint8_t *p = data;
+  while (len > 0) {
+    ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+enum bench_result {
+  BENCH_OK,
+  BENCH_IO_ERROR,
+  /* The daemon answered 503, which it does when it has no interface or
+     worker for the connection in time, see usb_admit(). */
+  BENCH_REFUSED,
+  /* The daemon closed the connection without answering */
+  BENCH_NO_RESPONSE,
+  /* No progress within --timeout, e.g. while the request waits for an
+     interface */
+  BENCH_TIMED_OUT
+};
+
+/* Tells a socket timeout from other failures of the last send or recv */
+static enum bench_result io_failure(void)
+{
+  return errno == EAGAIN || errno == EWOULDBLOCK ? BENCH_TIMED_OUT
+                                                 : BENCH_IO_ERROR;
+}
+
+/* Returns the Retry-After value in the response head |head|, 0 if none */
+static uint32_t retry_after(const char *head)
+{
+  const char *field = strcasestr(head, "\r\nRetry-After:");
+  if (field == NULL)
+    return 0;
+  return (uint32_t)strtoul(field + strlen("\r\nRetry-After:"), NULL, 10);
+}
+
+static enum bench_result bench_request(struct bench_client *client,
+                                       enum bench_class cls,
+                                       uint64_t *bytes, int *status,
+                                       uint32_t *retry)
+{
+  char head[1024];
+  struct bench_buffer ipp;
+  int is_head;
+  struct http_framer framer;
+  uint8_t buf[BENCH_IO_CHUNK];
+  uint64_t received = 0;
+  /* Start of the response, for the Retry-After of a refusal */
+  char response_head[512];
+  size_t head_len = 0;
+
+  build_request(client, cls, head, sizeof(head), &ipp, &is_head);
+
+  if (send_all(client->fd, head, strlen(head)) ||
+      send_all(client->fd, ipp.data, ipp.len))
+    return io_failure();
+  *bytes = strlen(head) + ipp.len;
+  if (cls == BENCH_PRINT_JOB) {
+    size_t left = config.print_size;
+    while (left > 0) {
+      size_t n = left < sizeof(bench_payload) ? left : sizeof(bench_payload);
+      if (send_all(client->fd, bench_payload, n))
+        return io_failure();
+      left -= n;
+    }
+    *bytes += config.print_size;
+  }
+
+  http_framer_init(&framer, 1);
+  framer.no_body = is_head;
+  while (!http_framer_done(&framer)) {
+    ssize_t n = recv(client->fd, buf, sizeof(buf), 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n == 0 && framer.state == HTTP_FRAMER_BODY_UNTIL_CLOSE)
+      break;
+    if (n == 0 && received == 0)
+      return BENCH_NO_RESPONSE;
+    if (n < 0)
+      return io_failure();
+    if (n == 0)
+      return BENCH_IO_ERROR;
+    received += (uint64_t)n;
+    if (head_len < sizeof(response_head) - 1) {
+      size_t copy = sizeof(response_head) - 1 - head_len;
+      if (copy > (size_t)n)
+        copy = (size_t)n;
+      memcpy(response_head + head_len, buf, copy);
+      head_len += copy;
+    }
+
+    size_t used = http_framer_feed(&framer, buf, (size_t)n);
+    if (framer.state == HTTP_FRAMER_ERROR || used < (size_t)n)
+      return BENCH_IO_ERROR;
+  }
+
+  *bytes += received;
+  *status = framer.status;
+  if (framer.status == 503) {
+    response_head[head_len] = '\0';
+    *retry = retry_after(response_head);
+    return BENCH_REFUSED;
+  }
+  return BENCH_OK;
+}
+
+static void record_latency(struct bench_class_stats *stats, uint64_t usec)
+{
+  if (stats->num_latencies == stats->cap_latencies) {
+    size_t cap = stats->cap_latencies ? stats->cap_latencies * 2 : 1024;
+    uint32_t *grown = realloc(stats->latencies, cap * sizeof(*grown));
+    if (grown == NULL)
+      return;
+    stats->latencies = grown;
+    stats->cap_latencies = cap;
+  }
+  stats->latencies[stats->num_latencies++] =
+      usec > UINT32_MAX ? UINT32_MAX : (uint32_t)usec;
+}
+
+static void *bench_client_thread(void *user_data)
+{
+  struct bench_client *client = user_data;
+  uint64_t issued = 0;
+
+  while (!bench_stop &&
+         (config.requests == 0 || issued < config.requests)) {
+    if (client->fd < 0 && bench_connect(client)) {
+      client->connect_failures++;
+      usleep(100000);
+      continue;
+    }
+
+    enum bench_class cls = pick_class(client);
+    uint64_t bytes = 0;
+    int status = 0;
+    uint32_t retry = 0;
+    uint64_t start = bench_now();
+    enum bench_result result = bench_request(client, cls, &bytes, &status,
+                                             &retry);
+    uint64_t end = bench_now();
+    issued++;
+
+    if (result != BENCH_OK || !config.keep_alive)
+      bench_disconnect(client);
+    if (start < bench_measure_start)
+      continue;
+
+    struct bench_class_stats *stats = client->classes + cls;
+    switch (result) {
+    case BENCH_OK:
+      stats->completed++;
+      stats->bytes += bytes;
+      if (status >= 400)
+        stats->http_errors++;
+      record_latency(stats, end - start);
+      break;
+    case BENCH_REFUSED:
+      client->refused++;
+      client->retry_after_sum += retry;
+      break;
+    case BENCH_NO_RESPONSE:
+      client->no_response++;
+      break;
+    case BENCH_TIMED_OUT:
+      client->timed_out++;
+      break;
+    case BENCH_IO_ERROR:
+      client->io_errors++;
+      break;
+    }
+  }
+
+  bench_disconnect(client);
+  return NULL;
+}
+
+/* Daemon management ==------------------------------------------------== */
+
+/* Starts the daemon on the fake printer and reads back the port it has
+   bound. Returns the pid or -1. */
+static pid_t bench_spawn(void)
+{
+  int out[2];
+  char port[16];
+  size_t len = 0;
+
+  if (pipe(out)) {
+    perror("pipe");
+    return -1;
+  }
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    perror("fork");
+    return -1;
+  }
+  if (pid == 0) {
+    dup2(out[1], STDOUT_FILENO);
+    close(out[0]);
+    close(out[1]);
+    execl(config.spawn, config.spawn, "-n", "-B", "-P", "60000",
+          "-F", config.fake_spec, (char *)NULL);
+    perror("execl");
+    _exit(127);
+  }
+  close(out[1]);
+
+  /* The daemon prints "<port>|" once it is listening. */
+  while (len < sizeof(port) - 1) {
+    ssize_t n = read(out[0], port + len, 1);
+    if (n <= 0 || port[len] == '|')
+      break;
+    len++;
+  }
+  port[len] = '\0';
+  close(out[0]);
+
+  config.port = (uint16_t)strtoul(port, NULL, 10);
+  if (config.port == 0) {
+    fprintf(stderr, "%s did not report a port\n", config.spawn);
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    return -1;
+  }
+  return pid;
+}
+
+/* Reporting ==--------------------------------------------------------== */
+
+static int compare_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint32_t *sorted, size_t n, double p)
+{
+  if (n == 0)
+    return 0.0;
+  size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+  return sorted[i] / 1000.0;
+}
+
+static void print_row(const char *name, struct bench_class_stats *stats,
+                      double seconds)
+{
+  qsort(stats->latencies, stats->num_latencies, sizeof(*stats->latencies),
+        compare_u32);
+  printf("%-24s %9llu %9.1f %9.2f %9.2f %9.2f %9.2f %9.2f %7llu\n", name,
+         (unsigned long long)stats->completed,
+         stats->completed / seconds,
+         stats->bytes / seconds / (1024.0 * 1024.0),
+         percentile_ms(stats->latencies, stats->num_latencies, 0.50),
+         percentile_ms(stats->latencies, stats->num_latencies, 0.90),
+         percentile_ms(stats->latencies, stats->num_latencies, 0.99),
+         percentile_ms(stats->latencies, stats->num_latencies, 1.0),
+         (unsigned long long)stats->http_errors);
+}
+
+static void merge_stats(struct bench_class_stats *into,
+                        const struct bench_class_stats *from)
+{
+  into->completed += from->completed;
+  into->http_errors += from->http_errors;
+  into->bytes += from->bytes;
+  for (size_t i = 0; i < from->num_latencies; i++)
+    record_latency(into, from->latencies[i]);
+}
+
+static void report(struct bench_client *clients, double seconds)
+{
+  struct bench_class_stats totals[BENCH_NUM_CLASSES + 1];
+  uint64_t connect_failures = 0, refused = 0, retry_after_sum = 0;
+  uint64_t no_response = 0, timed_out = 0, io_errors = 0;
+  uint64_t connections = 0;
+
+  memset(totals, 0, sizeof(totals));
+  for (uint32_t c = 0; c < config.clients; c++) {
+    for (int i = 0; i < BENCH_NUM_CLASSES; i++) {
+      merge_stats(totals + i, clients[c].classes + i);
+      merge_stats(totals + BENCH_NUM_CLASSES, clients[c].classes + i);
+    }
+    connect_failures += clients[c].connect_failures;
+    refused += clients[c].refused;
+    retry_after_sum += clients[c].retry_after_sum;
+    no_response += clients[c].no_response;
+    timed_out += clients[c].timed_out;
+    io_errors += clients[c].io_errors;
+    connections += clients[c].connections;
+  }
+
+  printf("\n%u clients, %.1f s measured, %s connections, "
+         "print body %zu bytes\n\n",
+         config.clients, seconds,
+         config.keep_alive ? "keep-alive" : "one-shot", config.print_size);
+  printf("%-24s %9s %9s %9s %9s %9s %9s %9s %7s\n", "class", "requests",
+         "req/s", "MB/s", "p50 ms", "p90 ms", "p99 ms", "max ms", "4xx/5xx");
+  for (int i = 0; i < BENCH_NUM_CLASSES; i++)
+    if (config.weights[i])
+      print_row(bench_class_names[i], totals + i, seconds);
+  print_row("total", totals + BENCH_NUM_CLASSES, seconds);
+
+  printf("\nconnections opened:      %llu\n"
+         "connection failures:     %llu\n"
+         "refused with 503:        %llu (mean Retry-After %.1f s)\n"
+         "closed without response: %llu\n"
+         "timed out:               %llu\n"
+         "i/o errors:              %llu\n",
+         (unsigned long long)connections,
+         (unsigned long long)connect_failures,
+         (unsigned long long)refused,
+         refused ? (double)retry_after_sum / refused : 0.0,
+         (unsigned long long)no_response,
+         (unsigned long long)timed_out,
+         (unsigned long long)io_errors);
+
+  for (int i = 0; i <= BENCH_NUM_CLASSES; i++)
+    free(totals[i].latencies);
+}
+
+/* Setup ==------------------------------------------------------------== */
+
+static int parse_mix(const char *mix)
+{
+  char *copy = strdup(mix);
+  char *saveptr = NULL;
+  uint32_t total = 0;
+
+  memset(config.weights, 0, sizeof(config.weights));
+  for (char *item = strtok_r(copy, ",", &saveptr); item != NULL;
+       item = strtok_r(NULL, ",", &saveptr)) {
+    char *value = strchr(item, '=');
+    char *end;
+    int i;
+    if (value == NULL) {
+      fprintf(stderr, "Missing weight in \"%s\"\n", item);
+      free(copy);
+      return -1;
+    }
+    *value++ = '\0';
+    for (i = 0; i < BENCH_NUM_CLASSES; i++)
+      if (strcmp(item, bench_mix_names[i]) == 0 ||
+          strcmp(item, bench_class_names[i]) == 0)
+        break;
+    if (i == BENCH_NUM_CLASSES) {
+      fprintf(stderr, "Unknown request class \"%s\"\n", item);
+      free(copy);
+      return -1;
+    }
+    unsigned long weight = strtoul(value, &end, 10);
+    if (*value < '0' || *value > '9' || *end != '\0' || weight > UINT16_MAX) {
+      fprintf(stderr, "Invalid weight \"%s\" for %s\n", value, item);
+      free(copy);
+      return -1;
+    }
+    config.weights[i] = (uint32_t)weight;
+    total += config.weights[i];
+  }
+
+  free(copy);
+  return total > 0 ? 0 : -1;
+}
+
+static void usage(const char *argv0)
+{
+  printf("Usage: %s [options]\n"
+         "Options:\n"
+         "  --host <host>      Host the daemon listens on (default 127.0.0.1)\n"
+         "  --port <port>      Port the daemon listens on\n"
+         "  --spawn <ippusbxd> Start <ippusbxd> on the fake printer instead of\n"
+         "                     using a running daemon\n"
+         "  --fake <spec>      Fake printer spec for --spawn (default\n"
+         "                     \"interfaces=3\")\n"
+         "  --clients <n>      Number of concurrent clients (default 8)\n"
+         "  --duration <sec>   Length of the measurement (default 10)\n"
+         "  --warmup <sec>     Requests started earlier are not counted\n"
+         "                     (default 1)\n"
+         "  --requests <n>     Stop each client after <n> requests instead\n"
+         "  --mix <mix>        Request weights, e.g. the default\n"
+         "                     \"get=4,print=1,escl=2,web=2\"\n"
+         "  --print-size <n>   Print-Job document size in bytes (default 1048576)\n"
+         "  --no-keep-alive    Open a new connection for every request\n"
+         "  --timeout <sec>    Socket I/O timeout (default 30)\n",
+         argv0);
+}
+
+int main(int argc, char *argv[])
+{
+  pid_t daemon = -1;
+  int status = 1;
+
+  config.host = "127.0.0.1";
+  config.clients = 8;
+  config.duration = 10;
+  config.warmup = 1;
+  config.print_size = 1024 * 1024;
+  config.keep_alive = 1;
+  config.io_timeout = 30;
+  config.fake_spec = "interfaces=3";
+  parse_mix("get=4,print=1,escl=2,web=2");
+
+  static struct option long_options[] = {
+    {"host",          required_argument, 0, 'H'},
+    {"port",          required_argument, 0, 'p'},
+    {"spawn",         required_argument, 0, 'S'},
+    {"fake",          required_argument, 0, 'F'},
+    {"clients",       required_argument, 0, 'c'},
+    {"duration",      required_argument, 0, 'd'},
+    {"warmup",        required_argument, 0, 'w'},
+    {"requests",      required_argument, 0, 'n'},
+    {"mix",           required_argument, 0, 'm'},
+    {"print-size",    required_argument, 0, 's'},
+    {"no-keep-alive", no_argument,       0, 'K'},
+    {"timeout",       required_argument, 0, 't'},
+    {"help",          no_argument,       0, 'h'},
+    {NULL,            0,                 0, 0  }
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "H:p:S:F:c:d:w:n:m:s:Kt:h",
+                          long_options, NULL)) != -1) {
+    switch (c) {
+    case 'H': config.host = optarg; break;
+    case 'p': config.port = (uint16_t)strtoul(optarg, NULL, 10); break;
+    case 'S': config.spawn = optarg; break;
+    case 'F': config.fake_spec = optarg; break;
+    case 'c': config.clients = (uint32_t)strtoul(optarg, NULL, 10); break;
+    case 'd': config.duration = (uint32_t)strtoul(optarg, NULL, 10); break;
+    case 'w': config.warmup = (uint32_t)strtoul(optarg, NULL, 10); break;
+    case 'n': config.requests = strtoull(optarg, NULL, 10); break;
+    case 'm':
+      if (parse_mix(optarg)) {
+        fprintf(stderr, "Invalid request mix \"%s\"\n", optarg);
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 's': config.print_size = strtoul(optarg, NULL, 10); break;
+    case 'K': config.keep_alive = 0; break;
+    case 't': config.io_timeout = (uint32_t)strtoul(optarg, NULL, 10); break;
+    case 'h':
+    default:
+      usage(argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+
+  if (config.clients == 0 || (config.port == 0 && config.spawn == NULL)) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  for (size_t i = 0; i < sizeof(bench_payload); i++)
+    bench_payload[i] = (uint8_t)(i * 31 + 7);
+
+  if (config.spawn != NULL && (daemon = bench_spawn()) < 0)
+    return 1;
+
+  char port[8];
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(port, sizeof(port), "%u", config.port);
+  if (getaddrinfo(config.host, port, &hints, &bench_addr)) {
+    fprintf(stderr, "Cannot resolve %s\n", config.host);
+    goto cleanup;
+  }
+
+  struct bench_client *clients = calloc(config.clients, sizeof(*clients));
+  if (clients == NULL)
+    goto cleanup;
+
+  uint64_t start = bench_now();
+  bench_measure_start = config.requests ? start
+                                        : start + config.warmup * 1000000ULL;
+  for (uint32_t i = 0; i < config.clients; i++) {
+    clients[i].id = i;
+    clients[i].seed = 0x1234 + i;
+    clients[i].fd = -1;
+    if (pthread_create(&clients[i].thread, NULL, &bench_client_thread,
+                       clients + i)) {
+      fprintf(stderr, "Failed to start client #%u\n", i);
+      bench_stop = 1;
+      config.clients = i;
+      break;
+    }
+  }
+
+  if (config.requests == 0) {
+    sleep(config.warmup + config.duration);
+    bench_stop = 1;
+  }
+  for (uint32_t i = 0; i < config.clients; i++)
+    pthread_join(clients[i].thread, NULL);
+
+  uint64_t end = bench_now();
+  double seconds = (end - bench_measure_start) / 1000000.0;
+  report(clients, seconds > 0 ? seconds : 1);
+  status = 0;
+
+  for (uint32_t i = 0; i < config.clients; i++)
+    for (int j = 0; j < BENCH_NUM_CLASSES; j++)
+      free(clients[i].classes[j].latencies);
+  free(clients);
+
+ cleanup:
+  if (bench_addr != NULL)
+    freeaddrinfo(bench_addr);
+  if (daemon > 0) {
+    kill(daemon, SIGTERM);
+    waitpid(daemon, NULL, 0);
+  }
+  return status;
+}
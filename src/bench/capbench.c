@@ -0,0 +1,347 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+/* Microbenchmark for the capability probing done at startup. Every
+   Get-Printer-Attributes response (*.ipp, the raw IPP message body) and
+   eSCL ScannerCapabilities document (*.xml) given on the command line, or
+   found in a given directory, is run through the same parse functions the
+   daemon uses and through the TXT record construction of dnssd.c. Time and
+   heap allocations per operation are reported.
+
+   The synthetic-* samples in data/ were put together by hand after the
+   attribute sets of common inkjet, laser, photo and scanner devices; they
+   are not captures. Captures from real devices can be recorded from a
+   running ippusbxd with e.g.
+
+     curl -s -o printer.ipp -H 'Content-Type: application/ipp' \
+          --data-binary @get-printer-attributes.bin http://localhost:60000/ipp/print
+     curl -s -o scanner.xml http://localhost:60000/eSCL/ScannerCapabilities */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libxml/parser.h>
+
+#include "../capabilities.h"
+#include "../dnssd.h"
+#include "../options.h"
+
+/* Allocation counting ==----------------------------------------------== */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static int counting = 0;
+static uint64_t num_allocs = 0;
+static uint64_t num_alloc_bytes = 0;
+
+void *malloc(size_t size)
+{
+  if (counting) {
+    num_allocs++;
+    num_alloc_bytes += size;
+  }
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  if (counting) {
+    num_allocs++;
+    num_alloc_bytes += nmemb * size;
+  }
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  if (counting) {
+    num_allocs++;
+    num_alloc_bytes += size;
+  }
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+  __libc_free(ptr);
+}
+
+/* Measurement ==------------------------------------------------------== */
+
+struct sample {
+  char *name;
+  unsigned char *data;
+  size_t size;
+};
+
+struct measurement {
+  uint64_t start_ns;
+  uint64_t allocs;
+  uint64_t bytes;
+};
+
+static uint32_t iterations = 2000;
+static const char *adminurl = "http://127.0.0.1:60000/";
+
+static uint64_t now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+}
+
+static void measure_start(struct measurement *m)
+{
+  m->allocs = num_allocs;
+  m->bytes = num_alloc_bytes;
+  counting = 1;
+  m->start_ns = now_ns();
+}
+
+static void measure_end(struct measurement *m, const char *sample,
+                        const char *stage)
+{
+  uint64_t elapsed = now_ns() - m->start_ns;
+  counting = 0;
+  printf("%-28s %-14s %10.2f %10.1f %10.1f\n", sample, stage,
+         elapsed / 1000.0 / iterations,
+         (double)(num_allocs - m->allocs) / iterations,
+         (double)(num_alloc_bytes - m->bytes) / 1024.0 / iterations);
+}
+
+/* IPP ==--------------------------------------------------------------== */
+
+struct ipp_reader {
+  const unsigned char *data;
+  size_t size;
+  size_t offset;
+};
+
+static ssize_t ipp_read_memory(void *context, unsigned char *buffer,
+                               size_t bytes)
+{
+  struct ipp_reader *reader = context;
+  size_t left = reader->size - reader->offset;
+  if (bytes > left)
+    bytes = left;
+  memcpy(buffer, reader->data + reader->offset, bytes);
+  reader->offset += bytes;
+  return (ssize_t)bytes;
+}
+
+static ipp_t *ipp_decode(const struct sample *sample)
+{
+  struct ipp_reader reader = { sample->data, sample->size, 0 };
+  ipp_t *response = ippNew();
+  if (ippReadIO(&reader, ipp_read_memory, 1, NULL, response) !=
+      IPP_STATE_DATA) {
+    ippDelete(response);
+    return NULL;
+  }
+  return response;
+}
+
+static void bench_ipp(const struct sample *sample)
+{
+  struct measurement m;
+  ipp_t *response = ipp_decode(sample);
+  if (response == NULL) {
+    fprintf(stderr, "%s: Not a valid IPP response\n", sample->name);
+    return;
+  }
+
+  measure_start(&m);
+  for (uint32_t i = 0; i < iterations; i++)
+    ippDelete(ipp_decode(sample));
+  measure_end(&m, sample->name, "ipp-decode");
+
+  measure_start(&m);
+  for (uint32_t i = 0; i < iterations; i++) {
+    ippPrinter *printer = calloc(1, sizeof(ippPrinter));
+    ipp_parse_printer(printer, response);
+    free_printer(printer);
+  }
+  measure_end(&m, sample->name, "ipp-parse");
+
+  ippPrinter *printer = calloc(1, sizeof(ippPrinter));
+  ipp_parse_printer(printer, response);
+  measure_start(&m);
+  for (uint32_t i = 0; i < iterations; i++)
+    avahi_string_list_free(dnssd_printer_txt(NULL, printer, adminurl));
+  measure_end(&m, sample->name, "ipp-txt");
+
+  free_printer(printer);
+  ippDelete(response);
+}
+
+/* eSCL ==-------------------------------------------------------------== */
+
+static void bench_escl(const struct sample *sample)
+{
+  struct measurement m;
+  ippPrinter *printer = calloc(1, sizeof(ippPrinter));
+  ippScanner *scanner = calloc(1, sizeof(ippScanner));
+
+  if (!escl_parse_scanner(scanner, (const char *)sample->data,
+                          (int)sample->size)) {
+    fprintf(stderr, "%s: Not a valid ScannerCapabilities document\n",
+            sample->name);
+    goto cleanup;
+  }
+
+  measure_start(&m);
+  for (uint32_t i = 0; i < iterations; i++) {
+    ippScanner *s = calloc(1, sizeof(ippScanner));
+    escl_parse_scanner(s, (const char *)sample->data, (int)sample->size);
+    free_scanner(s);
+  }
+  measure_end(&m, sample->name, "escl-parse");
+
+  measure_start(&m);
+  for (uint32_t i = 0; i < iterations; i++)
+    avahi_string_list_free(dnssd_scanner_txt(scanner, printer, adminurl));
+  measure_end(&m, sample->name, "escl-txt");
+
+ cleanup:
+  free_scanner(scanner);
+  free_printer(printer);
+}
+
+/* Setup ==------------------------------------------------------------== */
+
+static int load_sample(const char *path, struct sample *sample)
+{
+  FILE *in = fopen(path, "rb");
+  if (in == NULL) {
+    perror(path);
+    return -1;
+  }
+  fseek(in, 0, SEEK_END);
+  long size = ftell(in);
+  fseek(in, 0, SEEK_SET);
+
+  sample->data = malloc(size > 0 ? (size_t)size : 1);
+  sample->size = size > 0 ? (size_t)size : 0;
+  if (sample->data == NULL ||
+      fread(sample->data, 1, sample->size, in) != sample->size) {
+    fprintf(stderr, "%s: Read failed\n", path);
+    fclose(in);
+    free(sample->data);
+    return -1;
+  }
+  fclose(in);
+
+  const char *base = strrchr(path, '/');
+  sample->name = strdup(base ? base + 1 : path);
+  return 0;
+}
+
+static void run_file(const char *path)
+{
+  struct sample sample;
+  size_t len = strlen(path);
+  int is_ipp = len > 4 && strcmp(path + len - 4, ".ipp") == 0;
+  int is_xml = len > 4 && strcmp(path + len - 4, ".xml") == 0;
+
+  if ((!is_ipp && !is_xml) || load_sample(path, &sample))
+    return;
+  if (is_ipp)
+    bench_ipp(&sample);
+  else
+    bench_escl(&sample);
+  free(sample.name);
+  free(sample.data);
+}
+
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void run_path(const char *path)
+{
+  DIR *dir = opendir(path);
+  struct dirent *entry;
+  char **files = NULL;
+  size_t num_files = 0;
+
+  if (dir == NULL) {
+    run_file(path);
+    return;
+  }
+
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] == '.')
+      continue;
+    char **grown = realloc(files, (num_files + 1) * sizeof(*files));
+    if (grown == NULL)
+      break;
+    files = grown;
+    if (asprintf(files + num_files, "%s/%s", path, entry->d_name) < 0)
+      break;
+    num_files++;
+  }
+  closedir(dir);
+
+  qsort(files, num_files, sizeof(*files), compare_names);
+  for (size_t i = 0; i < num_files; i++) {
+    run_file(files[i]);
+    free(files[i]);
+  }
+  free(files);
+}
+
+int main(int argc, char *argv[])
+{
+  static struct option long_options[] = {
+    {"iterations", required_argument, 0, 'n'},
+    {"help",       no_argument,       0, 'h'},
+    {NULL,         0,                 0, 0  }
+  };
+  int c;
+  while ((c = getopt_long(argc, argv, "n:h", long_options, NULL)) != -1) {
+    switch (c) {
+    case 'n':
+      iterations = (uint32_t)strtoul(optarg, NULL, 10);
+      break;
+    case 'h':
+    default:
+      printf("Usage: %s [--iterations <n>] <file or directory>...\n",
+             argv[0]);
+      return c == 'h' ? 0 : 1;
+    }
+  }
+  if (optind >= argc || iterations == 0) {
+    printf("Usage: %s [--iterations <n>] <file or directory>...\n", argv[0]);
+    return 1;
+  }
+
+  xmlInitParser();
+  printf("%-28s %-14s %10s %10s %10s\n", "sample", "stage", "usec/op",
+         "allocs/op", "KiB/op");
+  for (int i = optind; i < argc; i++)
+    run_path(argv[i]);
+  xmlCleanupParser();
+
+  return 0;
+}
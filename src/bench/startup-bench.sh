@@ -0,0 +1,98 @@
+#!/bin/sh
+# Copyright (C) 2014 Daniel Dressler and contributors
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# Starts ippusbxd against the fake printer backend over and over, waits until
+# it reports itself ready in its --status-file and prints the distribution of
+# every startup phase over all runs. Without -B the daemon registers with
+# DNS-SD and runs the capability probes, which needs a running
+# avahi-daemon.
+
+usage() {
+  echo "Usage: $0 [-n <runs>] [-f <fake printer spec>] [-t <timeout sec>] [-B] <ippusbxd>"
+}
+
+runs=20
+spec="interfaces=3"
+timeout=30
+nobroadcast=""
+while getopts "n:f:t:Bh" opt; do
+  case "$opt" in
+    n) runs="$OPTARG" ;;
+    f) spec="$OPTARG" ;;
+    t) timeout="$OPTARG" ;;
+    B) nobroadcast="-B" ;;
+    *) usage; exit 1 ;;
+  esac
+done
+shift $((OPTIND - 1))
+if [ $# -ne 1 ]; then
+  usage
+  exit 1
+fi
+daemon="$1"
+
+tmp=$(mktemp -d) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+samples="$tmp/samples"
+: > "$samples"
+
+run=1
+failed=0
+while [ "$run" -le "$runs" ]; do
+  status="$tmp/status.json"
+  rm -f "$status"
+  "$daemon" -n $nobroadcast -P 60000 -F "$spec" -S "$status" \
+    > /dev/null 2>&1 &
+  pid=$!
+
+  # Poll for the status file, which only appears once the daemon is ready
+  waited=0
+  while [ ! -f "$status" ] && [ "$waited" -lt $((timeout * 20)) ] &&
+        kill -0 "$pid" 2> /dev/null; do
+    sleep 0.05
+    waited=$((waited + 1))
+  done
+  kill "$pid" 2> /dev/null
+  wait "$pid" 2> /dev/null
+
+  if grep -q '"ready":true' "$status" 2> /dev/null; then
+    # One phase per line: "name":{"start_ms":<start>,"end_ms":<end>}
+    sed -n 's/^,\{0,1\}"\([a-z_]*\)":{"start_ms":\([0-9.]*\),"end_ms":\([0-9.]*\)}.*/\1 \2 \3/p' \
+        "$status" |
+      awk '{ print $1, ($1 == "advertised" || $1 == "ready") ? $3 : $3 - $2 }' \
+        >> "$samples"
+  else
+    echo "Run $run: daemon did not become ready within ${timeout}s" >&2
+    failed=$((failed + 1))
+  fi
+  run=$((run + 1))
+done
+
+echo "$runs runs, $failed failed; stage durations, time since start for" \
+     "advertised and ready (ms)"
+printf "%-16s %6s %9s %9s %9s %9s %9s\n" phase runs min p50 p90 max mean
+for phase in usb_open tcp_listen dnssd_init dnssd_register ipp_probe \
+             fax_probe escl_probe advertised ready; do
+  awk -v phase="$phase" '$1 == phase { print $2 }' "$samples" | sort -n |
+    awk -v phase="$phase" '
+      { v[NR] = $1; sum += $1 }
+      END {
+        if (NR == 0) exit
+        p50 = v[int((NR - 1) * 0.5) + 1]
+        p90 = v[int((NR - 1) * 0.9) + 1]
+        printf "%-16s %6d %9.2f %9.2f %9.2f %9.2f %9.2f\n",
+               phase, NR, v[1], p50, p90, v[NR], sum / NR
+      }'
+done
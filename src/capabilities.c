@@ -9,140 +9,585 @@
 #include <string.h>
 #include <unistd.h>
 #include <wchar.h>
-#include <libxml/tree.h>
+#include <stdint.h>
+#include <time.h>
 #include <libxml/parser.h>
 #include <cups/cups.h>
 #include "capabilities.h"
+#include "http.h"
 #include "logging.h"
+#include "options.h"
+#include "usb.h"
 
-struct cap
+#define SIZE_DATA 32784
+
+/* Probe channel ==---------------------------------------------------== */
+
+/* The probes speak HTTP directly on a USB interface leased from the pool
+   and parse the responses in process, so they neither depend on how our
+   listener is configured nor cost a pair of service threads each. */
+
+/* Bytes asked for per IN transfer, a multiple of every bulk packet size */
+#define PROBE_READ_SIZE 16384
+
+long long
+probe_clock(void)
 {
-    char *memory;
-    size_t size;
-};
+  struct timespec now;
 
-#define SIZE_DATA 32784
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
 
-typedef void (*fct_parcours_t)(xmlNodePtr, ippScanner *ippscanner);
+/* Milliseconds left until |deadline|, capped to |max|. */
+static unsigned int
+probe_remaining(long long deadline, unsigned int max)
+{
+  long long left = deadline - probe_clock();
+  if (left <= 0)
+    return 1;
+  return left < max ? (unsigned int)left : max;
+}
 
-void parcours_prefixe(xmlNodePtr noeud, fct_parcours_t f, ippScanner *ippscanner);
-void afficher_noeud(xmlNodePtr noeud, ippScanner *ippscanner);
+struct probe_buffer {
+  uint8_t *data;
+  size_t size;
+  size_t capacity;
+  size_t offset;
+  int failed;
+};
 
-void parcours_prefixe(xmlNodePtr noeud, fct_parcours_t f, ippScanner *ippscanner) {
-    xmlNodePtr n;
-    
-    for (n = noeud; n != NULL; n = n->next) {
-        f(n, ippscanner);
-        if ((n->type == XML_ELEMENT_NODE) && (n->children != NULL)) 
-            parcours_prefixe(n->children, f, ippscanner);
+static void
+probe_buffer_append(void *ctx, const uint8_t *data, size_t len)
+{
+  struct probe_buffer *buf = ctx;
+
+  if (buf->failed)
+    return;
+  if (buf->size + len > buf->capacity) {
+    size_t capacity = buf->capacity ? buf->capacity : 4096;
+    while (capacity < buf->size + len)
+      capacity *= 2;
+    uint8_t *grown = realloc(buf->data, capacity);
+    if (grown == NULL) {
+      buf->failed = 1;
+      return;
     }
+    buf->data = grown;
+    buf->capacity = capacity;
+  }
+  memcpy(buf->data + buf->size, data, len);
+  buf->size += len;
 }
 
-int is_array(const char *name, ippScanner *ippscanner) {
-    if (!strcmp(name, "Platen") || !strcmp(name, "Adf")) {
-      char is[256] = { 0 };
-      if (!strcmp(name, "Platen"))
-        snprintf(is, sizeof(is), "platen");
-      else if (!strcmp(name, "Adf"))
-        snprintf(is, sizeof(is), "adf");
-      if (is[0]) {
-         if (ippscanner->is) {
-            if (!strstr(ippscanner->is, is)) {
-              int len = (strlen(ippscanner->is) + strlen(is) + 2);
-              ippscanner->is = (char *) realloc(ippscanner->is, len);
-              strcat(ippscanner->is, ",");
-              strcat(ippscanner->is, is);
-            }
-         }
-         else
-            ippscanner->is = strdup(is);
-      }
-      return 1;
+static ssize_t
+probe_buffer_write(void *ctx, unsigned char *data, size_t len)
+{
+  struct probe_buffer *buf = ctx;
+
+  probe_buffer_append(buf, data, len);
+  return buf->failed ? -1 : (ssize_t)len;
+}
+
+static ssize_t
+probe_buffer_read(void *ctx, unsigned char *data, size_t len)
+{
+  struct probe_buffer *buf = ctx;
+  size_t left = buf->size - buf->offset;
+
+  if (len > left)
+    len = left;
+  memcpy(data, buf->data + buf->offset, len);
+  buf->offset += len;
+  return (ssize_t)len;
+}
+
+struct probe_channel {
+  struct usb_conn_t *conn;
+  long long deadline;
+  struct http_framer framer;
+};
+
+/* Leases an interface for the probe, waiting for one up to the deadline. */
+static int
+probe_open(struct probe_channel *chan, struct usb_sock_t *usb,
+           long long deadline)
+{
+  memset(chan, 0, sizeof(*chan));
+  chan->deadline = deadline;
+  if (usb == NULL)
+    return -1;
+  while ((chan->conn = usb_conn_acquire(usb)) == NULL) {
+    if (g_options.terminate || probe_clock() >= deadline)
+      return -1;
+    usleep(100000);
+  }
+  return 0;
+}
+
+/* Sends a request with an optional |body|. */
+static int
+probe_send(struct probe_channel *chan, const char *method, const char *path,
+           const char *content_type, const uint8_t *body, size_t body_len)
+{
+  struct probe_buffer request = { NULL, 0, 0, 0, 0 };
+  struct http_packet_t pkt;
+  char head[512];
+  int status;
+
+  if (content_type)
+    snprintf(head, sizeof(head),
+             "%s %s HTTP/1.1\r\nHost: localhost:%d\r\n"
+             "Content-Type: %s\r\nContent-Length: %zu\r\n\r\n",
+             method, path, g_options.real_port, content_type, body_len);
+  else
+    snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\nHost: localhost:%d\r\n\r\n",
+             method, path, g_options.real_port);
+  probe_buffer_append(&request, (const uint8_t *)head, strlen(head));
+  if (body_len)
+    probe_buffer_append(&request, body, body_len);
+  if (request.failed) {
+    free(request.data);
+    return -1;
+  }
+
+  pkt.buffer = request.data;
+  pkt.filled_size = request.size;
+  pkt.buffer_capacity = request.capacity;
+  status = usb_conn_packet_send(chan->conn, &pkt);
+  free(request.data);
+  return status;
+}
+
+/* Reads the response to the last request, handing its body to |body_cb|.
+   Reading stops early once |*stop| becomes non-zero. Returns the HTTP
+   status or -1. */
+static int
+probe_receive(struct probe_channel *chan, int no_body,
+              void (*body_cb)(void *ctx, const uint8_t *data, size_t len),
+              void *ctx, const int *stop)
+{
+  struct http_framer *framer = &chan->framer;
+  uint8_t buffer[PROBE_READ_SIZE];
+  int transferred;
+  int status;
+
+  http_framer_init(framer, 1);
+  framer->no_body = no_body;
+  framer->body_cb = body_cb;
+  framer->body_ctx = ctx;
+
+  while (!http_framer_done(framer)) {
+    if (framer->state == HTTP_FRAMER_ERROR || g_options.terminate ||
+        probe_clock() >= chan->deadline)
+      return -1;
+    if (stop != NULL && *stop)
+      break;
+
+    transferred = 0;
+    status = usb_conn_read(chan->conn, buffer, sizeof(buffer), &transferred,
+                           probe_remaining(chan->deadline, 1000));
+    if (status != LIBUSB_SUCCESS && status != LIBUSB_ERROR_TIMEOUT) {
+      ERR("Probe: USB read failed with status %s", libusb_error_name(status));
+      return -1;
     }
-    if (!strcmp(name, "AdfDuplexInputCaps")) {
-      ippscanner->duplex = strdup("T");
-      return 1;
+    if (transferred == 0) {
+      /* Without a length or chunking the body ends when the printer goes
+         quiet, there is no connection to close on USB. */
+      if (framer->state == HTTP_FRAMER_BODY_UNTIL_CLOSE)
+        break;
+      if (status == LIBUSB_SUCCESS)
+        usleep(10000);
+      continue;
     }
-    if (!strcmp(name, "ScannerCapabilities") ||
-        !strcmp(name, "SharpenSupport") ||
-        !strcmp(name, "SupportedIntents") ||
-        !strcmp(name, "CcdChannels") ||
-        !strcmp(name, "ColorSpaces") ||
-        !strcmp(name, "ColorModes") ||
-        !strcmp(name, "DiscreteResolutions") ||
-        !strcmp(name, "SupportedResolutions") ||
-        !strcmp(name, "DocumentFormats") ||
-        !strcmp(name, "ContentTypes") ||
-        !strcmp(name, "DiscreteResolution") ||
-        !strcmp(name, "CompressionFactorSupport") ||
-        !strcmp(name, "SupportedMediaTypes") ||
-        !strcmp(name, "SettingProfiles") ||
-        !strcmp(name, "SettingProfile") ||
-        !strcmp(name, "PlatenInputCaps"))
-           return 1;
-        return 0;
- }
-    
-void set_value_escl_scanner(const char *noeud, const char *contenu, ippScanner *ippscanner)
-{
-    if (!strcmp(noeud, "Version")) {
-      ippscanner->vers = strdup(contenu);
-    } else if (!strcmp(noeud, "MakeAndModel")) {
-      ippscanner->ty = strdup(contenu);
-    } else if (!strcmp(noeud, "UUID")) {
-      ippscanner->uuid = strdup(contenu);
-    } else if (!strcmp(noeud, "AdminURI")) {
-      ippscanner->adminurl = strdup(contenu);
-    } else if (!strcmp(noeud, "IconURI")) {
-      ippscanner->representation = strdup(contenu);
-    } else if (!strcmp(noeud, "DocumentFormat")){
-      if (ippscanner->pdl) {
-         if (!strstr(ippscanner->pdl, contenu)) {
-            int len = (strlen(ippscanner->pdl) + strlen(contenu) + 2);
-            ippscanner->pdl = (char *) realloc(ippscanner->pdl, len);
-            strcat(ippscanner->pdl, ",");
-            strcat(ippscanner->pdl, contenu);
-         }
-      }
-      else {
-         ippscanner->pdl = strdup(contenu);
-      }
-    } else if (!strcmp(noeud, "ColorMode")){
-      char modecolor[256] = { 0 };
-      if (!strcmp(contenu, "Grayscale8"))
-        snprintf(modecolor, sizeof(modecolor), "grayscale");
-      else if (!strcmp(contenu, "RGB24"))
-        snprintf(modecolor, sizeof(modecolor), "color");
-      else if (!strcmp(contenu, "BlackAndWhite1"))
-        snprintf(modecolor, sizeof(modecolor), "binary");
-      if (modecolor[0]) {
-         if (ippscanner->cs) {
-            if (!strstr(ippscanner->cs, modecolor)) {
-              int len = (strlen(ippscanner->cs) + strlen(modecolor) + 2);
-              ippscanner->cs = (char *) realloc(ippscanner->cs, len);
-              strcat(ippscanner->cs, ",");
-              strcat(ippscanner->cs, modecolor);
-            }
-         }
-         else {
-            ippscanner->cs = strdup(modecolor);
-         }
+    http_framer_feed(framer, buffer, (size_t)transferred);
+  }
+  return framer->status;
+}
+
+/* Reads what is left of an abandoned response so the interface goes back
+   to the pool clean, then releases it. */
+static void
+probe_close(struct probe_channel *chan)
+{
+  struct http_framer *framer = &chan->framer;
+  uint8_t buffer[PROBE_READ_SIZE];
+  int transferred;
+
+  if (chan->conn == NULL)
+    return;
+
+  framer->body_cb = NULL;
+  while (framer->state != HTTP_FRAMER_HEADERS &&
+         framer->state != HTTP_FRAMER_ERROR && !http_framer_done(framer) &&
+         !g_options.terminate && probe_clock() < chan->deadline) {
+    transferred = 0;
+    if (usb_conn_read(chan->conn, buffer, sizeof(buffer), &transferred,
+                      probe_remaining(chan->deadline, 200)) !=
+        LIBUSB_SUCCESS || transferred == 0)
+      break;
+    http_framer_feed(framer, buffer, (size_t)transferred);
+  }
+
+  usb_conn_release(chan->conn);
+  chan->conn = NULL;
+}
+
+/* eSCL ScannerCapabilities parsing ==---------------------------------== */
+
+/* The document is parsed in a single streaming pass with libxml2's SAX2
+   interface. Only the few elements listed in escl_elements are looked at,
+   their text is collected into a fixed buffer and the multi-valued keys are
+   gathered in bitsets, so no tree gets built and hardly anything is
+   allocated however many setting profiles the scanner reports. */
+
+enum escl_element {
+  ESCL_NONE = 0,
+  ESCL_VERSION,
+  ESCL_MAKE_AND_MODEL,
+  ESCL_UUID,
+  ESCL_ADMIN_URI,
+  ESCL_ICON_URI,
+  ESCL_DOCUMENT_FORMAT,
+  ESCL_COLOR_MODE,
+  ESCL_PLATEN,
+  ESCL_ADF,
+  ESCL_ADF_DUPLEX
+};
+
+/* Perfect hash of the element local names below: (length + 9 * first
+   character + last character) mod 16 differs for every one of them. Any
+   change to the table has to keep it collision free. */
+#define ESCL_HASH_SIZE 16
+#define ESCL_HASH(name, len) \
+  (((len) + 9u * (unsigned char)(name)[0] + \
+    (unsigned char)(name)[(len) - 1]) % ESCL_HASH_SIZE)
+
+static const struct {
+  const char *name;
+  enum escl_element element;
+} escl_elements[ESCL_HASH_SIZE] = {
+  [1]  = { "IconURI",            ESCL_ICON_URI },
+  [2]  = { "Adf",                ESCL_ADF },
+  [4]  = { "Platen",             ESCL_PLATEN },
+  [5]  = { "UUID",               ESCL_UUID },
+  [6]  = { "DocumentFormat",     ESCL_DOCUMENT_FORMAT },
+  [9]  = { "ColorMode",          ESCL_COLOR_MODE },
+  [10] = { "AdminURI",           ESCL_ADMIN_URI },
+  [11] = { "Version",            ESCL_VERSION },
+  [13] = { "MakeAndModel",       ESCL_MAKE_AND_MODEL },
+  [14] = { "AdfDuplexInputCaps", ESCL_ADF_DUPLEX },
+};
+
+/* Values of the is, cs and pdl keys, in bitset order. */
+static const char *escl_input_sources[] = { "platen", "adf" };
+static const char *escl_color_modes[][2] = {
+  { "BlackAndWhite1", "binary" },
+  { "Grayscale8",     "grayscale" },
+  { "RGB24",          "color" }
+};
+static const char *escl_document_formats[] = {
+  "application/pdf",
+  "image/jpeg",
+  "image/png",
+  "image/tiff",
+  "application/octet-stream"
+};
+
+#define ESCL_SET_MAX 8
+
+/* Set of values which remembers the order they were first seen in. */
+struct escl_set {
+  uint32_t bits;
+  int count;
+  uint8_t order[ESCL_SET_MAX];
+};
+
+struct escl_parser {
+  xmlParserCtxtPtr ctxt;
+  ippScanner *scanner;
+
+  int depth;
+  int seen_root;
+  /* Set once the root element is closed, nothing after it matters. */
+  int done;
+  int well_formed;
+
+  /* Element whose text is being collected. */
+  enum escl_element text_element;
+  char text[1024];
+  size_t text_len;
+
+  int duplex;
+  struct escl_set is;
+  struct escl_set cs;
+  struct escl_set pdl;
+  /* Document formats not in escl_document_formats, comma separated. */
+  char pdl_extra[512];
+  size_t pdl_extra_len;
+};
+
+static enum escl_element escl_lookup(const xmlChar *localname)
+{
+  const char *name = (const char *)localname;
+  size_t len = strlen(name);
+  if (len == 0)
+    return ESCL_NONE;
+
+  unsigned int h = ESCL_HASH(name, len);
+  if (escl_elements[h].name != NULL && !strcmp(escl_elements[h].name, name))
+    return escl_elements[h].element;
+  return ESCL_NONE;
+}
+
+static void escl_set_add(struct escl_set *set, int index)
+{
+  if (set->bits & (1u << index))
+    return;
+  set->bits |= 1u << index;
+  set->order[set->count++] = (uint8_t)index;
+}
+
+/* Joins the values in |set| (named by |names|, |stride| entries apart) and
+   |extra| with commas. Returns NULL for an empty result. */
+static char *escl_set_join(const struct escl_set *set, const char **names,
+                           int stride, const char *extra, size_t extra_len)
+{
+  size_t len = extra_len;
+  for (int i = 0; i < set->count; i++)
+    len += strlen(names[set->order[i] * stride]) + 1;
+  if (len == 0)
+    return NULL;
+
+  char *joined = malloc(len + 1);
+  if (joined == NULL)
+    return NULL;
+  char *p = joined;
+  for (int i = 0; i < set->count; i++) {
+    const char *name = names[set->order[i] * stride];
+    size_t n = strlen(name);
+    if (p != joined)
+      *p++ = ',';
+    memcpy(p, name, n);
+    p += n;
+  }
+  if (extra_len) {
+    if (p != joined)
+      *p++ = ',';
+    memcpy(p, extra, extra_len);
+    p += extra_len;
+  }
+  *p = '\0';
+  return joined;
+}
+
+static void escl_add_extra_format(struct escl_parser *parser,
+                                  const char *format, size_t len)
+{
+  const char *p = parser->pdl_extra;
+  const char *end = parser->pdl_extra + parser->pdl_extra_len;
+
+  while (p < end) {
+    const char *comma = memchr(p, ',', (size_t)(end - p));
+    size_t n = comma ? (size_t)(comma - p) : (size_t)(end - p);
+    if (n == len && !memcmp(p, format, len))
+      return;
+    p += n + 1;
+  }
+
+  size_t needed = len + (parser->pdl_extra_len ? 1 : 0);
+  if (parser->pdl_extra_len + needed >= sizeof(parser->pdl_extra))
+    return;
+  if (parser->pdl_extra_len)
+    parser->pdl_extra[parser->pdl_extra_len++] = ',';
+  memcpy(parser->pdl_extra + parser->pdl_extra_len, format, len);
+  parser->pdl_extra_len += len;
+}
+
+static void escl_set_string(char **field, const char *value)
+{
+  free(*field);
+  *field = strdup(value);
+}
+
+static void escl_text_done(struct escl_parser *parser)
+{
+  ippScanner *scanner = parser->scanner;
+  const char *text = parser->text;
+  size_t i;
+
+  switch (parser->text_element) {
+  case ESCL_VERSION:
+    escl_set_string(&scanner->vers, text);
+    break;
+  case ESCL_MAKE_AND_MODEL:
+    escl_set_string(&scanner->ty, text);
+    break;
+  case ESCL_UUID:
+    escl_set_string(&scanner->uuid, text);
+    break;
+  case ESCL_ADMIN_URI:
+    escl_set_string(&scanner->adminurl, text);
+    break;
+  case ESCL_ICON_URI:
+    escl_set_string(&scanner->representation, text);
+    break;
+  case ESCL_DOCUMENT_FORMAT:
+    for (i = 0; i < sizeof(escl_document_formats) /
+                    sizeof(escl_document_formats[0]); i++)
+      if (!strcmp(text, escl_document_formats[i]))
+        break;
+    if (i < sizeof(escl_document_formats) / sizeof(escl_document_formats[0]))
+      escl_set_add(&parser->pdl, (int)i);
+    else if (parser->text_len)
+      escl_add_extra_format(parser, text, parser->text_len);
+    break;
+  case ESCL_COLOR_MODE:
+    for (i = 0; i < sizeof(escl_color_modes) / sizeof(escl_color_modes[0]);
+         i++)
+      if (!strcmp(text, escl_color_modes[i][0])) {
+        escl_set_add(&parser->cs, (int)i);
+        break;
       }
-    }
+    break;
+  default:
+    break;
+  }
 }
 
-void afficher_noeud(xmlNodePtr noeud, ippScanner *ippscanner) {
-    if (is_array((const char*)noeud->name, ippscanner)) return;
-    if (noeud->type == XML_ELEMENT_NODE) {
-        xmlChar *chemin = xmlGetNodePath(noeud);
-        if (noeud->children != NULL && noeud->children->type == XML_TEXT_NODE) {
-            xmlChar *contenu = xmlNodeGetContent(noeud);
-	    if (noeud->name != NULL)
-              set_value_escl_scanner((const char*)noeud->name , (const char*)contenu, ippscanner);
-            xmlFree(contenu);
-        }
-        xmlFree(chemin);
-    }
+static void escl_start_element(void *ctx, const xmlChar *localname,
+                               const xmlChar *prefix, const xmlChar *URI,
+                               int nb_namespaces, const xmlChar **namespaces,
+                               int nb_attributes, int nb_defaulted,
+                               const xmlChar **attributes)
+{
+  struct escl_parser *parser = ctx;
+  (void)prefix; (void)URI; (void)nb_namespaces; (void)namespaces;
+  (void)nb_attributes; (void)nb_defaulted; (void)attributes;
+
+  parser->depth++;
+  parser->seen_root = 1;
+  parser->text_element = ESCL_NONE;
+
+  enum escl_element element = escl_lookup(localname);
+  switch (element) {
+  case ESCL_PLATEN:
+    escl_set_add(&parser->is, 0);
+    break;
+  case ESCL_ADF:
+    escl_set_add(&parser->is, 1);
+    break;
+  case ESCL_ADF_DUPLEX:
+    parser->duplex = 1;
+    break;
+  case ESCL_NONE:
+    break;
+  default:
+    parser->text_element = element;
+    parser->text_len = 0;
+    parser->text[0] = '\0';
+    break;
+  }
+}
+
+static void escl_end_element(void *ctx, const xmlChar *localname,
+                             const xmlChar *prefix, const xmlChar *URI)
+{
+  struct escl_parser *parser = ctx;
+  (void)prefix; (void)URI;
+
+  if (parser->text_element != ESCL_NONE) {
+    escl_text_done(parser);
+    parser->text_element = ESCL_NONE;
+  }
+
+  /* Everything the TXT record needs is known once the root element, or the
+     Adf element following the Platen one, is closed. Whatever comes after
+     is not looked at. */
+  if (--parser->depth == 0 ||
+      (escl_lookup(localname) == ESCL_ADF && (parser->is.bits & 1))) {
+    parser->done = 1;
+    parser->well_formed = parser->ctxt->wellFormed;
+    xmlStopParser(parser->ctxt);
+  }
+}
+
+static void escl_characters(void *ctx, const xmlChar *ch, int len)
+{
+  struct escl_parser *parser = ctx;
+  if (parser->text_element == ESCL_NONE || len <= 0)
+    return;
+
+  size_t n = (size_t)len;
+  if (n > sizeof(parser->text) - 1 - parser->text_len)
+    n = sizeof(parser->text) - 1 - parser->text_len;
+  memcpy(parser->text + parser->text_len, ch, n);
+  parser->text_len += n;
+  parser->text[parser->text_len] = '\0';
+}
+
+static xmlSAXHandler escl_sax = {
+  .initialized = XML_SAX2_MAGIC,
+  .startElementNs = escl_start_element,
+  .endElementNs = escl_end_element,
+  .characters = escl_characters,
+  .cdataBlock = escl_characters,
+};
+
+static int escl_parser_init(struct escl_parser *parser, ippScanner *scanner)
+{
+  memset(parser, 0, sizeof(*parser));
+  parser->scanner = scanner;
+  parser->ctxt = xmlCreatePushParserCtxt(&escl_sax, parser, NULL, 0,
+                                         "ScannerCapabilities.xml");
+  if (parser->ctxt == NULL) {
+    ERR("Failed to create XML parser");
+    return -1;
+  }
+  xmlCtxtUseOptions(parser->ctxt, XML_PARSE_NONET);
+  return 0;
+}
+
+static void escl_parser_feed(struct escl_parser *parser, const char *data,
+                             int size)
+{
+  if (parser->done || size <= 0)
+    return;
+  xmlParseChunk(parser->ctxt, data, size, 0);
+}
+
+/* Ends parsing and fills in the multi-valued keys. Returns 1 if a complete,
+   well-formed document has been parsed. */
+static int escl_parser_finish(struct escl_parser *parser)
+{
+  ippScanner *scanner = parser->scanner;
+  int status = 0;
+
+  if (!parser->done) {
+    xmlParseChunk(parser->ctxt, NULL, 0, 1);
+    parser->well_formed = parser->done && parser->ctxt->wellFormed;
+  }
+  xmlFreeParserCtxt(parser->ctxt);
+  parser->ctxt = NULL;
+
+  if (!parser->seen_root) {
+    NOTE("Document XML vierge\n");
+  } else if (!parser->well_formed) {
+    NOTE("Document XML invalide\n");
+  } else {
+    free(scanner->is);
+    scanner->is = escl_set_join(&parser->is, escl_input_sources, 1, NULL, 0);
+    free(scanner->cs);
+    scanner->cs = escl_set_join(&parser->cs, &escl_color_modes[0][1], 2,
+                                NULL, 0);
+    free(scanner->pdl);
+    scanner->pdl = escl_set_join(&parser->pdl, escl_document_formats, 1,
+                                 parser->pdl_extra, parser->pdl_extra_len);
+    if (!scanner->duplex)
+      scanner->duplex = strdup(parser->duplex ? "T" : "F");
+    status = 1;
+  }
+  return status;
 }
 
 static char *get_format(int x_dim_max, int y_dim_max)
@@ -183,141 +628,248 @@ static char *get_format(int x_dim_max, int y_dim_max)
 }
 
 
-char * get_format_paper(char *val)
-{
-   int x_dim_max = 0, x_dim = 0;
-   int y_dim_max = 0, y_dim = 0;
-   if (!val) return NULL;
-   
-   while ((val = strchr(val, '{'))) {
-		   val++;
-		   char test1[255] = { 0 };
-		   char test2[255] = { 0 };
-		   
-	       char *tmp = strchr(val, '=');
-	       if (!tmp) continue;
-		   int a = strlen(val) - strlen(tmp);
-		   val+=(a + 1);
-	       
-	       tmp = strchr(val, ' ');
-	       if (!tmp) continue;
-	       a = strlen(val) - strlen(tmp);
-	       strncpy(test2, val, a);
-	       if (strchr(test2, '-') == NULL)
-			   x_dim = atoi(test2);
-		   val+=(a + 1);
-		   
-		   memset(test1, 0, 255);
-		   memset(test2, 0, 255);
-	       if (!tmp) continue;
-		   tmp = strchr(val, '=');
-		   a = strlen(val) - strlen(tmp);
-		   val+=(a + 1);
-	       
-	       if (!tmp) continue;
-	       tmp = strchr(val, '}');
-	       a = strlen(val) - strlen(tmp);
-	       strncpy(test2, val, a);
-	       if (strchr(test2, '-') == NULL)
-			   y_dim = atoi(test2);
-			   
-		   if (x_dim_max < x_dim)
-		      x_dim_max = x_dim;
-		   if (y_dim_max < y_dim)
-		      y_dim_max = y_dim;
-		   val+=(a + 1);
-   }
-   return get_format(x_dim_max, y_dim_max);
+/* Attributes the DNS-SD TXT record is built from. Only these are requested
+   from the printer. */
+static const char * const printer_attributes[] = {
+  "color-supported",
+  "document-format-supported",
+  "media-size-supported",
+  "mopria-certified",
+  "printer-icons",
+  "printer-kind",
+  "printer-location",
+  "printer-make-and-model",
+  "printer-more-info",
+  "printer-uuid",
+  "sides-supported",
+  "urf-supported"
+};
+
+/* Returns the first string value of |name|, or NULL. */
+static const char *ipp_find_string(ipp_t *response, const char *name)
+{
+  ipp_attribute_t *attr = ippFindAttribute(response, name, IPP_TAG_ZERO);
+  if (attr == NULL)
+    return NULL;
+  return ippGetString(attr, 0, NULL);
+}
+
+static char *ipp_find_strdup(ipp_t *response, const char *name)
+{
+  const char *value = ipp_find_string(response, name);
+  return value ? strdup(value) : NULL;
+}
+
+/* Returns all string values of |name| joined with commas, or NULL. */
+static char *ipp_find_joined(ipp_t *response, const char *name)
+{
+  ipp_attribute_t *attr = ippFindAttribute(response, name, IPP_TAG_ZERO);
+  int count = attr ? ippGetCount(attr) : 0;
+  size_t len = 0;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    const char *value = ippGetString(attr, i, NULL);
+    if (value)
+      len += strlen(value) + 1;
+  }
+  if (len == 0)
+    return NULL;
+
+  char *joined = malloc(len);
+  if (joined == NULL)
+    return NULL;
+  char *p = joined;
+  for (i = 0; i < count; i++) {
+    const char *value = ippGetString(attr, i, NULL);
+    if (value == NULL)
+      continue;
+    size_t n = strlen(value);
+    if (p != joined)
+      *p++ = ',';
+    memcpy(p, value, n);
+    p += n;
+  }
+  *p = '\0';
+  return joined;
+}
+
+/* Largest media size in hundredths of millimeters, from the integer
+   x-dimension/y-dimension members of media-size-supported. Ranges, which
+   describe custom sizes, are skipped. */
+static char *ipp_find_papermax(ipp_t *response)
+{
+  ipp_attribute_t *attr = ippFindAttribute(response, "media-size-supported",
+                                           IPP_TAG_BEGIN_COLLECTION);
+  int count = attr ? ippGetCount(attr) : 0;
+  int x_dim_max = 0, y_dim_max = 0;
+
+  for (int i = 0; i < count; i++) {
+    ipp_t *size = ippGetCollection(attr, i);
+    ipp_attribute_t *x = ippFindAttribute(size, "x-dimension",
+                                          IPP_TAG_INTEGER);
+    ipp_attribute_t *y = ippFindAttribute(size, "y-dimension",
+                                          IPP_TAG_INTEGER);
+    if (x && ippGetInteger(x, 0) > x_dim_max)
+      x_dim_max = ippGetInteger(x, 0);
+    if (y && ippGetInteger(y, 0) > y_dim_max)
+      y_dim_max = ippGetInteger(y, 0);
+  }
+
+  return get_format(x_dim_max, y_dim_max);
 }
 
 int
-ipp_request(ippPrinter *printer, int port)
+ipp_parse_printer(ippPrinter *printer, ipp_t *response)
 {
-  http_t	*http = NULL; 
-  ipp_t *request, *response = NULL;
   ipp_attribute_t *attr;
-  char uri[1024];
-  char buffer[1024];
+  const char *value;
 
-  /* Try to connect to IPP server */
-  if ((http = httpConnect2("127.0.0.1", port, NULL, AF_UNSPEC,
-			   HTTP_ENCRYPTION_IF_REQUESTED, 1, 30000, NULL)) == NULL) {
-    printf("Unable to connect to 127.0.0.1 on port %d.\n", port);
+  if (response == NULL)
     return 1;
+
+  /* Bonjour wants a single icon URL */
+  printer->representation = ipp_find_strdup(response, "printer-icons");
+  if ((value = ipp_find_string(response, "printer-uuid")) != NULL)
+    printer->uuid = strdup(strncasecmp(value, "urn:uuid:", 9) ? value
+                                                              : value + 9);
+  printer->adminurl = ipp_find_strdup(response, "printer-more-info");
+  printer->mopria_certified = ipp_find_strdup(response, "mopria-certified");
+  printer->kind = ipp_find_joined(response, "printer-kind");
+  if ((attr = ippFindAttribute(response, "color-supported",
+                               IPP_TAG_BOOLEAN)) != NULL)
+    printer->color = strdup(ippGetBoolean(attr, 0) ? "T" : "F");
+  if ((attr = ippFindAttribute(response, "sides-supported",
+                               IPP_TAG_ZERO)) != NULL) {
+    const char *side = "U";
+    for (int i = 0; i < ippGetCount(attr); i++) {
+      value = ippGetString(attr, i, NULL);
+      if (value == NULL)
+        continue;
+      if (!strncasecmp(value, "two-", 4)) {
+        side = "T";
+        break;
+      }
+      if (!strncasecmp(value, "one-", 4))
+        side = "F";
+    }
+    printer->side = strdup(side);
   }
+  printer->note = ipp_find_strdup(response, "printer-location");
+  printer->ty = ipp_find_strdup(response, "printer-make-and-model");
+  printer->pdl = ipp_find_joined(response, "document-format-supported");
+  printer->urf = ipp_find_joined(response, "urf-supported");
+  printer->papermax = ipp_find_papermax(response);
+  return 0;
+}
+
+/* Sends a Get-Printer-Attributes request for |attributes| and returns the
+   decoded response, or NULL. */
+static ipp_t *
+ipp_get_attributes(struct usb_sock_t *usb, long long deadline,
+                   const char * const *attributes, int num_attributes)
+{
+  struct probe_channel chan;
+  struct probe_buffer request = { NULL, 0, 0, 0, 0 };
+  struct probe_buffer response = { NULL, 0, 0, 0, 0 };
+  ipp_t *ipp = NULL;
+  char uri[1024];
+  int status = -1;
 
-  snprintf(uri, sizeof(uri), "http://127.0.0.1:%d/ipp/print", port);
+  snprintf(uri, sizeof(uri), "http://localhost:%d/ipp/print",
+           g_options.real_port);
 
   /* Fire a Get-Printer-Attributes request */
-  request = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
-  ippAddString(request, IPP_TAG_OPERATION, IPP_TAG_URI, "printer-uri",
+  ipp = ippNewRequest(IPP_OP_GET_PRINTER_ATTRIBUTES);
+  ippAddString(ipp, IPP_TAG_OPERATION, IPP_TAG_URI, "printer-uri",
 	             NULL, uri);
-  response = cupsDoRequest(http, request, "/ipp/print");
-
-  /* Print the attributes received from the IPP printer */
-  attr = ippFirstAttribute(response);
-  while (attr) {
-    /* Convert IPP attribute's value to string */
-    ippAttributeString(attr, buffer, sizeof(buffer));
-    char *attr_name = (char*)ippGetName(attr);
-    if (!attr_name) continue;
-    if (!strcasecmp(attr_name, "printer-icons"))
-       printer->representation = strdup(buffer);
-    else if(!strcasecmp(attr_name, "printer-uuid"))
-       printer->uuid = strdup(buffer + 9);
-    else if(!strcasecmp(attr_name, "printer-more-info"))
-       printer->adminurl = strdup(buffer);
-    else if(!strcasecmp(attr_name, "mopria-certified"))
-       printer->mopria_certified = strdup(buffer);
-    else if(!strcasecmp(attr_name, "printer-kind"))
-       printer->kind = strdup(buffer);
-    else if(!strcasecmp(attr_name, "color-supported")) {
-       if(!strcasecmp(buffer, "true"))
-           printer->color = strdup("T");
-       else
-           printer->color = strdup("F");
-    }
-    else if(!strcasecmp(attr_name, "sides-supported")) {
-       if(strcasestr(buffer, "two-"))
-           printer->side = strdup("T");
-       else if(strcasestr(buffer, "one-"))
-           printer->side = strdup("F");
-       else
-           printer->side = strdup("U");
-    }
-    else if(!strcasecmp(attr_name, "printer-location"))
-       printer->note = strdup(buffer);
-    else if(!strcasecmp(attr_name, "printer-make-and-model"))
-       printer->ty = strdup(buffer);
-    else if(!strcasecmp(attr_name, "document-format-supported"))
-       printer->pdl = strdup(buffer);
-    else if(!strcasecmp(attr_name, "urf-supported"))
-       printer->urf = strdup(buffer);
-    else if(!strcasecmp(attr_name, "media-size-supported"))
-       printer->papermax = get_format_paper(buffer);
-    /* next attribute */
-    attr = ippNextAttribute(response);
+  ippAddStrings(ipp, IPP_TAG_OPERATION, IPP_TAG_KEYWORD,
+                "requested-attributes", num_attributes, NULL, attributes);
+  if (ippWriteIO(&request, probe_buffer_write, 1, NULL, ipp) !=
+      IPP_STATE_DATA) {
+    ERR("Probe: Failed to encode Get-Printer-Attributes request");
+    goto cleanup;
   }
-  if (!strcasecmp(httpGetField(http, HTTP_FIELD_CONNECTION), "close"))
-  {
-      httpClearFields(http);
-      if (httpReconnect2(http, 30000, NULL))
-      {
-          goto close_http;
-      }
+  ippDelete(ipp);
+  ipp = NULL;
+
+  if (probe_open(&chan, usb, deadline)) {
+    ERR("Probe: No USB interface for Get-Printer-Attributes");
+    goto cleanup;
+  }
+  if (probe_send(&chan, "POST", "/ipp/print", "application/ipp",
+                 request.data, request.size) == 0)
+    status = probe_receive(&chan, 0, probe_buffer_append, &response, NULL);
+  probe_close(&chan);
+
+  if (status != 200 || response.failed) {
+    NOTE("Get-Printer-Attributes failed with status %d", status);
+    goto cleanup;
   }
-  httpClearFields(http);
-  httpSetField(http, HTTP_FIELD_AUTHORIZATION, httpGetAuthString(http));
-  httpSetField(http, HTTP_FIELD_ACCEPT_LANGUAGE, "en");
-  if (!httpHead(http, "/ipp/faxout"))
-  {
-    printer->fax = strdup("T");
+
+  ipp = ippNew();
+  if (ippReadIO(&response, probe_buffer_read, 1, NULL, ipp) != IPP_STATE_DATA) {
+    NOTE("Get-Printer-Attributes returned no valid IPP response");
+    ippDelete(ipp);
+    ipp = NULL;
   }
-close_http:
-  httpClose(http);
+
+ cleanup:
+  free(request.data);
+  free(response.data);
+  return ipp;
+}
+
+int
+ipp_request(ippPrinter *printer, struct usb_sock_t *usb, long long deadline)
+{
+  ipp_t *response = ipp_get_attributes(
+      usb, deadline, printer_attributes,
+      sizeof(printer_attributes) / sizeof(printer_attributes[0]));
+
+  if (response == NULL)
+    return 1;
+  ipp_parse_printer(printer, response);
+  ippDelete(response);
   return 0;
 }
 
+long
+ipp_config_change_time(struct usb_sock_t *usb, long long deadline)
+{
+  static const char * const attributes[] = { "printer-config-change-time" };
+  ipp_attribute_t *attr;
+  long value = -1;
+  ipp_t *response = ipp_get_attributes(usb, deadline, attributes, 1);
+
+  if (response == NULL)
+    return -1;
+  if ((attr = ippFindAttribute(response, "printer-config-change-time",
+                               IPP_TAG_INTEGER)) != NULL)
+    value = ippGetInteger(attr, 0);
+  ippDelete(response);
+  return value;
+}
+
+int
+ipp_fax_request(struct usb_sock_t *usb, long long deadline)
+{
+  struct probe_channel chan;
+  int status = -1;
+
+  if (probe_open(&chan, usb, deadline)) {
+    ERR("Probe: No USB interface for the fax queue check");
+    return -1;
+  }
+  if (probe_send(&chan, "HEAD", "/ipp/faxout", NULL, NULL, 0) == 0)
+    status = probe_receive(&chan, 1, NULL, NULL, NULL);
+  probe_close(&chan);
+
+  if (status < 0)
+    return -1;
+  return status == 200;
+}
+
 ippPrinter *
 free_printer(ippPrinter *printer)
 {
@@ -339,190 +891,88 @@ free_printer(ippPrinter *printer)
    return NULL;
 }
 
-static char *
-http_request(const char *hostname, const char *ressource, int port, int *size_data)
-{
-  http_t	*http = NULL;		/* HTTP connection */
-  http_status_t	status = HTTP_STATUS_OK;			/* Status of GET command */
-  char		buffer[SIZE_DATA] = { 0 };		/* Input buffer */
-  long		bytes;			/* Number of bytes read */
-  off_t		total;		        /* Total bytes */
-  const char	*encoding;		/* Negotiated Content-Encoding */
-  char *memory = (char*)calloc(1, sizeof (char));
-  char *tmp = NULL;
-//////////////////////////////////////////////////////////////////////////////////////////////////////:
-
-
-    http = httpConnect2(hostname, port, NULL, AF_UNSPEC, HTTP_ENCRYPTION_IF_REQUESTED, 1, 30000, NULL);
-    if (http == NULL)
-    {
-      perror(hostname);
-      return 0;
-    }
-
-    NOTE("Checking file \"%s\"...\n", ressource);
-
-    do
-    {
-      if (!strcasecmp(httpGetField(http, HTTP_FIELD_CONNECTION), "close"))
-      {
-	httpClearFields(http);
-	if (httpReconnect2(http, 30000, NULL))
-	{
-          status = HTTP_STATUS_ERROR;
-          break;
-	}
-      }
-
-      httpClearFields(http);
-      httpSetField(http, HTTP_FIELD_AUTHORIZATION, httpGetAuthString(http));
-      httpSetField(http, HTTP_FIELD_ACCEPT_LANGUAGE, "en");
-      if (httpHead(http, ressource))
-      {
-        if (httpReconnect2(http, 30000, NULL))
-        {
-          status = HTTP_STATUS_ERROR;
-          break;
-        }
-      }
-
-      while ((status = httpUpdate(http)) == HTTP_STATUS_CONTINUE);
-
-      if (status == HTTP_STATUS_UNAUTHORIZED)
-      {
-       /*
-	* Flush any error message...
-	*/
-
-	httpFlush(http);
-
-       /*
-	* See if we can do authentication...
-	*/
-
-	if (cupsDoAuthentication(http, "GET", ressource))
-	{
-	  status = HTTP_STATUS_CUPS_AUTHORIZATION_CANCELED;
-	  break;
-	}
+struct escl_sink {
+  struct escl_parser *parser;
+  int started;
+  long total;
+};
 
-	if (httpReconnect2(http, 30000, NULL))
-	{
-	  status = HTTP_STATUS_ERROR;
-	  break;
-	}
+/* Some printers send junk ahead of the document, it starts at the first
+   '<'. */
+static void
+escl_sink_feed(void *ctx, const uint8_t *data, size_t len)
+{
+  struct escl_sink *sink = ctx;
+  const uint8_t *start = data;
+
+  if (!sink->started) {
+    start = memchr(data, '<', len);
+    if (start == NULL)
+      return;
+    len -= (size_t)(start - data);
+    sink->started = 1;
+  }
+  sink->total += (long)len;
+  escl_parser_feed(sink->parser, (const char *)start, (int)len);
+}
 
-        return 0;
-      }
-    }
-    while (status == HTTP_STATUS_UNAUTHORIZED ||
-           status == HTTP_STATUS_UPGRADE_REQUIRED);
-
-    if (status != HTTP_STATUS_OK)
-      NOTE("HEAD failed with status %d...\n", status);
-
-    encoding = httpGetContentEncoding(http);
-
-    NOTE("Requesting file \"%s\" (Accept-Encoding: %s)...\n", ressource,
-           encoding ? encoding : "identity");
-
-    do
-    {
-      if (!strcasecmp(httpGetField(http, HTTP_FIELD_CONNECTION), "close"))
-      {
-	httpClearFields(http);
-	if (httpReconnect2(http, 30000, NULL))
-	{
-          status = HTTP_STATUS_ERROR;
-          break;
-	}
-      }
+/* Fetches |ressource| and feeds the body to |parser| as it arrives. The
+   parser stops as soon as it has seen what it needs, the rest of the body is
+   drained without being looked at. Returns 0 if the document could be
+   requested. */
+static int
+http_request(const char *ressource, struct usb_sock_t *usb,
+             struct escl_parser *parser, long long deadline)
+{
+  struct probe_channel chan;
+  struct escl_sink sink = { parser, 0, 0 };
+  int status = -1;
 
-      httpClearFields(http);
-      httpSetField(http, HTTP_FIELD_AUTHORIZATION, httpGetAuthString(http));
-      httpSetField(http, HTTP_FIELD_ACCEPT_LANGUAGE, "en");
-      httpSetField(http, HTTP_FIELD_ACCEPT_ENCODING, encoding);
-
-      if (httpGet(http, ressource))
-      {
-        if (httpReconnect2(http, 30000, NULL))
-        {
-          status = HTTP_STATUS_ERROR;
-          break;
-        }
-      }
+  if (probe_open(&chan, usb, deadline)) {
+    ERR("Probe: No USB interface for \"%s\"", ressource);
+    return -1;
+  }
 
-      while ((status = httpUpdate(http)) == HTTP_STATUS_CONTINUE);
+  NOTE("Requesting file \"%s\"...", ressource);
+  if (probe_send(&chan, "GET", ressource, NULL, NULL, 0) == 0)
+    status = probe_receive(&chan, 0, escl_sink_feed, &sink, &parser->done);
+  probe_close(&chan);
 
-    }
-    while (status == HTTP_STATUS_UNAUTHORIZED || status == HTTP_STATUS_UPGRADE_REQUIRED);
+  if (status != 200) {
+    NOTE("GET failed with status %d...", status);
+    return -1;
+  }
+  NOTE("Parsed %ld bytes of \"%s\"%s", sink.total, ressource,
+       parser->done ? "" : " (incomplete)");
+  return 0;
+}
 
-    if (status != HTTP_STATUS_OK) {
-      NOTE("GET failed with status %d...\n", status);
-      return NULL;
-    }
+int
+escl_parse_scanner(ippScanner *scanner, const char *xml, int size)
+{
+    struct escl_parser parser;
 
-  total = 0;
-  while ((bytes = httpRead2(http, buffer, (SIZE_DATA - 1))) > 0)
-  {
-    char *str = realloc(memory, total + bytes + 1);
-    memory = str;
-    memcpy(&(memory[total]), buffer, bytes);
-    total += bytes;
-    memory[total] = 0;
-    memset(buffer, 0, SIZE_DATA);
-  }
-  tmp = (char *)strstr(memory, "<?xml version");
-  if (tmp)
-  {
-     char *tmp2 = NULL;
-     total = strlen(tmp);
-     tmp2 = strrchr(tmp, '>');
-     if (tmp2)
-     {
-       int len = total - strlen(tmp2);
-       tmp[len + 1] = 0;
-       tmp2 = strdup(tmp);
-       free(memory);
-       memory = tmp2;
-       total = strlen(memory);
-     }
-  }
-  *size_data = total;
-  httpClose(http);
-  return memory;
+    if (xml == NULL) return 0;
+    if (escl_parser_init(&parser, scanner)) return 0;
+    escl_parser_feed(&parser, xml, size);
+    return escl_parser_finish(&parser);
 }
 
 int
-is_scanner_present(ippScanner *scanner, int port) {
-    xmlDocPtr doc;
-    xmlNodePtr racine;
-    int size = 0;
+is_scanner_present(ippScanner *scanner, struct usb_sock_t *usb,
+                   long long deadline) {
+    struct escl_parser parser;
     NOTE("is_scanner_present");
     if (!scanner) return 0;
     NOTE("go is_scanner_present");
 
-    char *memory = http_request("127.0.0.1", "/eSCL/ScannerCapabilities", port, &size);
-    NOTE("Capabilites[\n%s\n]\n", memory);
-    // Ouverture du fichier XML
-    doc = xmlReadMemory(memory, size, "ScannerCapabilities.xml", NULL, 0); //xmlParseFile("ScannerCapabilities.xml");
-    if (doc == NULL) {
-        NOTE("Document XML invalide\n");
-        return 0; 
-    }
-    // Récupération de la racine
-    racine = xmlDocGetRootElement(doc);
-    if (racine == NULL) {
-        NOTE("Document XML vierge\n");
-        xmlFreeDoc(doc);
+    if (escl_parser_init(&parser, scanner)) return 0;
+    int fetched = http_request("/eSCL/ScannerCapabilities", usb, &parser,
+                               deadline);
+    if (!escl_parser_finish(&parser) || fetched != 0)
         return 0;
-    }
-    // Parcours
-    parcours_prefixe(racine, afficher_noeud, scanner);
-    if (!scanner->duplex) scanner->duplex = strdup("F");
     NOTE("txt = [\n\"representation=%s\"\n\"note=\"\n\"UUID=%s\"\n\"adminurl=%s\"\n\"duplex=%s\"\n\"is=%s\"\n\"cs=%s\"\n\"pdl=%s\"\n\"ty=%s\"\n\"rs=eSCL\"\n\"vers=%s\"\n\"txtvers=1\"\n]",
          scanner->representation, scanner->uuid, scanner->adminurl, scanner->duplex, scanner->is, scanner->cs, scanner->pdl, scanner->ty, scanner->vers);
-    xmlFreeDoc(doc);
 
     return 1;
 }
@@ -1,6 +1,10 @@
 #ifndef __CAPABILITIES_H__
 #define __CAPABILITIES_H__
 
+#include <cups/cups.h>
+
+struct usb_sock_t;
+
 typedef struct {
   char *representation;
   char *uuid;
@@ -29,9 +33,28 @@ typedef struct {
   char *fax;
 } ippPrinter;
 
-int is_scanner_present(ippScanner *scanner, int port);
+/* The probes talk to the printer on an interface leased from |usb| and give
+   up once the probe_clock() time |deadline|, in milliseconds, has passed. */
+long long probe_clock(void);
+
+/* Fill |scanner| from the eSCL ScannerCapabilities document |xml| of |size|
+   bytes. Returns 1 if the document could be parsed. */
+int escl_parse_scanner(ippScanner *scanner, const char *xml, int size);
+int is_scanner_present(ippScanner *scanner, struct usb_sock_t *usb,
+                       long long deadline);
 ippScanner *free_scanner(ippScanner *scanner);
-int ipp_request(ippPrinter *printer, int port);
+/* Fill |printer| from a Get-Printer-Attributes |response|. Returns 0 on
+   success. */
+int ipp_parse_printer(ippPrinter *printer, ipp_t *response);
+int ipp_request(ippPrinter *printer, struct usb_sock_t *usb,
+                long long deadline);
+/* HEAD request on the printer's fax queue. Returns 1 if the printer has one,
+   0 if not and -1 if it could not be asked. */
+int ipp_fax_request(struct usb_sock_t *usb, long long deadline);
+/* Asks for just printer-config-change-time, a cheap way of telling whether
+   the attributes above may have changed. Returns -1 if the printer does not
+   report it. */
+long ipp_config_change_time(struct usb_sock_t *usb, long long deadline);
 ippPrinter *free_printer(ippPrinter *printer);
 
 #endif
@@ -16,14 +16,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <net/if.h>
+#include <pthread.h>
 
 #include "dnssd.h"
 #include "logging.h"
 #include "options.h"
 #include "capabilities.h"
+#include "status.h"
 
+static void dnssd_probe_stop(void);
 
 
 /*
@@ -193,8 +197,15 @@ int dnssd_init()
 
 void dnssd_shutdown()
 {
+  if (g_options.dnssd_data == NULL)
+    return;
+
   if (g_options.dnssd_data->DNSSDMaster) {
+    /* No registration starts new probes once the poll stopped. The
+       running ones publish nothing more and give up on the printer as
+       soon as they see the termination flag. */
     avahi_threaded_poll_stop(g_options.dnssd_data->DNSSDMaster);
+    dnssd_probe_stop();
     dnssd_unregister();
   }
 
@@ -209,25 +220,17 @@ void dnssd_shutdown()
   }
 
   free(g_options.dnssd_data);
+  g_options.dnssd_data = NULL;
   NOTE("DNS-SD shut down.");
 }
 
-void * dnssd_escl_register(void *data)
+AvahiStringList *dnssd_printer_txt(AvahiStringList *ipp_txt,
+                                   ippPrinter *printer, const char *adminurl)
 {
-  AvahiStringList *uscan_txt;             /* DNS-SD USCAN TXT record */
-  AvahiStringList *ipp_txt;             /* DNS-SD USCAN TXT record */
-  ippScanner      *scanner = NULL;
-  int             error;
-  char            temp[256];            /* Subtype service string */
- 
-  ipp_txt = (AvahiStringList *)data;
-
-  ippPrinter *printer = (ippPrinter *)calloc(1, sizeof(ippPrinter));
-  ipp_request(printer, g_options.real_port);
   if (printer->adminurl)
     ipp_txt = avahi_string_list_add_printf(ipp_txt, "adminurl=%s", printer->adminurl);
   else
-    ipp_txt = avahi_string_list_add_printf(ipp_txt, "adminurl=%s", temp);
+    ipp_txt = avahi_string_list_add_printf(ipp_txt, "adminurl=%s", adminurl);
   if (printer->uuid)
     ipp_txt = avahi_string_list_add_printf(ipp_txt, "UUID=%s", printer->uuid);
   if (printer->mopria_certified)
@@ -258,33 +261,14 @@ void * dnssd_escl_register(void *data)
   }
   else
     ipp_txt = avahi_string_list_add_printf(ipp_txt, "Fax=F");
+  return ipp_txt;
+}
 
-  NOTE("Printer TXT[\n\tadminurl=%s\n\tUUID=%s\t\n]\n", printer->adminurl, printer->uuid);
-
- /*
-  * Then register the _ipp._tcp (IPP)...
-  */
-  error = avahi_entry_group_update_service_txt_strlst(
-      g_options.dnssd_data->ipp_ref,
-      (g_options.interface ? (int)if_nametoindex(g_options.interface)
-                           : AVAHI_IF_UNSPEC),
-      AVAHI_PROTO_UNSPEC, 0, g_options.dnssd_data->dnssd_name, "_ipp._tcp", NULL, ipp_txt);
-
-  if (error) {
-    ERR("Error registering %s as IPP printer (_ipp._tcp): %d", g_options.dnssd_data->dnssd_name,
-	error);
-  }
-  avahi_entry_group_commit(g_options.dnssd_data->ipp_ref);
-  avahi_string_list_free(ipp_txt);
+AvahiStringList *dnssd_scanner_txt(ippScanner *scanner, ippPrinter *printer,
+                                   const char *adminurl)
+{
+  AvahiStringList *uscan_txt = NULL;
 
-  snprintf(temp, sizeof(temp), "http://127.0.0.1:%d/", g_options.real_port);
-  scanner = (ippScanner*) calloc(1, sizeof(ippScanner));
-  if (is_scanner_present(scanner, g_options.real_port) == 0 || scanner == NULL)
-     goto noscanner;
-  /*
-   * Create the TXT record for scanner ...
-   */
-  uscan_txt = NULL;
   if (scanner->representation)
      uscan_txt = avahi_string_list_add_printf(uscan_txt, "representation=%s", scanner->representation);
   else if (printer->representation)
@@ -299,7 +283,7 @@ void * dnssd_escl_register(void *data)
   else if (printer->adminurl)
      uscan_txt = avahi_string_list_add_printf(uscan_txt, "adminurl=%s", printer->adminurl);
   else
-     uscan_txt = avahi_string_list_add_printf(uscan_txt, "adminurl=%s", temp);
+     uscan_txt = avahi_string_list_add_printf(uscan_txt, "adminurl=%s", adminurl);
   uscan_txt = avahi_string_list_add_printf(uscan_txt, "duplex=%s", scanner->duplex);
   uscan_txt = avahi_string_list_add_printf(uscan_txt, "cs=%s", scanner->cs);
   uscan_txt = avahi_string_list_add_printf(uscan_txt, "pdl=%s", scanner->pdl);
@@ -307,14 +291,215 @@ void * dnssd_escl_register(void *data)
   uscan_txt = avahi_string_list_add_printf(uscan_txt, "rs=eSCL");
   uscan_txt = avahi_string_list_add_printf(uscan_txt, "vers=%s", scanner->vers);
   uscan_txt = avahi_string_list_add_printf(uscan_txt, "txtvers=1");
+  return uscan_txt;
+}
+
+/* Capability probing ==-------------------------------------------------== */
+
+/* The IPP, fax and eSCL probes each lease a USB interface of their own, so
+   with enough interfaces they run in parallel and the printer is fully
+   advertised after the slowest of them rather than after all of them in
+   turn. Every result is published as soon as it comes in. The state is
+   shared by the probe threads and freed by the last one to finish. */
+
+/* Overall time the probes get, in milliseconds */
+#define DNSSD_PROBE_TIMEOUT 30000
+
+/* Afterwards printer-config-change-time is polled every
+   DNSSD_REFRESH_INTERVAL seconds and everything is probed again when it
+   changes. Printers which do not report it are probed again every
+   DNSSD_REFRESH_FULL_EVERY polls. The records are only touched when their
+   contents changed, so a refresh that finds nothing new causes no mDNS
+   traffic. */
+#define DNSSD_REFRESH_INTERVAL 300
+#define DNSSD_REFRESH_FULL_EVERY 12
+
+/* Bumped for every registration and when it is withdrawn, probes of older
+   ones publish nothing and their refreshers stop. Only changed with
+   __sync builtins. */
+static int dnssd_generation = 0;
+
+/* Probe threads still running, dnssd_shutdown() waits for them before
+   the DNS-SD state and the USB device they use go away. */
+static pthread_mutex_t dnssd_probe_threads_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dnssd_probe_threads_done = PTHREAD_COND_INITIALIZER;
+static int dnssd_probe_threads = 0;
+
+struct dnssd_probe {
+  pthread_mutex_t lock;
+  int refs;
+  long long deadline;
+  char adminurl[256];
+  /* Base _ipp._tcp TXT record built from the device ID */
+  AvahiStringList *ipp_txt;
+  /* NULL until the respective probe finished */
+  ippPrinter *printer;
+  ippScanner *scanner;
+  /* -1 until the fax probe finished */
+  int fax;
+  /* Initial probes still running, |settled| is signalled once they are
+     done */
+  int pending;
+  pthread_cond_t settled;
+  int ipp_committed;
+  int uscan_registered;
+  /* Hashes of the TXT records last handed to Avahi */
+  uint32_t ipp_hash;
+  uint32_t uscan_hash;
+  int generation;
+};
+
+/* FNV-1a over the strings of |txt| */
+static uint32_t dnssd_txt_hash(AvahiStringList *txt)
+{
+  uint32_t hash = 2166136261u;
+
+  for (; txt != NULL; txt = avahi_string_list_get_next(txt)) {
+    const uint8_t *text = avahi_string_list_get_text(txt);
+    size_t size = avahi_string_list_get_size(txt);
+    for (size_t i = 0; i < size; i++)
+      hash = (hash ^ text[i]) * 16777619u;
+    /* Keeps "ab","c" apart from "a","bc" */
+    hash = (hash ^ 0xff) * 16777619u;
+  }
+  return hash;
+}
+
+static void dnssd_probe_unref(struct dnssd_probe *probe)
+{
+  int refs;
 
+  pthread_mutex_lock(&probe->lock);
+  refs = --probe->refs;
+  pthread_mutex_unlock(&probe->lock);
+  if (refs > 0)
+    return;
+
+  avahi_string_list_free(probe->ipp_txt);
+  free_printer(probe->printer);
+  free_scanner(probe->scanner);
+  pthread_cond_destroy(&probe->settled);
+  pthread_mutex_destroy(&probe->lock);
+  free(probe);
+}
+
+/* Adds |delta| to the number of running probe threads. */
+static void dnssd_probe_threads_add(int delta)
+{
+  pthread_mutex_lock(&dnssd_probe_threads_lock);
+  dnssd_probe_threads += delta;
+  if (dnssd_probe_threads == 0)
+    pthread_cond_broadcast(&dnssd_probe_threads_done);
+  pthread_mutex_unlock(&dnssd_probe_threads_lock);
+}
+
+/* Withdraws the current probes and waits until every probe thread has
+   finished. */
+static void dnssd_probe_stop(void)
+{
+  __sync_add_and_fetch(&dnssd_generation, 1);
+  pthread_mutex_lock(&dnssd_probe_threads_lock);
+  while (dnssd_probe_threads > 0)
+    pthread_cond_wait(&dnssd_probe_threads_done, &dnssd_probe_threads_lock);
+  pthread_mutex_unlock(&dnssd_probe_threads_lock);
+}
+
+/* Returns non-zero if |probe| belongs to the current registration. */
+static int dnssd_probe_current(const struct dnssd_probe *probe)
+{
+  return probe->generation == __sync_fetch_and_add(&dnssd_generation, 0);
+}
+
+/* Called with the probe and the Avahi poll locked. */
+static void dnssd_publish_ipp(struct dnssd_probe *probe)
+{
+  AvahiStringList *ipp_txt;
+  ippPrinter       printer = { 0 };
+  uint32_t         hash;
+  int              error;
+
+  /* The entry groups of an older registration may be gone already */
+  if (!dnssd_probe_current(probe) || g_options.dnssd_data->ipp_ref == NULL)
+    return;
+
+  if (probe->printer)
+    printer = *probe->printer;
+  printer.fax = (probe->fax == 1 ? "T" : NULL);
+  ipp_txt = dnssd_printer_txt(avahi_string_list_copy(probe->ipp_txt),
+                              &printer, probe->adminurl);
+
+  hash = dnssd_txt_hash(ipp_txt);
+  if (probe->ipp_committed && hash == probe->ipp_hash) {
+    avahi_string_list_free(ipp_txt);
+    return;
+  }
+
+  NOTE("Printer TXT[\n\tadminurl=%s\n\tUUID=%s\t\n]\n", printer.adminurl,
+       printer.uuid);
+
+  error = avahi_entry_group_update_service_txt_strlst(
+      g_options.dnssd_data->ipp_ref,
+      (g_options.interface ? (int)if_nametoindex(g_options.interface)
+                           : AVAHI_IF_UNSPEC),
+      AVAHI_PROTO_UNSPEC, 0, g_options.dnssd_data->dnssd_name, "_ipp._tcp",
+      NULL, ipp_txt);
+  if (error)
+    ERR("Error registering %s as IPP printer (_ipp._tcp): %d",
+        g_options.dnssd_data->dnssd_name, error);
+  else
+    probe->ipp_hash = hash;
+
+  if (!probe->ipp_committed) {
+    avahi_entry_group_commit(g_options.dnssd_data->ipp_ref);
+    probe->ipp_committed = 1;
+    status_phase_end(STATUS_PHASE_ADVERTISED);
+  }
+  avahi_string_list_free(ipp_txt);
+}
+
+/* Called with the probe and the Avahi poll locked. */
+static void dnssd_publish_uscan(struct dnssd_probe *probe)
+{
+  AvahiStringList *uscan_txt;
+  ippPrinter       printer = { 0 };
+  uint32_t         hash;
+  int              error;
+
+  if (!dnssd_probe_current(probe))
+    return;
+
+  if (probe->printer)
+    printer = *probe->printer;
+  uscan_txt = dnssd_scanner_txt(probe->scanner, &printer, probe->adminurl);
+  hash = dnssd_txt_hash(uscan_txt);
+
+  if (probe->uscan_registered) {
+    if (hash == probe->uscan_hash ||
+        g_options.dnssd_data->uscan_ref == NULL) {
+      avahi_string_list_free(uscan_txt);
+      return;
+    }
+    error = avahi_entry_group_update_service_txt_strlst(
+        g_options.dnssd_data->uscan_ref,
+        (g_options.interface ? (int)if_nametoindex(g_options.interface)
+                             : AVAHI_IF_UNSPEC),
+        AVAHI_PROTO_UNSPEC, 0, g_options.dnssd_data->dnssd_name,
+        "_uscan._tcp", NULL, uscan_txt);
+    if (error)
+      ERR("Error updating %s as Unix scanner (_uscan._tcp): %d",
+          probe->scanner->ty, error);
+    else
+      probe->uscan_hash = hash;
+    avahi_string_list_free(uscan_txt);
+    return;
+  }
 
  /*
-  * Register _uscan._tcp (LPD) with port 0 to reserve the service name...
+  * Register _uscan._tcp ...
   */
 
   NOTE("Registering scanner %s on interface %s for DNS-SD broadcasting ...",
-       scanner->ty, g_options.interface);
+       probe->scanner->ty, g_options.interface);
 
   if (g_options.dnssd_data->uscan_ref == NULL)
     g_options.dnssd_data->uscan_ref =
@@ -324,8 +509,7 @@ void * dnssd_escl_register(void *data)
   if (g_options.dnssd_data->uscan_ref == NULL) {
     ERR("Could not establish Avahi entry group");
     avahi_string_list_free(uscan_txt);
-    scanner = free_scanner(scanner);
-    goto noscanner;
+    return;
   }
 
   error =
@@ -338,23 +522,254 @@ void * dnssd_escl_register(void *data)
 					 "_uscan._tcp", NULL, NULL,
 					 g_options.real_port, uscan_txt);
   if (error) {
-    ERR("Error registering %s as Unix scanner (_uscan._tcp): %d", scanner->ty,
-	error);
+    ERR("Error registering %s as Unix scanner (_uscan._tcp): %d",
+        probe->scanner->ty, error);
+  } else {
+    NOTE("Registered %s as Unix scanner (_uscan._tcp).", probe->scanner->ty);
+    avahi_entry_group_commit(g_options.dnssd_data->uscan_ref);
+    probe->uscan_registered = 1;
+    probe->uscan_hash = hash;
+  }
+  avahi_string_list_free(uscan_txt);
+}
+
+static void dnssd_probe_lock(struct dnssd_probe *probe)
+{
+  pthread_mutex_lock(&probe->lock);
+  avahi_threaded_poll_lock(g_options.dnssd_data->DNSSDMaster);
+}
+
+static void dnssd_probe_unlock(struct dnssd_probe *probe)
+{
+  avahi_threaded_poll_unlock(g_options.dnssd_data->DNSSDMaster);
+  pthread_mutex_unlock(&probe->lock);
+}
+
+/* Called with the probe locked when one of the initial probes finished. */
+static void dnssd_probe_done(struct dnssd_probe *probe)
+{
+  if (--probe->pending == 0) {
+    status_ready();
+    pthread_cond_broadcast(&probe->settled);
+  }
+}
+
+static void *dnssd_probe_ipp(void *data)
+{
+  struct dnssd_probe *probe = data;
+  ippPrinter *printer = calloc(1, sizeof(ippPrinter));
+
+  status_phase_begin(STATUS_PHASE_IPP_PROBE);
+  if (printer != NULL)
+    ipp_request(printer, g_options.usb_sock, probe->deadline);
+  status_phase_end(STATUS_PHASE_IPP_PROBE);
+
+  dnssd_probe_lock(probe);
+  probe->printer = printer;
+  dnssd_publish_ipp(probe);
+  /* The scanner TXT falls back to the printer's values */
+  if (probe->uscan_registered)
+    dnssd_publish_uscan(probe);
+  dnssd_probe_done(probe);
+  dnssd_probe_unlock(probe);
+
+  dnssd_probe_unref(probe);
+  dnssd_probe_threads_add(-1);
+  return NULL;
+}
+
+static void *dnssd_probe_fax(void *data)
+{
+  struct dnssd_probe *probe = data;
+  int fax;
+
+  status_phase_begin(STATUS_PHASE_FAX_PROBE);
+  fax = ipp_fax_request(g_options.usb_sock, probe->deadline);
+  status_phase_end(STATUS_PHASE_FAX_PROBE);
+
+  dnssd_probe_lock(probe);
+  probe->fax = (fax == 1);
+  /* Until the IPP probe is done the _ipp._tcp record is not committed yet,
+     it then picks up the fax result. */
+  if (probe->ipp_committed && probe->fax)
+    dnssd_publish_ipp(probe);
+  dnssd_probe_done(probe);
+  dnssd_probe_unlock(probe);
+
+  dnssd_probe_unref(probe);
+  dnssd_probe_threads_add(-1);
+  return NULL;
+}
+
+static void *dnssd_probe_escl(void *data)
+{
+  struct dnssd_probe *probe = data;
+  ippScanner *scanner = calloc(1, sizeof(ippScanner));
+
+  status_phase_begin(STATUS_PHASE_ESCL_PROBE);
+  if (scanner != NULL &&
+      !is_scanner_present(scanner, g_options.usb_sock, probe->deadline)) {
+    NOTE("No eSCL scanner found");
     scanner = free_scanner(scanner);
-    goto noscanner;
-  }else
-    NOTE("Registered %s as Unix scanner (_uscan._tcp).", scanner->ty);
+  }
+  status_phase_end(STATUS_PHASE_ESCL_PROBE);
 
- /*
-  * Commit it scanner ...
-  */
+  dnssd_probe_lock(probe);
+  if (scanner != NULL) {
+    probe->scanner = scanner;
+    dnssd_publish_uscan(probe);
+  }
+  dnssd_probe_done(probe);
+  dnssd_probe_unlock(probe);
 
-  avahi_entry_group_commit(g_options.dnssd_data->uscan_ref);
+  dnssd_probe_unref(probe);
+  dnssd_probe_threads_add(-1);
+  return NULL;
+}
 
-  avahi_string_list_free(uscan_txt);
-  scanner = free_scanner(scanner);
-noscanner:
-  printer = free_printer(printer);
+/* Waits for the initial probes, which need the interfaces more urgently.
+   Returns 0 once the refresher should stop. */
+static int dnssd_refresh_settle(struct dnssd_probe *probe)
+{
+  pthread_mutex_lock(&probe->lock);
+  while (probe->pending > 0 && !g_options.terminate &&
+         dnssd_probe_current(probe)) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec++;
+    pthread_cond_timedwait(&probe->settled, &probe->lock, &until);
+  }
+  pthread_mutex_unlock(&probe->lock);
+  return !g_options.terminate && dnssd_probe_current(probe);
+}
+
+/* Sleeps for a refresh interval. Returns 0 once the refresher should stop. */
+static int dnssd_refresh_wait(struct dnssd_probe *probe)
+{
+  for (int i = 0; i < DNSSD_REFRESH_INTERVAL; i++) {
+    if (g_options.terminate || !dnssd_probe_current(probe))
+      return 0;
+    sleep(1);
+  }
+  return !g_options.terminate && dnssd_probe_current(probe);
+}
+
+/* Probes everything again and republishes what changed. Results of probes
+   which failed are left as they were. */
+static void dnssd_refresh_probe(struct dnssd_probe *probe)
+{
+  long long deadline = probe_clock() + DNSSD_PROBE_TIMEOUT;
+  ippPrinter *printer = calloc(1, sizeof(ippPrinter));
+  ippScanner *scanner = calloc(1, sizeof(ippScanner));
+  int fax;
+
+  if (printer != NULL && ipp_request(printer, g_options.usb_sock, deadline))
+    printer = free_printer(printer);
+  fax = ipp_fax_request(g_options.usb_sock, deadline);
+  if (scanner != NULL &&
+      !is_scanner_present(scanner, g_options.usb_sock, deadline))
+    scanner = free_scanner(scanner);
+
+  dnssd_probe_lock(probe);
+  if (printer != NULL) {
+    free_printer(probe->printer);
+    probe->printer = printer;
+  }
+  if (fax >= 0)
+    probe->fax = fax;
+  if (scanner != NULL) {
+    free_scanner(probe->scanner);
+    probe->scanner = scanner;
+  }
+  if (probe->ipp_committed)
+    dnssd_publish_ipp(probe);
+  if (probe->scanner != NULL)
+    dnssd_publish_uscan(probe);
+  dnssd_probe_unlock(probe);
+}
+
+static void *dnssd_probe_refresh(void *data)
+{
+  struct dnssd_probe *probe = data;
+  long long deadline;
+  long last_change = -1;
+  long change;
+  int polls = 0;
+
+  /* The baseline is only taken once the initial probes are done */
+  if (dnssd_refresh_settle(probe)) {
+    deadline = probe_clock() + DNSSD_PROBE_TIMEOUT;
+    last_change = ipp_config_change_time(g_options.usb_sock, deadline);
+  }
+
+  while (dnssd_refresh_wait(probe)) {
+    deadline = probe_clock() + DNSSD_PROBE_TIMEOUT;
+    change = ipp_config_change_time(g_options.usb_sock, deadline);
+    polls++;
+    if (change >= 0 ? change == last_change
+                    : polls < DNSSD_REFRESH_FULL_EVERY)
+      continue;
+
+    NOTE("Printer configuration may have changed, refreshing DNS-SD records");
+    last_change = change;
+    polls = 0;
+    dnssd_refresh_probe(probe);
+  }
+
+  dnssd_probe_unref(probe);
+  dnssd_probe_threads_add(-1);
+  return NULL;
+}
+
+/* Starts the capability probes, taking ownership of |ipp_txt|. */
+static int dnssd_probe_start(AvahiStringList *ipp_txt)
+{
+  void *(*probes[])(void *) = {
+    dnssd_probe_ipp, dnssd_probe_fax, dnssd_probe_escl, dnssd_probe_refresh
+  };
+  struct dnssd_probe *probe;
+  pthread_attr_t attr;
+  pthread_t thread;
+  size_t i;
+
+  probe = calloc(1, sizeof(*probe));
+  if (probe == NULL) {
+    ERR("Unable to allocate memory for capability probing.");
+    avahi_string_list_free(ipp_txt);
+    return -1;
+  }
+  pthread_mutex_init(&probe->lock, NULL);
+  pthread_cond_init(&probe->settled, NULL);
+  probe->refs = 1;
+  probe->deadline = probe_clock() + DNSSD_PROBE_TIMEOUT;
+  probe->ipp_txt = ipp_txt;
+  probe->fax = -1;
+  probe->pending = 3;
+  probe->generation = __sync_add_and_fetch(&dnssd_generation, 1);
+  snprintf(probe->adminurl, sizeof(probe->adminurl), "http://127.0.0.1:%d/",
+           g_options.real_port);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (i = 0; i < sizeof(probes) / sizeof(probes[0]); i++) {
+    pthread_mutex_lock(&probe->lock);
+    probe->refs++;
+    pthread_mutex_unlock(&probe->lock);
+    dnssd_probe_threads_add(1);
+    if (pthread_create(&thread, &attr, probes[i], probe)) {
+      ERR("Could not start capability probe thread");
+      dnssd_probe_threads_add(-1);
+      if (probes[i] != dnssd_probe_refresh) {
+        pthread_mutex_lock(&probe->lock);
+        dnssd_probe_done(probe);
+        pthread_mutex_unlock(&probe->lock);
+      }
+      dnssd_probe_unref(probe);
+    }
+  }
+  pthread_attr_destroy(&attr);
+
+  dnssd_probe_unref(probe);
   return 0;
 }
 
@@ -377,13 +792,13 @@ int dnssd_register(AvahiClient *c)
   char            formats[1024];        /* I - Supported formats */
   char            *ptr;
   int             error;
-  pthread_t       thread_escl;
 
  /*
   * Parse the device ID for MFG, MDL, and CMD
   */
 
   
+  status_phase_begin(STATUS_PHASE_DNSSD_REGISTER);
   dev_id = strdup(g_options.device_id);
   NOTE("%s", "=======================================");
   NOTE("%s", dev_id);
@@ -587,13 +1002,15 @@ int dnssd_register(AvahiClient *c)
   // avahi_entry_group_commit(g_options.dnssd_data->ipp_ref);
 
 
-  pthread_create (&thread_escl, NULL, dnssd_escl_register, ipp_txt);
-
-  return 0;
+  status_phase_end(STATUS_PHASE_DNSSD_REGISTER);
+  return dnssd_probe_start(ipp_txt);
 }
 
 void dnssd_unregister()
 {
+  /* Probes still running for this registration must not publish into
+     the entry groups freed here */
+  __sync_add_and_fetch(&dnssd_generation, 1);
   if (g_options.dnssd_data->ipp_ref) {
     avahi_entry_group_free(g_options.dnssd_data->ipp_ref);
     g_options.dnssd_data->ipp_ref = NULL;
@@ -19,6 +19,8 @@
 #include <avahi-common/error.h>
 #include <avahi-common/thread-watch.h>
 
+#include "capabilities.h"
+
 typedef struct dnssd_s {
   AvahiThreadedPoll *DNSSDMaster;
   AvahiClient       *DNSSDClient;
@@ -37,5 +39,15 @@ void dnssd_shutdown();
 /* Register a printer object via DNS-SD. */
 int dnssd_register(AvahiClient *c);
 
+/* Append the TXT keys derived from the printer's IPP attributes to |ipp_txt|.
+   |adminurl| is used if the printer does not report one. */
+AvahiStringList *dnssd_printer_txt(AvahiStringList *ipp_txt,
+                                   ippPrinter *printer, const char *adminurl);
+
+/* Build the _uscan._tcp TXT record, falling back to the printer's values for
+   keys the scanner does not report. */
+AvahiStringList *dnssd_scanner_txt(ippScanner *scanner, ippPrinter *printer,
+                                   const char *adminurl);
+
 /* Unregister a printer object from DNS-SD. */
 void dnssd_unregister();
@@ -0,0 +1,916 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fake_printer.h"
+#include "http.h"
+#include "logging.h"
+#include "options.h"
+#include "usb.h"
+
+#define IGNORE(x) (void)(x)
+
+#define FAKE_MAX_PACKET_SIZE 512
+#define FAKE_DEVICE_ID                                                   \
+  "MFG:Fake;MDL:IPP-USB Printer;CMD:PDF,PWGRaster,URF,JPEG;SN:FAKE0001;" \
+  "URF:W8,SRGB24,CP1,RS300;"
+
+static const char fake_scanner_capabilities[] =
+  "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+  "<scan:ScannerCapabilities xmlns:pwg=\"http://www.pwg.org/schemas/2010/12/sm\""
+  " xmlns:scan=\"http://schemas.hp.com/imaging/escl/2011/05/03\">\n"
+  "<pwg:Version>2.6</pwg:Version>\n"
+  "<pwg:MakeAndModel>Fake IPP-USB Printer</pwg:MakeAndModel>\n"
+  "<scan:UUID>4509a320-00a0-008f-00b6-00000000fa4e</scan:UUID>\n"
+  "<scan:AdminURI>http://localhost/</scan:AdminURI>\n"
+  "<scan:Platen><scan:PlatenInputCaps>\n"
+  "<scan:SettingProfiles><scan:SettingProfile><scan:ColorModes>\n"
+  "<scan:ColorMode>BlackAndWhite1</scan:ColorMode>\n"
+  "<scan:ColorMode>Grayscale8</scan:ColorMode>\n"
+  "<scan:ColorMode>RGB24</scan:ColorMode>\n"
+  "</scan:ColorModes><scan:DocumentFormats>\n"
+  "<pwg:DocumentFormat>application/pdf</pwg:DocumentFormat>\n"
+  "<pwg:DocumentFormat>image/jpeg</pwg:DocumentFormat>\n"
+  "</scan:DocumentFormats></scan:SettingProfile></scan:SettingProfiles>\n"
+  "</scan:PlatenInputCaps></scan:Platen>\n"
+  "</scan:ScannerCapabilities>\n";
+
+static const char fake_scanner_status[] =
+  "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+  "<scan:ScannerStatus xmlns:pwg=\"http://www.pwg.org/schemas/2010/12/sm\""
+  " xmlns:scan=\"http://schemas.hp.com/imaging/escl/2011/05/03\">\n"
+  "<pwg:Version>2.6</pwg:Version>\n"
+  "<pwg:State>Idle</pwg:State>\n"
+  "</scan:ScannerStatus>\n";
+
+static const char fake_web_page[] =
+  "<!DOCTYPE html>\n<html><head><title>Fake IPP-USB Printer</title></head>"
+  "<body><h1>Fake IPP-USB Printer</h1></body></html>\n";
+
+struct fake_buffer {
+  uint8_t *data;
+  size_t len;
+  size_t cap;
+};
+
+struct fake_rule {
+  char method[16];
+  char path[256];
+  int status;
+  char content_type[128];
+  struct fake_buffer body;
+  struct fake_rule *next;
+};
+
+struct fake_interface {
+  /* Request currently being written by the host. */
+  struct http_framer request;
+
+  /* Response bytes waiting to be read, readable from |ready_at| on. */
+  struct fake_buffer response;
+  size_t response_off;
+  uint64_t ready_at;
+
+  /* IN transfer waiting for data, or NULL. */
+  struct libusb_transfer *pending;
+  uint64_t pending_deadline;
+  /* Once data is available for |pending| this is the time its transfer
+     completes, given latency and bandwidth. */
+  uint64_t pending_done_at;
+  /* Set once an IN transfer stalled, until the halt is cleared. */
+  int halted;
+  /* Transfer which finished and waits in the done queue for its callback,
+     or NULL. */
+  struct libusb_transfer *finished;
+};
+
+struct fake_printer {
+  /* Configuration */
+  uint32_t num_interfaces;
+  uint64_t bandwidth;
+  uint64_t latency;
+  uint64_t think;
+  /* Every |stall|th IN transfer with data stalls instead, 0 for never. */
+  uint32_t stall;
+  uint32_t num_in;
+  struct fake_rule *rules;
+
+  struct fake_interface *interfaces;
+  pthread_mutex_t mutex;
+  /* Wakes the device thread when transfers or responses show up. */
+  pthread_cond_t device_cond;
+  /* Wakes handle_events() when transfers have finished. */
+  pthread_cond_t done_cond;
+  pthread_t device_thread;
+  int stop;
+
+  /* Interfaces with a finished transfer, in the order they finished. An
+     interface takes no new transfer before the callback of the last one
+     ran, so there is always room for all of them. */
+  struct fake_interface **done;
+  size_t num_done;
+};
+
+static uint64_t fake_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static struct timespec fake_timespec(uint64_t usec)
+{
+  struct timespec ts;
+  ts.tv_sec = (time_t)(usec / 1000000);
+  ts.tv_nsec = (long)(usec % 1000000) * 1000;
+  return ts;
+}
+
+/* Time the bus is busy moving |bytes|. */
+static uint64_t fake_transfer_time(struct fake_printer *fp, size_t bytes)
+{
+  uint64_t usec = fp->latency;
+  if (fp->bandwidth)
+    usec += (uint64_t)bytes * 1000000 / fp->bandwidth;
+  return usec;
+}
+
+static int fake_buffer_append(struct fake_buffer *buf, const void *data,
+                              size_t len)
+{
+  if (buf->len + len > buf->cap) {
+    size_t cap = buf->cap ? buf->cap : 1024;
+    while (cap < buf->len + len)
+      cap *= 2;
+    uint8_t *grown = realloc(buf->data, cap);
+    if (grown == NULL)
+      return -1;
+    buf->data = grown;
+    buf->cap = cap;
+  }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  return 0;
+}
+
+static void fake_buffer_free(struct fake_buffer *buf)
+{
+  free(buf->data);
+  memset(buf, 0, sizeof(*buf));
+}
+
+/* IPP encoding ==-----------------------------------------------------== */
+
+static void ipp_put16(struct fake_buffer *buf, unsigned value)
+{
+  uint8_t be[2] = { (uint8_t)(value >> 8), (uint8_t)value };
+  fake_buffer_append(buf, be, 2);
+}
+
+static void ipp_put32(struct fake_buffer *buf, uint32_t value)
+{
+  uint8_t be[4] = { (uint8_t)(value >> 24), (uint8_t)(value >> 16),
+                    (uint8_t)(value >> 8), (uint8_t)value };
+  fake_buffer_append(buf, be, 4);
+}
+
+/* Appends one value. An empty |name| adds another value to the previous
+   attribute. */
+static void ipp_value(struct fake_buffer *buf, uint8_t tag, const char *name,
+                      const void *value, size_t len)
+{
+  fake_buffer_append(buf, &tag, 1);
+  ipp_put16(buf, (unsigned)strlen(name));
+  fake_buffer_append(buf, name, strlen(name));
+  ipp_put16(buf, (unsigned)len);
+  fake_buffer_append(buf, value, len);
+}
+
+static void ipp_string(struct fake_buffer *buf, uint8_t tag, const char *name,
+                       const char *value)
+{
+  ipp_value(buf, tag, name, value, strlen(value));
+}
+
+static void ipp_integer(struct fake_buffer *buf, uint8_t tag,
+                        const char *name, uint32_t value)
+{
+  uint8_t be[4] = { (uint8_t)(value >> 24), (uint8_t)(value >> 16),
+                    (uint8_t)(value >> 8), (uint8_t)value };
+  ipp_value(buf, tag, name, be, 4);
+}
+
+static void ipp_media_size(struct fake_buffer *buf, const char *name,
+                           uint32_t x, uint32_t y)
+{
+  ipp_value(buf, 0x34, name, NULL, 0);
+  ipp_string(buf, 0x4a, "", "x-dimension");
+  ipp_integer(buf, 0x21, "", x);
+  ipp_string(buf, 0x4a, "", "y-dimension");
+  ipp_integer(buf, 0x21, "", y);
+  ipp_value(buf, 0x37, "", NULL, 0);
+}
+
+static void fake_ipp_response(struct fake_buffer *body,
+                              const struct http_framer *request)
+{
+  unsigned op = 0;
+  uint32_t request_id = 0;
+  uint8_t yes = 1;
+
+  if (request->body_head_len >= 8) {
+    op = (unsigned)request->body_head[2] << 8 | request->body_head[3];
+    request_id = (uint32_t)request->body_head[4] << 24 |
+                 (uint32_t)request->body_head[5] << 16 |
+                 (uint32_t)request->body_head[6] << 8 |
+                 request->body_head[7];
+  }
+
+  ipp_put16(body, 0x0200);
+  ipp_put16(body, 0x0000);
+  ipp_put32(body, request_id);
+  fake_buffer_append(body, "\x01", 1);
+  ipp_string(body, 0x47, "attributes-charset", "utf-8");
+  ipp_string(body, 0x48, "attributes-natural-language", "en");
+
+  switch (op) {
+  case 0x000b: /* Get-Printer-Attributes */
+    fake_buffer_append(body, "\x04", 1);
+    ipp_string(body, 0x45, "printer-uri-supported",
+               "ipp://localhost/ipp/print");
+    ipp_string(body, 0x42, "printer-name", "Fake");
+    ipp_string(body, 0x41, "printer-make-and-model", "Fake IPP-USB Printer");
+    ipp_string(body, 0x41, "printer-location", "Emulated");
+    ipp_string(body, 0x45, "printer-uuid",
+               "urn:uuid:4509a320-00a0-008f-00b6-00000000fa4e");
+    ipp_string(body, 0x45, "printer-more-info", "http://localhost/");
+    ipp_integer(body, 0x23, "printer-state", 3);
+    ipp_value(body, 0x22, "color-supported", &yes, 1);
+    ipp_string(body, 0x49, "document-format-supported", "application/pdf");
+    ipp_string(body, 0x49, "", "image/pwg-raster");
+    ipp_string(body, 0x49, "", "image/urf");
+    ipp_string(body, 0x49, "", "image/jpeg");
+    ipp_string(body, 0x44, "sides-supported", "one-sided");
+    ipp_string(body, 0x44, "", "two-sided-long-edge");
+    ipp_string(body, 0x44, "", "two-sided-short-edge");
+    ipp_string(body, 0x44, "urf-supported", "W8");
+    ipp_string(body, 0x44, "", "SRGB24");
+    ipp_string(body, 0x44, "", "CP1");
+    ipp_string(body, 0x44, "", "RS300");
+    ipp_media_size(body, "media-size-supported", 21000, 29700);
+    ipp_media_size(body, "", 21590, 27940);
+    ipp_media_size(body, "", 21590, 35560);
+    break;
+  case 0x0002: /* Print-Job */
+  case 0x0005: /* Create-Job */
+    fake_buffer_append(body, "\x02", 1);
+    ipp_integer(body, 0x21, "job-id", 1);
+    ipp_string(body, 0x45, "job-uri", "ipp://localhost/ipp/print/1");
+    ipp_integer(body, 0x23, "job-state", 3);
+    break;
+  default:
+    break;
+  }
+
+  fake_buffer_append(body, "\x03", 1);
+}
+
+/* Responder ==--------------------------------------------------------== */
+
+static const char *fake_reason(int status)
+{
+  switch (status) {
+  case 200: return "OK";
+  case 404: return "Not Found";
+  case 500: return "Internal Server Error";
+  case 503: return "Service Unavailable";
+  default: return "Unknown";
+  }
+}
+
+/* Queues the response to the request just completed on |fi|. Called with the
+   printer's mutex held. */
+static void fake_respond(struct fake_printer *fp, struct fake_interface *fi)
+{
+  const struct http_framer *req = &fi->request;
+  struct fake_buffer generated = { NULL, 0, 0 };
+  const struct fake_buffer *body = &generated;
+  const char *content_type = "text/html";
+  int status = 200;
+  char head[512];
+
+  struct fake_rule *rule;
+  for (rule = fp->rules; rule != NULL; rule = rule->next) {
+    if ((strcmp(rule->method, "*") == 0 ||
+         strcmp(rule->method, req->method) == 0) &&
+        strncmp(req->path, rule->path, strlen(rule->path)) == 0)
+      break;
+  }
+
+  if (rule != NULL) {
+    status = rule->status;
+    content_type = rule->content_type;
+    body = &rule->body;
+  } else if (strcmp(req->method, "POST") == 0 &&
+             strncasecmp(req->content_type, "application/ipp", 15) == 0) {
+    content_type = "application/ipp";
+    fake_ipp_response(&generated, req);
+  } else if (strcmp(req->path, "/eSCL/ScannerCapabilities") == 0) {
+    content_type = "text/xml";
+    fake_buffer_append(&generated, fake_scanner_capabilities,
+                       sizeof(fake_scanner_capabilities) - 1);
+  } else if (strcmp(req->path, "/eSCL/ScannerStatus") == 0) {
+    content_type = "text/xml";
+    fake_buffer_append(&generated, fake_scanner_status,
+                       sizeof(fake_scanner_status) - 1);
+  } else if (strcmp(req->method, "GET") == 0 ||
+             strcmp(req->method, "HEAD") == 0) {
+    fake_buffer_append(&generated, fake_web_page, sizeof(fake_web_page) - 1);
+  }
+
+  int head_len = snprintf(head, sizeof(head),
+                          "HTTP/1.1 %d %s\r\n"
+                          "Content-Type: %s\r\n"
+                          "Content-Length: %zu\r\n"
+                          "\r\n",
+                          status, fake_reason(status), content_type,
+                          body->len);
+
+  if (fi->response_off == fi->response.len) {
+    fi->response.len = 0;
+    fi->response_off = 0;
+    fi->ready_at = fake_now() + fp->think;
+  }
+  fake_buffer_append(&fi->response, head, (size_t)head_len);
+  if (strcmp(req->method, "HEAD") != 0 && body->len)
+    fake_buffer_append(&fi->response, body->data, body->len);
+
+  fake_buffer_free(&generated);
+}
+
+/* Transfers ==--------------------------------------------------------== */
+
+/* Hands the pending transfer of |fi| over to handle_events(). Called with
+   the printer's mutex held. */
+static void fake_complete(struct fake_printer *fp, struct fake_interface *fi,
+                          enum libusb_transfer_status status)
+{
+  struct libusb_transfer *transfer = fi->pending;
+
+  transfer->status = status;
+  fi->pending = NULL;
+  fi->pending_done_at = 0;
+  fi->finished = transfer;
+  fp->done[fp->num_done++] = fi;
+  pthread_cond_signal(&fp->done_cond);
+}
+
+static void *fake_device_thread(void *data)
+{
+  struct fake_printer *fp = data;
+
+  pthread_mutex_lock(&fp->mutex);
+  while (!fp->stop) {
+    uint64_t now = fake_now();
+    uint64_t next = now + 50000;
+
+    for (uint32_t i = 0; i < fp->num_interfaces; i++) {
+      struct fake_interface *fi = fp->interfaces + i;
+      struct libusb_transfer *transfer = fi->pending;
+      if (transfer == NULL)
+        continue;
+
+      size_t avail = fi->response.len - fi->response_off;
+      if (avail > 0 && now >= fi->ready_at) {
+        size_t n = avail < (size_t)transfer->length ? avail
+                                                     : (size_t)transfer->length;
+        if (fi->pending_done_at == 0)
+          fi->pending_done_at = now + fake_transfer_time(fp, n);
+        if (now >= fi->pending_done_at && fp->stall &&
+            ++fp->num_in % fp->stall == 0) {
+          WARN("Fake printer: Interface #%u: Stalling", i);
+          fi->halted = 1;
+          transfer->actual_length = 0;
+          fake_complete(fp, fi, LIBUSB_TRANSFER_STALL);
+          continue;
+        }
+        if (now >= fi->pending_done_at) {
+          memcpy(transfer->buffer, fi->response.data + fi->response_off, n);
+          fi->response_off += n;
+          transfer->actual_length = (int)n;
+          fake_complete(fp, fi, LIBUSB_TRANSFER_COMPLETED);
+          continue;
+        }
+        if (fi->pending_done_at < next)
+          next = fi->pending_done_at;
+      } else if (avail > 0 && fi->ready_at < next) {
+        next = fi->ready_at;
+      }
+
+      if (fi->pending_deadline && fi->pending_done_at == 0) {
+        if (now >= fi->pending_deadline) {
+          transfer->actual_length = 0;
+          fake_complete(fp, fi, LIBUSB_TRANSFER_TIMED_OUT);
+          continue;
+        }
+        if (fi->pending_deadline < next)
+          next = fi->pending_deadline;
+      }
+    }
+
+    struct timespec until = fake_timespec(next);
+    pthread_cond_timedwait(&fp->device_cond, &fp->mutex, &until);
+  }
+  pthread_mutex_unlock(&fp->mutex);
+
+  return NULL;
+}
+
+static int fake_bulk_out(struct usb_conn_t *conn, uint8_t *data, int length,
+                         int *transferred, unsigned int timeout)
+{
+  IGNORE(timeout);
+  struct fake_printer *fp = conn->parent->transport_data;
+  struct fake_interface *fi = fp->interfaces + conn->interface_index;
+
+  /* The bus is busy for as long as the data takes to go out. */
+  struct timespec busy = fake_timespec(fake_transfer_time(fp, (size_t)length));
+  nanosleep(&busy, NULL);
+
+  pthread_mutex_lock(&fp->mutex);
+  if (fi->halted) {
+    pthread_mutex_unlock(&fp->mutex);
+    *transferred = 0;
+    return LIBUSB_ERROR_PIPE;
+  }
+  size_t used = 0;
+  while (used < (size_t)length) {
+    used += http_framer_feed(&fi->request, data + used,
+                             (size_t)length - used);
+    if (fi->request.state == HTTP_FRAMER_ERROR) {
+      WARN("Fake printer: Interface #%u: Malformed request, discarding",
+           conn->interface_index);
+      http_framer_init(&fi->request, 0);
+      break;
+    }
+    if (http_framer_done(&fi->request)) {
+      fake_respond(fp, fi);
+      http_framer_init(&fi->request, 0);
+    }
+  }
+  pthread_cond_signal(&fp->device_cond);
+  pthread_mutex_unlock(&fp->mutex);
+
+  *transferred = length;
+  return LIBUSB_SUCCESS;
+}
+
+static int fake_submit_in(struct usb_conn_t *conn,
+                          struct libusb_transfer *transfer)
+{
+  struct fake_printer *fp = conn->parent->transport_data;
+  struct fake_interface *fi = fp->interfaces + conn->interface_index;
+
+  pthread_mutex_lock(&fp->mutex);
+  if (fi->pending != NULL || fi->finished != NULL) {
+    pthread_mutex_unlock(&fp->mutex);
+    return LIBUSB_ERROR_BUSY;
+  }
+  fi->pending = transfer;
+  fi->pending_done_at = 0;
+  fi->pending_deadline =
+      transfer->timeout ? fake_now() + (uint64_t)transfer->timeout * 1000 : 0;
+  if (fi->halted) {
+    transfer->actual_length = 0;
+    fake_complete(fp, fi, LIBUSB_TRANSFER_STALL);
+  }
+  pthread_cond_signal(&fp->device_cond);
+  pthread_mutex_unlock(&fp->mutex);
+
+  return LIBUSB_SUCCESS;
+}
+
+static int fake_cancel_in(struct usb_conn_t *conn,
+                          struct libusb_transfer *transfer)
+{
+  struct fake_printer *fp = conn->parent->transport_data;
+  struct fake_interface *fi = fp->interfaces + conn->interface_index;
+  int status = LIBUSB_ERROR_NOT_FOUND;
+
+  pthread_mutex_lock(&fp->mutex);
+  if (fi->pending == transfer) {
+    transfer->actual_length = 0;
+    fake_complete(fp, fi, LIBUSB_TRANSFER_CANCELLED);
+    status = LIBUSB_SUCCESS;
+  }
+  pthread_mutex_unlock(&fp->mutex);
+
+  return status;
+}
+
+static void fake_handle_events(struct usb_sock_t *usb, struct timeval *tv)
+{
+  struct fake_printer *fp = usb->transport_data;
+
+  pthread_mutex_lock(&fp->mutex);
+  if (fp->num_done == 0) {
+    struct timespec until =
+        fake_timespec(fake_now() + (uint64_t)tv->tv_sec * 1000000 +
+                      (uint64_t)tv->tv_usec);
+    pthread_cond_timedwait(&fp->done_cond, &fp->mutex, &until);
+  }
+  while (fp->num_done > 0) {
+    struct fake_interface *fi = fp->done[0];
+    struct libusb_transfer *transfer = fi->finished;
+    fi->finished = NULL;
+    fp->num_done--;
+    memmove(fp->done, fp->done + 1, fp->num_done * sizeof(*fp->done));
+
+    /* The callback may submit the next transfer. */
+    pthread_mutex_unlock(&fp->mutex);
+    transfer->callback(transfer);
+    pthread_mutex_lock(&fp->mutex);
+  }
+  pthread_mutex_unlock(&fp->mutex);
+}
+
+static int fake_start_events(struct usb_sock_t *usb)
+{
+  IGNORE(usb);
+  return 0;
+}
+
+static void fake_wake_events(struct usb_sock_t *usb)
+{
+  struct fake_printer *fp = usb->transport_data;
+
+  pthread_mutex_lock(&fp->mutex);
+  pthread_cond_broadcast(&fp->done_cond);
+  pthread_mutex_unlock(&fp->mutex);
+}
+
+struct fake_sync {
+  struct fake_printer *fp;
+  int done;
+};
+
+static void LIBUSB_CALL fake_sync_callback(struct libusb_transfer *transfer)
+{
+  struct fake_sync *sync = transfer->user_data;
+
+  pthread_mutex_lock(&sync->fp->mutex);
+  sync->done = 1;
+  pthread_cond_broadcast(&sync->fp->done_cond);
+  pthread_mutex_unlock(&sync->fp->mutex);
+}
+
+/* Runs an IN transfer like an asynchronous one and dispatches events until
+   it has finished, which is what libusb does for its synchronous transfers
+   too. Another thread dispatching the completion is fine. */
+static int fake_bulk_in(struct usb_conn_t *conn, uint8_t *data, int length,
+                        int *transferred, unsigned int timeout)
+{
+  struct fake_printer *fp = conn->parent->transport_data;
+  struct fake_sync sync = { fp, 0 };
+  struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+  int status;
+
+  if (transfer == NULL)
+    return LIBUSB_ERROR_NO_MEM;
+  libusb_fill_bulk_transfer(transfer, NULL, conn->interface->endpoint_in,
+                            data, length, fake_sync_callback, &sync, timeout);
+  status = fake_submit_in(conn, transfer);
+  if (status != LIBUSB_SUCCESS) {
+    libusb_free_transfer(transfer);
+    return status;
+  }
+
+  pthread_mutex_lock(&fp->mutex);
+  while (!sync.done) {
+    pthread_mutex_unlock(&fp->mutex);
+    struct timeval tv = { 0, 10000 };
+    fake_handle_events(conn->parent, &tv);
+    pthread_mutex_lock(&fp->mutex);
+  }
+  pthread_mutex_unlock(&fp->mutex);
+
+  *transferred = transfer->actual_length;
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    status = LIBUSB_SUCCESS;
+    break;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    status = LIBUSB_ERROR_TIMEOUT;
+    break;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    status = LIBUSB_ERROR_NO_DEVICE;
+    break;
+  default:
+    status = LIBUSB_ERROR_IO;
+    break;
+  }
+  libusb_free_transfer(transfer);
+  return status;
+}
+
+/* Setup ==------------------------------------------------------------== */
+
+static int fake_load_file(const char *path, struct fake_buffer *buf)
+{
+  char chunk[4096];
+  size_t n;
+
+  FILE *in = fopen(path, "rb");
+  if (in == NULL) {
+    ERR("Fake printer: Cannot open %s", path);
+    return -1;
+  }
+  while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+    if (fake_buffer_append(buf, chunk, n)) {
+      fclose(in);
+      return -1;
+    }
+  }
+  fclose(in);
+  return 0;
+}
+
+static int fake_load_script(struct fake_printer *fp, const char *path)
+{
+  char line[1024];
+  struct fake_rule **tail = &fp->rules;
+  int line_num = 0;
+
+  FILE *in = fopen(path, "r");
+  if (in == NULL) {
+    ERR("Fake printer: Cannot open script %s", path);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), in) != NULL) {
+    char body_file[512];
+    line_num++;
+    if (line[0] == '#' || line[strspn(line, " \t\r\n")] == '\0')
+      continue;
+
+    struct fake_rule *rule = calloc(1, sizeof(*rule));
+    if (rule == NULL) {
+      fclose(in);
+      return -1;
+    }
+    if (sscanf(line, "%15s %255s %d %127s %511s", rule->method, rule->path,
+               &rule->status, rule->content_type, body_file) != 5 ||
+        (strcmp(body_file, "-") != 0 &&
+         fake_load_file(body_file, &rule->body))) {
+      ERR("Fake printer: %s:%d: Invalid rule", path, line_num);
+      fake_buffer_free(&rule->body);
+      free(rule);
+      fclose(in);
+      return -1;
+    }
+    *tail = rule;
+    tail = &rule->next;
+  }
+
+  fclose(in);
+  return 0;
+}
+
+static int fake_parse_spec(struct fake_printer *fp, const char *spec)
+{
+  char *copy = strdup(spec);
+  char *saveptr = NULL;
+  int status = 0;
+
+  if (copy == NULL)
+    return -1;
+
+  for (char *item = strtok_r(copy, ",", &saveptr); item != NULL;
+       item = strtok_r(NULL, ",", &saveptr)) {
+    char *value = strchr(item, '=');
+    if (value == NULL) {
+      ERR("Fake printer: Setting \"%s\" has no value", item);
+      status = -1;
+      break;
+    }
+    *value++ = '\0';
+
+    if (strcmp(item, "interfaces") == 0)
+      fp->num_interfaces = (uint32_t)strtoul(value, NULL, 10);
+    else if (strcmp(item, "bandwidth") == 0)
+      fp->bandwidth = strtoull(value, NULL, 10);
+    else if (strcmp(item, "latency") == 0)
+      fp->latency = strtoull(value, NULL, 10);
+    else if (strcmp(item, "think") == 0)
+      fp->think = strtoull(value, NULL, 10) * 1000;
+    else if (strcmp(item, "stall") == 0)
+      fp->stall = (uint32_t)strtoul(value, NULL, 10);
+    else if (strcmp(item, "script") == 0)
+      status = fake_load_script(fp, value);
+    else {
+      ERR("Fake printer: Unknown setting \"%s\"", item);
+      status = -1;
+    }
+    if (status)
+      break;
+  }
+
+  free(copy);
+  return status;
+}
+
+static void fake_free(struct fake_printer *fp)
+{
+  while (fp->rules != NULL) {
+    struct fake_rule *next = fp->rules->next;
+    fake_buffer_free(&fp->rules->body);
+    free(fp->rules);
+    fp->rules = next;
+  }
+  if (fp->interfaces != NULL) {
+    for (uint32_t i = 0; i < fp->num_interfaces; i++)
+      fake_buffer_free(&fp->interfaces[i].response);
+    free(fp->interfaces);
+  }
+  free(fp->done);
+  free(fp);
+}
+
+static int fake_open(struct usb_sock_t *usb)
+{
+  pthread_condattr_t attr;
+  struct fake_printer *fp = calloc(1, sizeof(*fp));
+  if (fp == NULL) {
+    ERR("Fake printer: Failed to allocate state");
+    return -1;
+  }
+
+  fp->num_interfaces = 3;
+  fp->bandwidth = 40000000;
+  fp->latency = 125;
+  fp->think = 10000;
+  if (fake_parse_spec(fp, g_options.fake_printer) ||
+      fp->num_interfaces == 0) {
+    ERR("Fake printer: Invalid specification \"%s\"", g_options.fake_printer);
+    goto error;
+  }
+
+  fp->interfaces = calloc(fp->num_interfaces, sizeof(*fp->interfaces));
+  fp->done = calloc(fp->num_interfaces, sizeof(*fp->done));
+  usb->interfaces = calloc(fp->num_interfaces, sizeof(*usb->interfaces));
+  usb->device_id = strdup(FAKE_DEVICE_ID);
+  if (fp->interfaces == NULL || fp->done == NULL || usb->interfaces == NULL ||
+      usb->device_id == NULL) {
+    ERR("Fake printer: Failed to allocate interfaces");
+    goto error;
+  }
+
+  usb->num_interfaces = fp->num_interfaces;
+  for (uint32_t i = 0; i < fp->num_interfaces; i++) {
+    struct usb_interface *uf = usb->interfaces + i;
+    uf->interface_number = (uint8_t)i;
+    uf->libusb_interface_index = (uint8_t)i;
+    uf->interface_alt = 0;
+    uf->endpoint_in = (uint8_t)(0x81 + i);
+    uf->endpoint_out = (uint8_t)(0x01 + i);
+    uf->max_packet_in = FAKE_MAX_PACKET_SIZE;
+    uf->max_packet_out = FAKE_MAX_PACKET_SIZE;
+    http_framer_init(&fp->interfaces[i].request, 0);
+  }
+  g_options.device_id = usb->device_id;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&fp->mutex, NULL);
+  pthread_cond_init(&fp->device_cond, &attr);
+  pthread_cond_init(&fp->done_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  usb->transport_data = fp;
+  if (pthread_create(&fp->device_thread, NULL, &fake_device_thread, fp)) {
+    ERR("Fake printer: Failed to start device thread");
+    usb->transport_data = NULL;
+    goto error;
+  }
+
+  NOTE("Fake printer: %u interfaces, %llu B/s, %llu usec latency, "
+       "%llu usec think time",
+       fp->num_interfaces, (unsigned long long)fp->bandwidth,
+       (unsigned long long)fp->latency, (unsigned long long)fp->think);
+  return 0;
+
+ error:
+  free(usb->interfaces);
+  usb->interfaces = NULL;
+  free(usb->device_id);
+  usb->device_id = NULL;
+  fake_free(fp);
+  return -1;
+}
+
+static void fake_close(struct usb_sock_t *usb)
+{
+  struct fake_printer *fp = usb->transport_data;
+  if (fp == NULL)
+    return;
+
+  pthread_mutex_lock(&fp->mutex);
+  fp->stop = 1;
+  pthread_cond_signal(&fp->device_cond);
+  pthread_mutex_unlock(&fp->mutex);
+  pthread_join(fp->device_thread, NULL);
+
+  pthread_cond_destroy(&fp->device_cond);
+  pthread_cond_destroy(&fp->done_cond);
+  pthread_mutex_destroy(&fp->mutex);
+  fake_free(fp);
+  usb->transport_data = NULL;
+}
+
+static int fake_claim(struct usb_sock_t *usb, struct usb_interface *uf)
+{
+  IGNORE(usb);
+  IGNORE(uf);
+  return 0;
+}
+
+/* Clearing a halt, reselecting the alt setting and a reset all leave the
+   interface idle, with the rest of any response discarded. */
+static void fake_reset_interface(struct fake_interface *fi)
+{
+  fi->halted = 0;
+  fi->response.len = 0;
+  fi->response_off = 0;
+  http_framer_init(&fi->request, 0);
+}
+
+static int fake_recover(struct usb_sock_t *usb, struct usb_interface *uf,
+                        int step)
+{
+  struct fake_printer *fp = usb->transport_data;
+  uint32_t index = (uint32_t)(uf - usb->interfaces);
+
+  pthread_mutex_lock(&fp->mutex);
+  if (step == USB_RECOVER_RESET) {
+    for (uint32_t i = 0; i < fp->num_interfaces; i++)
+      fake_reset_interface(fp->interfaces + i);
+  } else if (step == USB_RECOVER_CLEAR_HALT) {
+    /* Like on a real device, pending response data stays */
+    fp->interfaces[index].halted = 0;
+  } else {
+    fake_reset_interface(fp->interfaces + index);
+  }
+  pthread_mutex_unlock(&fp->mutex);
+  return 0;
+}
+
+static int fake_can_hotplug(struct usb_sock_t *usb)
+{
+  IGNORE(usb);
+  /* The emulated device never goes away */
+  return 0;
+}
+
+static int fake_register_hotplug(struct usb_sock_t *usb)
+{
+  IGNORE(usb);
+  return 0;
+}
+
+const struct usb_transport usb_fake_transport = {
+  "fake printer",
+  fake_open,
+  fake_close,
+  fake_claim,
+  fake_bulk_out,
+  fake_bulk_in,
+  fake_submit_in,
+  fake_cancel_in,
+  fake_can_hotplug,
+  fake_register_hotplug,
+  fake_start_events,
+  fake_handle_events,
+  fake_wake_events,
+  fake_recover,
+  NULL,
+  NULL
+};
@@ -0,0 +1,36 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+
+#include "usb.h"
+
+/* In-process emulation of an IPP-over-USB printer, selected with
+   --fake-printer <spec>. The spec is a comma-separated list of settings:
+
+     interfaces=<n>    Number of IPP-USB interfaces (default 3)
+     bandwidth=<B/s>   Bulk throughput in bytes per second, 0 for unlimited
+                       (default 40000000)
+     latency=<usec>    Fixed cost of every bulk transfer (default 125)
+     think=<msec>      Time the printer takes before a response becomes
+                       readable (default 10)
+     script=<file>     Canned responses, one per line:
+                         <method|*> <path-prefix> <status> <content-type> <body-file|->
+
+   Requests not matched by the script are answered by a minimal built-in
+   responder: IPP requests get a successful IPP response (with a small set of
+   printer attributes for Get-Printer-Attributes), the eSCL capability and
+   status resources return fixed XML documents and every other GET returns a
+   small HTML page. */
+extern const struct usb_transport usb_fake_transport;
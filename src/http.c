@@ -54,6 +54,211 @@ struct http_packet_t *packet_new()
 
 void packet_free(struct http_packet_t *pkt)
 {
-  free(pkt->buffer);
+  if (pkt->release != NULL)
+    pkt->release(pkt);
+  else
+    free(pkt->buffer);
   free(pkt);
 }
+
+void http_framer_init(struct http_framer *framer, int is_response)
+{
+  memset(framer, 0, sizeof(*framer));
+  framer->state = HTTP_FRAMER_HEADERS;
+  framer->is_response = is_response;
+}
+
+int http_framer_done(const struct http_framer *framer)
+{
+  return framer->state == HTTP_FRAMER_COMPLETE;
+}
+
+int http_framer_is_idempotent(const struct http_framer *framer)
+{
+  if (!strcmp(framer->method, "GET") || !strcmp(framer->method, "HEAD") ||
+      !strcmp(framer->method, "OPTIONS"))
+    return 1;
+  if (strcmp(framer->method, "POST") ||
+      strncasecmp(framer->content_type, "application/ipp", 15) ||
+      framer->body_head_len < 4)
+    return 0;
+
+  /* The operation id follows the two version bytes */
+  switch ((unsigned)framer->body_head[2] << 8 | framer->body_head[3]) {
+  case 0x0004: /* Validate-Job */
+  case 0x0009: /* Get-Job-Attributes */
+  case 0x000A: /* Get-Jobs */
+  case 0x000B: /* Get-Printer-Attributes */
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+static void framer_copy_value(char *dst, size_t size, const char *value,
+                              size_t len)
+{
+  while (len > 0 && (*value == ' ' || *value == '\t')) {
+    value++;
+    len--;
+  }
+  if (len >= size)
+    len = size - 1;
+  memcpy(dst, value, len);
+  dst[len] = '\0';
+}
+
+static void framer_parse_head(struct http_framer *framer)
+{
+  if (framer->is_response) {
+    if (sscanf(framer->head, "HTTP/%*d.%*d %d", &framer->status) != 1) {
+      framer->state = HTTP_FRAMER_ERROR;
+      return;
+    }
+  } else if (sscanf(framer->head, "%15s %255s", framer->method,
+                    framer->path) != 2) {
+    framer->state = HTTP_FRAMER_ERROR;
+    return;
+  }
+
+  /* Walk the header lines following the start line. */
+  char *line = strstr(framer->head, "\r\n") + 2;
+  while (strncmp(line, "\r\n", 2) != 0) {
+    char *end = strstr(line, "\r\n");
+    char *colon = memchr(line, ':', (size_t)(end - line));
+    if (colon != NULL) {
+      size_t name_len = (size_t)(colon - line);
+      size_t value_len = (size_t)(end - colon - 1);
+      if (name_len == 14 && !strncasecmp(line, "Content-Length", 14)) {
+        framer->content_length = strtoull(colon + 1, NULL, 10);
+        framer->has_length = 1;
+      } else if (name_len == 17 &&
+                 !strncasecmp(line, "Transfer-Encoding", 17)) {
+        char value[64];
+        framer_copy_value(value, sizeof(value), colon + 1, value_len);
+        if (strcasestr(value, "chunked") != NULL)
+          framer->chunked = 1;
+      } else if (name_len == 12 && !strncasecmp(line, "Content-Type", 12)) {
+        framer_copy_value(framer->content_type,
+                          sizeof(framer->content_type), colon + 1,
+                          value_len);
+      }
+    }
+    line = end + 2;
+  }
+
+  /* Decide how the end of the body will be recognized. */
+  if (framer->is_response &&
+      (framer->no_body || framer->status < 200 || framer->status == 204 ||
+       framer->status == 304))
+    framer->state = HTTP_FRAMER_COMPLETE;
+  else if (framer->chunked)
+    framer->state = HTTP_FRAMER_CHUNK_SIZE;
+  else if (framer->has_length) {
+    framer->remaining = framer->content_length;
+    framer->state = framer->remaining ? HTTP_FRAMER_BODY
+                                      : HTTP_FRAMER_COMPLETE;
+  } else if (framer->is_response)
+    framer->state = HTTP_FRAMER_BODY_UNTIL_CLOSE;
+  else
+    framer->state = HTTP_FRAMER_COMPLETE;
+}
+
+static void framer_body(struct http_framer *framer, const uint8_t *data,
+                        size_t len)
+{
+  if (framer->body_head_len < HTTP_FRAMER_BODY_HEAD) {
+    size_t room = HTTP_FRAMER_BODY_HEAD - framer->body_head_len;
+    size_t n = len < room ? len : room;
+    memcpy(framer->body_head + framer->body_head_len, data, n);
+    framer->body_head_len += n;
+  }
+  framer->body_len += len;
+  if (framer->body_cb != NULL && len > 0)
+    framer->body_cb(framer->body_ctx, data, len);
+}
+
+size_t http_framer_feed(struct http_framer *framer, const uint8_t *data,
+                        size_t len)
+{
+  size_t used = 0;
+
+  while (used < len && framer->state != HTTP_FRAMER_COMPLETE &&
+         framer->state != HTTP_FRAMER_ERROR) {
+    switch (framer->state) {
+    case HTTP_FRAMER_HEADERS: {
+      char c = (char)data[used++];
+      /* Skip empty lines left over between pipelined messages. */
+      if (framer->head_len == 0 && (c == '\r' || c == '\n'))
+        break;
+      if (framer->head_len + 1 >= HTTP_FRAMER_HEAD_MAX) {
+        framer->state = HTTP_FRAMER_ERROR;
+        break;
+      }
+      framer->head[framer->head_len++] = c;
+      framer->head[framer->head_len] = '\0';
+      if (framer->head_len >= 4 &&
+          !memcmp(framer->head + framer->head_len - 4, "\r\n\r\n", 4))
+        framer_parse_head(framer);
+      break;
+    }
+    case HTTP_FRAMER_BODY:
+    case HTTP_FRAMER_CHUNK_DATA: {
+      size_t n = len - used;
+      if (n > framer->remaining)
+        n = (size_t)framer->remaining;
+      framer_body(framer, data + used, n);
+      used += n;
+      framer->remaining -= n;
+      if (framer->remaining == 0)
+        framer->state = framer->state == HTTP_FRAMER_BODY
+                            ? HTTP_FRAMER_COMPLETE
+                            : HTTP_FRAMER_CHUNK_END;
+      break;
+    }
+    case HTTP_FRAMER_BODY_UNTIL_CLOSE:
+      framer_body(framer, data + used, len - used);
+      used = len;
+      break;
+    case HTTP_FRAMER_CHUNK_SIZE: {
+      char c = (char)data[used++];
+      if (c == '\n') {
+        if (framer->line_len == 0)
+          break;
+        framer->line[framer->line_len] = '\0';
+        framer->line_len = 0;
+        framer->remaining = strtoull(framer->line, NULL, 16);
+        framer->state = framer->remaining ? HTTP_FRAMER_CHUNK_DATA
+                                          : HTTP_FRAMER_TRAILER;
+      } else if (c != '\r') {
+        if (framer->line_len + 1 >= sizeof(framer->line)) {
+          framer->state = HTTP_FRAMER_ERROR;
+          break;
+        }
+        framer->line[framer->line_len++] = c;
+      }
+      break;
+    }
+    case HTTP_FRAMER_CHUNK_END:
+      if (data[used++] == '\n')
+        framer->state = HTTP_FRAMER_CHUNK_SIZE;
+      break;
+    case HTTP_FRAMER_TRAILER: {
+      char c = (char)data[used++];
+      if (c == '\n') {
+        if (framer->line_len == 0)
+          framer->state = HTTP_FRAMER_COMPLETE;
+        framer->line_len = 0;
+      } else if (c != '\r') {
+        framer->line_len = 1;
+      }
+      break;
+    }
+    case HTTP_FRAMER_COMPLETE:
+    case HTTP_FRAMER_ERROR:
+      break;
+    }
+  }
+
+  return used;
+}
@@ -20,7 +20,84 @@ struct http_packet_t {
   size_t filled_size;
   size_t buffer_capacity;
   uint8_t *buffer;
+  /* Frees |buffer| if it was not allocated with malloc(). */
+  void (*release)(struct http_packet_t *pkt);
+  void *owner;
 };
 
 struct http_packet_t *packet_new();
 void packet_free(struct http_packet_t *pkt);
+
+/* Incremental HTTP/1.1 message framer. Bytes of a request or response stream
+   are fed in as they arrive and the framer tracks where the current message
+   ends, so that callers can find message boundaries without buffering whole
+   messages. Only the start line, the headers and the first bytes of the body
+   are retained. */
+
+#define HTTP_FRAMER_HEAD_MAX 8192
+#define HTTP_FRAMER_BODY_HEAD 64
+
+enum http_framer_state {
+  HTTP_FRAMER_HEADERS,
+  HTTP_FRAMER_BODY,
+  HTTP_FRAMER_BODY_UNTIL_CLOSE,
+  HTTP_FRAMER_CHUNK_SIZE,
+  HTTP_FRAMER_CHUNK_DATA,
+  HTTP_FRAMER_CHUNK_END,
+  HTTP_FRAMER_TRAILER,
+  HTTP_FRAMER_COMPLETE,
+  HTTP_FRAMER_ERROR
+};
+
+struct http_framer {
+  enum http_framer_state state;
+  int is_response;
+  /* Set by the caller for responses to HEAD requests, which carry no body. */
+  int no_body;
+
+  /* Start line and headers of the current message. */
+  char head[HTTP_FRAMER_HEAD_MAX];
+  size_t head_len;
+  /* Current chunk-size or trailer line. */
+  char line[64];
+  size_t line_len;
+
+  /* Parsed from the head. */
+  char method[16];
+  char path[256];
+  char content_type[128];
+  int status;
+  int chunked;
+  int has_length;
+  uint64_t content_length;
+
+  /* Body bytes still expected in the current body or chunk. */
+  uint64_t remaining;
+  /* Total body bytes seen so far. */
+  uint64_t body_len;
+  /* First bytes of the body, enough for an IPP request header. */
+  uint8_t body_head[HTTP_FRAMER_BODY_HEAD];
+  size_t body_head_len;
+
+  /* Optional sink for the body with any chunked encoding removed. Set after
+     http_framer_init(). */
+  void (*body_cb)(void *ctx, const uint8_t *data, size_t len);
+  void *body_ctx;
+};
+
+/* Resets |framer| to expect the start of a new request or response. */
+void http_framer_init(struct http_framer *framer, int is_response);
+
+/* Feeds up to |len| bytes of |data| to |framer|. Consumption stops at the end
+   of the current message, so the return value, the number of bytes used, can
+   be smaller than |len| if a second message follows. */
+size_t http_framer_feed(struct http_framer *framer, const uint8_t *data,
+                        size_t len);
+
+/* Returns non-zero once a complete message has been fed. */
+int http_framer_done(const struct http_framer *framer);
+
+/* Returns non-zero if the request fed to |framer| can be sent again without
+   changing anything on the printer: safe HTTP methods and IPP operations
+   which only query state. */
+int http_framer_is_idempotent(const struct http_framer *framer);
@@ -27,18 +27,19 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "affinity.h"
 #include "dnssd.h"
 #include "http.h"
 #include "logging.h"
 #include "options.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "session.h"
+#include "status.h"
 #include "tcp.h"
+#include "trace.h"
 #include "usb.h"
 
-/* Global variables */
-static pthread_mutex_t thread_register_mutex;
-static struct service_thread_param **service_threads = NULL;
-static uint32_t num_service_threads = 0;
-
 static void sigterm_handler(int sig)
 {
   /* Flag that we should stop and return... */
@@ -46,106 +47,19 @@ static void sigterm_handler(int sig)
   NOTE("Caught signal %d, shutting down ...", sig);
 }
 
-static void list_service_threads(
-    uint32_t num_service_threads,
-    struct service_thread_param **service_threads)
-{
-  uint32_t i;
-  char *p;
-  char buf[10240];
-  size_t written = 0;
-
-  /* Set all bytes in |buf| to the null terminator so that we don't have to
-     worry about it later. */
-  memset(buf, '\0', sizeof(buf));
-
-  written += snprintf(buf, sizeof(buf), "Threads currently running: ");
-  p = buf + written;
-
-  if (num_service_threads == 0) {
-    written += snprintf(p, sizeof(buf) - written, "None");
-  } else {
-    for (i = 0; i < num_service_threads; i++) {
-      written += snprintf(p, sizeof(buf) - written, "#%u",
-                          service_threads[i]->thread_num);
-      p = buf + written;
-      if (i + 1 < num_service_threads) {
-        written += snprintf(p, sizeof(buf) - written, ", ");
-        p = buf + written;
-      }
-    }
-  }
-  NOTE("%s", buf);
-}
-
-static int register_service_thread(
-    uint32_t *num_service_threads,
-    struct service_thread_param ***service_threads,
-    struct service_thread_param *new_thread)
-{
-  NOTE("Registering thread #%u", new_thread->thread_num);
-  (*num_service_threads)++;
-  *service_threads =
-      realloc(*service_threads, *num_service_threads * sizeof(void *));
-  if (*service_threads == NULL) {
-    ERR("Registering thread #%u: Failed to alloc space for thread registration "
-        "list",
-        new_thread->thread_num);
-    return -1;
-  }
-  (*service_threads)[*num_service_threads - 1] = new_thread;
-  return 0;
-}
-
-static int unregister_service_thread(
-    uint32_t *num_service_threads,
-    struct service_thread_param ***service_threads, uint32_t thread_num)
-{
-  uint32_t i;
-
-  NOTE("Unregistering thread #%u", thread_num);
-  /* Search |service_threads| for an element with a matching thread number. */
-  for (i = 0; i < *num_service_threads; i++) {
-    if ((*service_threads)[i]->thread_num == thread_num) break;
-  }
-
-  if (i >= *num_service_threads) {
-    ERR("Unregistering thread #%u: Cannot unregister, not found", thread_num);
-    return -1;
-  }
-
-  (*num_service_threads)--;
-  struct service_thread_param *removed_thread = (*service_threads)[i];
-  /* Shift the contents after |removed_thread| down. */
-  for (; i < *num_service_threads; i++) {
-    (*service_threads)[i] = (*service_threads)[i + 1];
-  }
-  free(removed_thread);
-
-  *service_threads =
-      realloc(*service_threads, *num_service_threads * sizeof(void *));
-
-  if (*num_service_threads == 0) {
-    *service_threads = NULL;
-  } else if (*service_threads == NULL) {
-    ERR("Unregistering thread #%u: Failed to alloc space for thread "
-        "registration list",
-        thread_num);
-    return -1;
-  }
-
-  return 0;
-}
-
 static void
 cleanup_handler(void *arg_void)
 {
-  uint32_t thread_num = *((int *)(arg_void));
-  NOTE("Thread #%u: Called clean-up handler", thread_num);
-  pthread_mutex_lock(&thread_register_mutex);
-  unregister_service_thread(&num_service_threads, &service_threads, thread_num);
-  list_service_threads(num_service_threads, service_threads);
-  pthread_mutex_unlock(&thread_register_mutex);
+  struct service_thread_param *params =
+      (struct service_thread_param *)arg_void;
+  NOTE("Thread #%u: Called clean-up handler", params->thread_num);
+  session_unregister(params->session_id);
+  if (params->done != NULL)
+    sem_post(params->done);
+  else
+    /* The socket thread only gets here once the printer thread is done */
+    pool_unreserve(CONN_WORKERS);
+  free(params);
 }
 
 static void read_transfer_callback(struct libusb_transfer *transfer)
@@ -157,17 +71,49 @@ static void read_transfer_callback(struct libusb_transfer *transfer)
   pthread_mutex_t *read_inflight_mutex = user_data->read_inflight_mutex;
   pthread_cond_t *read_inflight_cond = user_data->read_inflight_cond;
 
+  /* Even a cancelled, timed out or failed transfer may have read part of a
+     response, which has to reach the client all the same. */
+  int has_data = transfer->actual_length > 0;
+  if (has_data) {
+    user_data->pkt->filled_size = transfer->actual_length;
+    NOTE("Thread #%u: Pkt from %s (buffer size: %zu)\n===\n%s===",
+         thread_num, "usb", user_data->pkt->filled_size,
+         hexdump(user_data->pkt->buffer, (int)user_data->pkt->filled_size));
+  }
+
+  /* A response is only counted as read together with queueing its end for
+     the client, so that an answer made up by the daemon cannot overtake
+     it, see refuse_request(). Bytes which do not reach the client must not
+     be counted, or the interface would look idle in the middle of a
+     response. Writing to the client is left to the printer thread, a
+     client which does not read must not hold up the completions of the
+     other connections. */
+  if (has_data) {
+    tcp_writer_lock(user_data->tcp);
+    if (tcp_writer_push_locked(user_data->tcp, user_data->pkt) == 0) {
+      usb_conn_track_response(user_data->usb_conn, transfer->buffer,
+                              (size_t)transfer->actual_length);
+      user_data->pkt = NULL;
+    } else {
+      ERR("Thread #%u: Writer queue full, dropping %d bytes", thread_num,
+          transfer->actual_length);
+      usb_conn_stop_tracking(user_data->usb_conn);
+    }
+    tcp_writer_unlock(user_data->tcp);
+    /* Mark the tcp socket as active. */
+    set_is_active(user_data->tcp, 1);
+    *user_data->idle_timeouts = 0;
+  } else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+    (*user_data->idle_timeouts)++;
+  }
+
   switch (transfer->status) {
     case LIBUSB_TRANSFER_COMPLETED:
-      user_data->pkt->filled_size = transfer->actual_length;
-
-      if (transfer->actual_length) {
-        NOTE("Thread #%u: Pkt from %s (buffer size: %zu)\n===\n%s===",
-             thread_num, "usb", user_data->pkt->filled_size,
-             hexdump(user_data->pkt->buffer, (int)user_data->pkt->filled_size));
-        tcp_packet_send(user_data->tcp, user_data->pkt);
-        /* Mark the tcp socket as active. */
-        set_is_active(user_data->tcp, 1);
+      trace_span(thread_num, "usb_in", user_data->submit_time,
+                 (size_t)transfer->actual_length);
+
+      if (has_data) {
+        usb_conn_report(user_data->usb_conn, 0);
       } else {
         /* Set that we received an empty response from the printer. */
         *user_data->empty_response = 1;
@@ -176,20 +122,26 @@ static void read_transfer_callback(struct libusb_transfer *transfer)
       break;
     case LIBUSB_TRANSFER_ERROR:
       ERR("Thread #%u: There was an error completing the transfer", thread_num);
-      g_options.terminate = 1;
+      usb_conn_report(user_data->usb_conn, USB_FAULT_ERROR);
+      *user_data->transfer_failed = 1;
       break;
     case LIBUSB_TRANSFER_TIMED_OUT:
+      trace_span(thread_num, "usb_in_timeout", user_data->submit_time,
+                 (size_t)transfer->actual_length);
       NOTE(
           "Thread #%u: The transfer timed out before it could be completed: "
           "Received %u bytes",
           thread_num, transfer->actual_length);
       break;
     case LIBUSB_TRANSFER_CANCELLED:
+      trace_span(thread_num, "usb_in_cancelled", user_data->submit_time,
+                 (size_t)transfer->actual_length);
       NOTE("Thread #%u: The transfer was cancelled", thread_num);
       break;
     case LIBUSB_TRANSFER_STALL:
       ERR("Thread #%u: The transfer has stalled", thread_num);
-      g_options.terminate = 1;
+      usb_conn_report(user_data->usb_conn, USB_FAULT_STALL);
+      *user_data->transfer_failed = 1;
       break;
     case LIBUSB_TRANSFER_NO_DEVICE:
       ERR("Thread #%u: The printer was disconnected during the transfer",
@@ -199,19 +151,23 @@ static void read_transfer_callback(struct libusb_transfer *transfer)
     case LIBUSB_TRANSFER_OVERFLOW:
       ERR("Thread #%u: The printer sent more data than was requested",
           thread_num);
-      g_options.terminate = 1;
+      usb_conn_report(user_data->usb_conn, USB_FAULT_OVERFLOW);
+      *user_data->transfer_failed = 1;
       break;
     default:
       ERR("Thread #%u: Something unexpected happened", thread_num);
-      g_options.terminate = 1;
+      usb_conn_report(user_data->usb_conn, USB_FAULT_ERROR);
+      *user_data->transfer_failed = 1;
   }
 
-  /* Free the packet used for the transfer. */
-  packet_free(user_data->pkt);
+  /* Free the packet used for the transfer, unless it was queued. */
+  if (user_data->pkt != NULL)
+    packet_free(user_data->pkt);
 
   /* Mark the transfer as completed. */
   pthread_mutex_lock(read_inflight_mutex);
   *user_data->read_inflight = 0;
+  *user_data->completed_at = affinity_now();
   pthread_cond_broadcast(read_inflight_cond);
   pthread_mutex_unlock(read_inflight_mutex);
 
@@ -220,26 +176,121 @@ static void read_transfer_callback(struct libusb_transfer *transfer)
   libusb_free_transfer(transfer);
 }
 
+/* Answers |request| with 429 Too Many Requests in place of the printer.
+   Returns 0 if the answer is on its way. */
+static int refuse_request(struct service_thread_param *params,
+                          const struct http_framer *request,
+                          uint32_t retry_after)
+{
+  static const char body[] = "Too many requests, please try again later.\n";
+  char response[256];
+  int is_head = strcmp(request->method, "HEAD") == 0;
+
+  int length = snprintf(response, sizeof(response),
+                        "HTTP/1.1 429 Too Many Requests\r\n"
+                        "Retry-After: %u\r\n"
+                        "Content-Type: text/plain\r\n"
+                        "Content-Length: %zu\r\n"
+                        "\r\n"
+                        "%s", retry_after, sizeof(body) - 1,
+                        is_head ? "" : body);
+  if (tcp_writer_send(params->tcp, (const uint8_t *)response,
+                      (size_t)length))
+    return -1;
+  /* Have the printer thread write out whatever was queued */
+  pthread_cond_broadcast(params->cond);
+  return 0;
+}
+
+/* Holds back or refuses the request the writer is holding for a client
+   over its rate limit, see usb_writer_admit */
+static void limit_request(struct service_thread_param *params)
+{
+  struct usb_writer *writer = params->writer;
+  int is_complete, can_refuse;
+  const struct http_framer *request =
+      usb_writer_held(writer, &is_complete, &can_refuse);
+  enum ratelimit_class class =
+      is_complete && http_framer_is_idempotent(request) ? RATELIMIT_QUERY
+                                                        : RATELIMIT_JOB;
+  uint32_t retry_after;
+
+  int refuse = ratelimit_admit(params->tcp->client, class, can_refuse,
+                               &retry_after) != 0 &&
+               refuse_request(params, request, retry_after) == 0;
+  usb_writer_admit(writer, refuse);
+}
+
+/* Takes an interface from the pool for a request which is about to go
+   out. With every interface busy and enough clients waiting for one
+   already, or after waiting in vain, the client is told when to come
+   back. */
+static int attach_interface(struct service_thread_param *params)
+{
+  uint32_t retry_after;
+  if (usb_admit(params->usb_sock, &retry_after)) {
+    NOTE("Thread #%u: Refusing request from %s, retry after %u s",
+         params->thread_num, params->tcp->peer, retry_after);
+    trace_instant(params->thread_num, "refuse");
+    tcp_conn_refuse(params->tcp, retry_after);
+    return -1;
+  }
+
+  uint64_t acquire_start = trace_begin();
+  struct usb_conn_t *conn = usb_conn_acquire(params->usb_sock);
+  usb_admit_done(params->usb_sock);
+  if (conn == NULL) {
+    ERR("Thread #%u: Failed to acquire usb interface", params->thread_num);
+    if (!g_options.terminate)
+      tcp_conn_refuse(params->tcp, usb_retry_after(params->usb_sock));
+    return -1;
+  }
+  trace_span(params->thread_num, "usb_acquire", acquire_start, 0);
+  usb_writer_attach(params->writer, conn);
+  session_set_interface(params->conn_id, (int)conn->interface_index);
+  return 0;
+}
+
+/* Deals with a request the writer could not send yet and retries until
+   the writer is done. Returns 0 or -1 like usb_writer_commit. */
+static int settle_writer(struct service_thread_param *params, int status,
+                         int flush)
+{
+  struct usb_writer *writer = params->writer;
+
+  while (status > 0) {
+    if (status == USB_WRITER_HELD)
+      limit_request(params);
+    else if (attach_interface(params))
+      return -1;
+    status = flush ? usb_writer_flush(writer) : usb_writer_commit(writer, 0);
+  }
+  return status;
+}
+
 void *service_connection(void *params_void)
 {
   struct service_thread_param *params =
       (struct service_thread_param *)params_void;
   uint32_t thread_num = params->thread_num;
 
-  /* Detach this thread so that the main thread does not need to join this
-     thread after termination for clean-up. */
-  pthread_detach(pthread_self());
+  session_started(params->session_id);
 
   /* Register clean-up handler. */
-  pthread_cleanup_push(cleanup_handler, &thread_num);
+  pthread_cleanup_push(cleanup_handler, params);
 
   /* Allow immediate cancelling of this thread. */
   pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
   pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
-  /* Attempt to establish a connection with the printer. */
-  if (setup_usb_connection(params->usb_sock, params))
+  /* The connection only takes an interface from the pool once a request
+     has to go out, see attach_interface(). */
+  struct usb_writer writer;
+  if (usb_writer_init(&writer, params->usb_sock))
     goto cleanup;
+  params->writer = &writer;
+  if (ratelimit_enabled())
+    usb_writer_gate(&writer);
 
   /* Condition variable used to broadcast updates to the printer thread. */
   pthread_cond_t cond;
@@ -247,18 +298,27 @@ void *service_connection(void *params_void)
     goto cleanup;
   params->cond = &cond;
 
+  /* Posted by the printer thread when it exits. */
+  sem_t printer_done;
+  if (sem_init(&printer_done, 0, 0))
+    goto cleanup;
+
   /* Copy the contents of |params| into |printer_params|. The only
-     differences between the two are the |thread_num| and |thread_handle|. */
+     differences between the two are the |thread_num|, the |session_id| and
+     that only the printer thread signals |done|. */
   struct service_thread_param *printer_params =
       calloc(1, sizeof(*printer_params));
   memcpy(printer_params, params, sizeof(*printer_params));
   printer_params->thread_num += 1;
+  printer_params->done = &printer_done;
 
   /* Attempt to start the printer's end of the communication. */
-  if (setup_communication_thread(&service_printer_connection, printer_params))
+  if (setup_communication_thread(&service_printer_connection,
+                                 printer_params)) {
+    free(printer_params);
+    sem_destroy(&printer_done);
     goto cleanup;
-
-  pthread_t printer_params_thread_handle = printer_params->thread_handle;
+  }
 
   /* This function will run until the socket has been closed. When this function
      returns it means that the communication has been completed. */
@@ -271,11 +331,18 @@ void *service_connection(void *params_void)
   /* Wait for the printer thread to exit. */
   NOTE("Thread #%u: Waiting for thread #%u to complete", thread_num,
        thread_num + 1);
-  if (pthread_join(printer_params_thread_handle, NULL))
-    ERR("Thread #%u: Something went wrong trying to join the printer thread",
-        thread_num);
+  while (sem_wait(&printer_done) && errno == EINTR)
+    ;
+  sem_destroy(&printer_done);
 
 cleanup:
+  if (params->writer != NULL) {
+    /* The printer thread may have moved the connection to another
+       interface. */
+    params->usb_conn = params->writer->conn;
+    usb_writer_free(params->writer);
+    params->writer = NULL;
+  }
   if (params->usb_conn != NULL) {
     NOTE("Thread #%u: interface #%u: releasing usb conn", thread_num,
          params->usb_conn->interface_index);
@@ -287,45 +354,137 @@ cleanup:
        g_options.terminate ? "shutdown requested"
                            : "communication thread terminated");
   tcp_conn_close(params->tcp);
+  trace_instant(thread_num, "close");
 
   /* Execute clean-up handler. */
   pthread_cleanup_pop(1);
-  pthread_exit(NULL);
+  return NULL;
+}
+
+/* Returns how long in seconds a connection may stay quiet in |state|. */
+static uint32_t connection_timeout(enum usb_writer_state state)
+{
+  switch (state) {
+  case USB_WRITER_IDLE:
+    return g_options.idle_timeout;
+  case USB_WRITER_REQUEST:
+    return g_options.request_timeout;
+  default:
+    return g_options.response_timeout;
+  }
 }
 
 void service_socket_connection(struct service_thread_param *params)
 {
   uint32_t thread_num = params->thread_num;
+  struct usb_writer *writer = params->writer;
+  uint64_t quiet_since = affinity_now();
 
   while (is_socket_open(params) && !g_options.terminate) {
-    int result = poll_tcp_socket(params->tcp);
+    /* The tail of an incomplete request is only held back for as long as
+       more of it is about to arrive. */
+    if (usb_writer_pending(writer) &&
+        !tcp_wait_readable(params->tcp, USB_OUT_LINGER_MS)) {
+      uint64_t flush_start = trace_begin();
+      size_t pending = usb_writer_pending(writer);
+      if (settle_writer(params, usb_writer_flush(writer), 1))
+        break;
+      trace_span(thread_num, "usb_out", flush_start, pending);
+      pthread_cond_broadcast(params->cond);
+      continue;
+    }
+
+    /* Between transactions the interface goes back to the pool, so that a
+       keep-alive connection does not keep other clients waiting. */
+    if (writer->conn != NULL && usb_writer_release_idle(writer))
+      session_set_interface(params->conn_id, -1);
+
+    int result = poll_tcp_socket(params->tcp, writer->conn != NULL ?
+                                 busy_poll_interval : idle_poll_interval);
     if (result < 0 || !is_socket_open(params)) {
       NOTE("Thread #%u: Client closed connection", thread_num);
-      return;
+      break;
     } else if (result == 0) {
+      /* A response on its way to the client counts as activity. */
+      uint64_t now = affinity_now();
+      if (get_is_active(params->tcp)) {
+        set_is_active(params->tcp, 0);
+        quiet_since = now;
+        continue;
+      }
+      enum usb_writer_state state = usb_writer_state(writer);
+      if (tcp_writer_depth(params->tcp) > 0)
+        state = USB_WRITER_RESPONSE;
+      uint32_t limit = connection_timeout(state);
+      if (limit > 0 && now - quiet_since >= (uint64_t)limit * 1000000) {
+        NOTE("Thread #%u: Closing the connection after %u seconds %s",
+             thread_num, limit, state == USB_WRITER_IDLE ? "idle" :
+             state == USB_WRITER_REQUEST ? "within a request" :
+             "waiting for the response");
+        break;
+      }
       continue;
     }
-
-    struct http_packet_t *pkt = tcp_packet_get(params->tcp);
-    if (pkt == NULL) {
+    quiet_since = affinity_now();
+
+    /* Receive straight into the buffer the printer is sent from. */
+    size_t room;
+    uint8_t *space = usb_writer_space(writer, &room);
+    uint64_t recv_start = trace_begin();
+    ssize_t received = tcp_recv(params->tcp, space, room);
+    if (received < 0) {
       NOTE("Thread #%u: There was an error reading from the socket",
            thread_num);
-      return;
+      break;
     }
+    trace_span(thread_num, "tcp_recv", recv_start, (size_t)received);
 
-    if (!is_socket_open(params)) {
+    if (!is_socket_open(params) && received == 0) {
       NOTE("Thread #%u: Client closed connection", thread_num);
-      return;
+      break;
     }
 
-    NOTE("Thread #%u: Pkt from tcp (buffer size: %zu)\n===\n%s===", thread_num,
-         pkt->filled_size, hexdump(pkt->buffer, (int)pkt->filled_size));
+    NOTE("Thread #%u: Pkt from tcp (buffer size: %zd)\n===\n%s===", thread_num,
+         received, hexdump(space, (int)received));
+
+    /* Send pkt to printer. A request only takes an interface once it got
+       past the rate limit. */
+    uint64_t send_start = trace_begin();
+    int status = settle_writer(params,
+                               usb_writer_commit(writer, (size_t)received), 0);
+    trace_span(thread_num, "usb_out", send_start, (size_t)received);
+    session_add_bytes(params->conn_id, (size_t)received, 0);
+    if (status)
+      break;
+    /* The printer thread may be waiting for a request to read the response
+       to. */
+    pthread_cond_broadcast(params->cond);
+  }
+
+  /* Whatever the client managed to send still goes to the printer. */
+  if (!g_options.terminate && writer->conn != NULL && !writer->conn->is_staled)
+    usb_writer_flush(writer);
 
-    /* Send pkt to printer. */
-    usb_conn_packet_send(params->usb_conn, pkt);
+  /* A failed USB transfer leaves the socket open, the printer thread has to
+     stop as well. */
+  tcp_conn_abort(params->tcp);
+}
 
-    packet_free(pkt);
+/* Waits up to busy_poll_interval milliseconds for the socket thread to announce a new
+   request. */
+static void wait_for_request(struct service_thread_param *params,
+                             pthread_mutex_t *mutex)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += busy_poll_interval * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
   }
+  pthread_mutex_lock(mutex);
+  pthread_cond_timedwait(params->cond, mutex, &deadline);
+  pthread_mutex_unlock(mutex);
 }
 
 void *service_printer_connection(void *params_void)
@@ -334,15 +493,22 @@ void *service_printer_connection(void *params_void)
       (struct service_thread_param *)params_void;
   uint32_t thread_num = params->thread_num;
 
+  session_started(params->session_id);
+
   /* Register clean-up handler. */
-  pthread_cleanup_push(cleanup_handler, &thread_num);
+  pthread_cleanup_push(cleanup_handler, params);
 
   /* Amount of time to wait in milliseconds before sending another read request
      if we received a 0-byte response from the printer. */
   int backoff = initial_backoff;
 
   int read_inflight = 0;
+  /* Set while params->usb_conn is kept for reading from it */
+  int reading = 0;
   int empty_response = 0;
+  int transfer_failed = 0;
+  int idle_timeouts = 0;
+  uint64_t completed_at = 0;
 
   pthread_mutex_t read_inflight_mutex;
   if (pthread_mutex_init(&read_inflight_mutex, NULL))
@@ -354,9 +520,17 @@ void *service_printer_connection(void *params_void)
     /* If there is already a read from the printer underway, block until it has
        completed. */
     pthread_mutex_lock(&read_inflight_mutex);
-    while (is_socket_open(params) && read_inflight)
+    int waited = 0;
+    while (is_socket_open(params) && read_inflight &&
+           tcp_writer_depth(params->tcp) == 0) {
       pthread_cond_wait(params->cond, &read_inflight_mutex);
+      waited = 1;
+    }
+    uint64_t woken_by = completed_at;
+    completed_at = 0;
     pthread_mutex_unlock(&read_inflight_mutex);
+    if (waited && woken_by)
+      affinity_record_latency(THREAD_ROLE_WORKER, affinity_now() - woken_by);
 
     /* After waking up due to a completed transfer, verify that the socket is
        still open and that the termination flag has not been set before
@@ -364,11 +538,90 @@ void *service_printer_connection(void *params_void)
     if (!is_socket_open(params) || g_options.terminate)
       break;
 
+    /* An interface which stops answering in the middle of an exchange which
+       can be replayed is given up on like one which failed, other exchanges
+       are left to the response timeout. */
+    if (idle_timeouts >= USB_REPLAY_IDLE_READS && !transfer_failed &&
+        !get_read_inflight(&read_inflight, &read_inflight_mutex)) {
+      idle_timeouts = 0;
+      if (usb_writer_replayable(params->writer)) {
+        WARN("Thread #%u: Interface #%u: No response after %d reads",
+             thread_num, params->usb_conn->interface_index,
+             USB_REPLAY_IDLE_READS);
+        usb_conn_report(params->usb_conn, USB_FAULT_TIMEOUT);
+        transfer_failed = 1;
+      }
+    }
+
+    /* A failed read loses the interface, but if the client has not seen
+       any of the response yet its requests can be answered on another
+       one. */
+    if (transfer_failed) {
+      transfer_failed = 0;
+      if (usb_writer_replay(params->writer)) {
+        ERR("Thread #%u: Interface failed, closing the connection",
+            thread_num);
+        tcp_conn_abort(params->tcp);
+        break;
+      }
+      params->usb_conn = params->writer->conn;
+      session_set_interface(params->conn_id,
+                            (int)params->usb_conn->interface_index);
+      trace_instant(thread_num, "usb_replay");
+      empty_response = 0;
+      continue;
+    }
+
+    /* The interface can only go back to the pool once no read from it is
+       in flight. */
+    if (reading && !get_read_inflight(&read_inflight, &read_inflight_mutex)) {
+      usb_writer_end_read(params->writer);
+      reading = 0;
+    }
+
+    /* Pass on what the printer sent, as far as the client takes it without
+       blocking. */
+    uint64_t send_start = trace_begin();
+    ssize_t sent = tcp_writer_flush(params->tcp);
+    if (sent < 0)
+      break;
+    if (sent > 0) {
+      trace_span(thread_num, "tcp_send", send_start, (size_t)sent);
+      session_add_bytes(params->conn_id, 0, (size_t)sent);
+    }
+
+    /* Only read on from the printer while the client keeps up, so that a
+       client which does not read only stalls its own connection. */
+    uint32_t depth = tcp_writer_depth(params->tcp);
+    if (get_read_inflight(&read_inflight, &read_inflight_mutex) ||
+        depth >= TCP_WRITER_MAX_DEPTH) {
+      if (depth > 0)
+        tcp_writer_wait(params->tcp, 100);
+      continue;
+    }
+
+    /* Only read while the printer owes responses, in between the interface
+       may be handed back. */
+    if (!reading) {
+      params->usb_conn = usb_writer_begin_read(params->writer);
+      if (params->usb_conn == NULL) {
+        empty_response = 0;
+        if (depth > 0)
+          tcp_writer_wait(params->tcp, 100);
+        else
+          wait_for_request(params, &read_inflight_mutex);
+        continue;
+      }
+      reading = 1;
+    }
+
     /* If we received an empty response from the printer then wait for |backoff|
        milliseconds and update the backoff period. */
     if (empty_response) {
       /* usleep accepts microseconds. */
+      uint64_t backoff_start = trace_begin();
       usleep(backoff * 1000);
+      trace_span(thread_num, "usb_in_backoff", backoff_start, 0);
       backoff = update_backoff(backoff);
       /* Reset the empty response indicator before sending the next read
          request. A mutex should not be needed here since the transfer callback
@@ -381,14 +634,15 @@ void *service_printer_connection(void *params_void)
     }
 
     NOTE("Thread #%u: No read in flight, starting a new one", thread_num);
-    struct http_packet_t *pkt = packet_new();
+    struct http_packet_t *pkt = usb_conn_packet_new(params->usb_conn);
     if (pkt == NULL) {
       ERR("Thread #%u: Failed to allocate packet", thread_num);
       break;
     }
 
     struct libusb_callback_data *user_data = setup_libusb_callback_data(
-        pkt, &read_inflight, &empty_response, params, &read_inflight_mutex);
+        pkt, &read_inflight, &empty_response, &transfer_failed,
+        &idle_timeouts, &completed_at, params, &read_inflight_mutex);
 
     if (user_data == NULL) {
       ERR("Thread #%u: Failed to allocate memory for libusb_callback_data",
@@ -410,7 +664,8 @@ void *service_printer_connection(void *params_void)
        libusb_submit_transfer() */
     read_inflight = 1;
 
-    if (libusb_submit_transfer(read_transfer)) {
+    user_data->submit_time = trace_begin();
+    if (usb_conn_submit_read(params->usb_conn, read_transfer)) {
       ERR("Thread #%u: Failed to submit asynchronous USB transfer", thread_num);
       set_read_inflight(0, &read_inflight_mutex, &read_inflight);
       break;
@@ -423,7 +678,7 @@ void *service_printer_connection(void *params_void)
     NOTE(
         "Thread #%u: There was a read in flight when the connection was "
         "closed, cancelling transfer", thread_num);
-    int cancel_status = libusb_cancel_transfer(read_transfer);
+    int cancel_status = usb_conn_cancel_read(params->usb_conn, read_transfer);
     if (!cancel_status) {
       /* Wait until the cancellation has completed. */
       NOTE("Thread #%u: Waiting until the transfer has been cancelled",
@@ -445,7 +700,7 @@ void *service_printer_connection(void *params_void)
 cleanup:
   /* Execute clean-up handler. */
   pthread_cleanup_pop(1);
-  pthread_exit(NULL);
+  return NULL;
 }
 
 static uint16_t open_tcp_socket(void)
@@ -488,44 +743,25 @@ int allocate_socket_connection(struct service_thread_param *param)
 
 int setup_socket_connection(struct service_thread_param *param)
 {
-  param->tcp = tcp_conn_select(g_options.tcp_socket, g_options.tcp6_socket);
+  param->tcp = tcp_conn_select(g_options.tcp_socket, g_options.tcp6_socket,
+                               g_options.unix_socket);
   if (g_options.terminate || param->tcp == NULL)
     return -1;
   return 0;
 }
 
-int setup_usb_connection(struct usb_sock_t *usb_sock,
-                         struct service_thread_param *param)
-{
-  param->usb_conn = usb_conn_acquire(usb_sock);
-  if (param->usb_conn == NULL) {
-    ERR("Thread #%u: Failed to acquire usb interface", param->thread_num);
-    return -1;
-  }
-
-  return 0;
-}
-
 int setup_communication_thread(void *(*routine)(void *),
                                struct service_thread_param *param)
 {
-  pthread_mutex_lock(&thread_register_mutex);
-  register_service_thread(&num_service_threads, &service_threads, param);
-  list_service_threads(num_service_threads, service_threads);
-  pthread_mutex_unlock(&thread_register_mutex);
-
-  int status =
-      pthread_create(&param->thread_handle, NULL, routine, param);
-
-  if (status) {
-    ERR("Creating thread #%u: Failed to spawn thread, error %d",
-        param->thread_num, status);
-    pthread_mutex_lock(&thread_register_mutex);
-    unregister_service_thread(&num_service_threads, &service_threads,
-                              param->thread_num);
-    list_service_threads(num_service_threads, service_threads);
-    pthread_mutex_unlock(&thread_register_mutex);
-    return -1;
+  param->session_id = session_register(param->thread_num, param->tcp,
+                                       &param->conn_id);
+  if (param->session_id == SESSION_ID_NONE)
+    return 1;
+
+  if (pool_submit(routine, param)) {
+    ERR("Creating thread #%u: No worker available", param->thread_num);
+    session_unregister(param->session_id);
+    return 1;
   }
 
   return 0;
@@ -533,6 +769,7 @@ int setup_communication_thread(void *(*routine)(void *),
 
 struct libusb_callback_data *setup_libusb_callback_data(
     struct http_packet_t *pkt, int *read_inflight, int *empty_response,
+    int *transfer_failed, int *idle_timeouts, uint64_t *completed_at,
     struct service_thread_param *thread_param,
     pthread_mutex_t *read_inflight_mutex)
 {
@@ -543,10 +780,15 @@ struct libusb_callback_data *setup_libusb_callback_data(
   data->pkt = pkt;
   data->read_inflight = read_inflight;
   data->empty_response = empty_response;
+  data->transfer_failed = transfer_failed;
+  data->idle_timeouts = idle_timeouts;
+  data->completed_at = completed_at;
   data->thread_num = thread_param->thread_num;
+  data->conn_id = thread_param->conn_id;
   data->read_inflight_mutex = read_inflight_mutex;
   data->read_inflight_cond = thread_param->cond;
   data->tcp = thread_param->tcp;
+  data->usb_conn = thread_param->usb_conn;
 
   return data;
 }
@@ -588,10 +830,21 @@ static void start_daemon()
   /* Termination flag */
   g_options.terminate = 0;
 
+  /* Before anything can fail, so that the clean-up finds no sessions */
+  session_init();
+
+  /* Set up tracing before libusb spawns any threads */
+  if (TRACE_ENABLED() && trace_init())
+    return;
+
+  status_phase_begin(STATUS_PHASE_USB_OPEN);
   usb_sock = usb_open();
   if (usb_sock == NULL) goto cleanup_usb;
+  g_options.usb_sock = usb_sock;
+  status_phase_end(STATUS_PHASE_USB_OPEN);
 
   /* Capture a socket */
+  status_phase_begin(STATUS_PHASE_TCP_LISTEN);
   uint16_t desired_port = open_tcp_socket();
   if (g_options.tcp_socket == NULL && g_options.tcp6_socket == NULL)
     goto cleanup_tcp;
@@ -606,6 +859,15 @@ static void start_daemon()
 	" The requested port number may be too high.");
     goto cleanup_tcp;
   }
+
+  /* Local clients may also come in over a Unix domain socket, next to
+     the port which DNS-SD advertises */
+  if (g_options.unix_socket_path != NULL) {
+    g_options.unix_socket = tcp_unix_open(g_options.unix_socket_path);
+    if (g_options.unix_socket == NULL)
+      goto cleanup_tcp;
+  }
+  status_phase_end(STATUS_PHASE_TCP_LISTEN);
   printf("%u|", g_options.real_port);
   fflush(stdout);
 
@@ -619,6 +881,9 @@ static void start_daemon()
     exit(0);
   }
 
+  /* Write the trace and the status file on SIGUSR1 */
+  status_start();
+
   /* Redirect SIGINT and SIGTERM so that we do a proper shutdown, unregistering
      the printer from DNS-SD */
 #ifdef HAVE_SIGSET /* Use System V signals over POSIX to avoid bugs */
@@ -643,6 +908,11 @@ static void start_daemon()
   NOTE("Using signal handler SIGNAL");
 #endif /* HAVE_SIGSET */
 
+  /* Dispatch USB transfer completions, whether or not the device can
+     report being unplugged */
+  if (usb_start_events(usb_sock))
+    goto cleanup_tcp;
+
   /* Register for unplug event */
   if (usb_can_callback(usb_sock))
     usb_register_callback(usb_sock);
@@ -650,13 +920,18 @@ static void start_daemon()
   /* DNS-SD-broadcast the printer on the local machine so
      that cups-browsed and ippfind will discover it */
   if (g_options.nobroadcast == 0) {
+    status_phase_begin(STATUS_PHASE_DNSSD_INIT);
     if (dnssd_init() == -1)
       goto cleanup_tcp;
-  }
+    status_phase_end(STATUS_PHASE_DNSSD_INIT);
+  } else
+    status_ready();
 
   /* Main loop */
   uint32_t i = 1;
-  pthread_mutex_init(&thread_register_mutex, NULL);
+  if (pool_init(POOL_DEFAULT_MIN_THREADS, g_options.max_threads,
+                g_options.thread_stack_size))
+    goto cleanup_tcp;
   while (!g_options.terminate) {
     struct service_thread_param *args = calloc(1, sizeof(*args));
     if (args == NULL) {
@@ -674,11 +949,33 @@ static void start_daemon()
     /* Attempt to establish a connection to the relevant socket. */
     if (setup_socket_connection(args))
       goto cleanup_thread;
+    trace_instant(i, "accept");
+
+    /* Both threads of a connection need a worker, the socket thread blocks
+       until the printer thread is done. Without two workers to spare the
+       client is turned away like one waiting for a busy printer, which
+       caps the number of open connections. Whether the client may wait
+       for an interface is only decided once it sends a request. */
+    if (pool_reserve(CONN_WORKERS)) {
+      uint32_t retry_after = usb_retry_after(usb_sock);
+      NOTE("Refusing connection from %s, no workers left, retry after %u s",
+           args->tcp->peer, retry_after);
+      trace_instant(i, "refuse");
+      tcp_conn_refuse(args->tcp, retry_after);
+      tcp_conn_close(args->tcp);
+      free(args);
+      continue;
+    }
 
     /* Attempt to start up a new thread to handle the socket's end of
-       communication. */
-    if (setup_communication_thread(&service_connection, args))
-      goto cleanup_thread;
+       communication. With all slots taken, turn the client away but keep
+       serving the others. */
+    if (setup_communication_thread(&service_connection, args)) {
+      pool_unreserve(CONN_WORKERS);
+      tcp_conn_close(args->tcp);
+      free(args);
+      continue;
+    }
 
     i += 2;
 
@@ -701,29 +998,51 @@ static void start_daemon()
   /* Cancel communication threads which did not terminate by themselves when
      stopping ippusbxd, so that no USB communication with the printer can
      happen after the final reset */
-  while (num_service_threads) {
-    NOTE("Thread #%u did not terminate, canceling it now ...",
-	 service_threads[0]->thread_num);
-    i = num_service_threads;
-    pthread_cancel(service_threads[0]->thread_handle);
-    while (i == num_service_threads)
+  while ((i = session_count()) != 0) {
+    session_cancel_one();
+    while (i == session_count())
       usleep(1000000);
   }
 
-  /* Wait for USB unplug event observer thread to terminate */
-  NOTE("Shutting down usb observer thread");
-  pthread_join(g_options.usb_event_thread_handle, NULL);
+  for (int role = 0; role < THREAD_NUM_ROLES; role++) {
+    struct affinity_latency latency;
+    affinity_get_latency(role, &latency);
+    if (latency.count)
+      NOTE("Wake-up latency of %s threads: %llu samples, mean %.1f usec, "
+           "max %llu usec", affinity_role_name(role),
+           (unsigned long long)latency.count,
+           (double)latency.sum_usec / latency.count,
+           (unsigned long long)latency.max_usec);
+  }
+
+  struct pool_stats pool;
+  pool_get_stats(&pool);
+  NOTE("Worker pool: %llu connection threads run on %llu workers, at most "
+       "%u workers and %u queued at once",
+       (unsigned long long)pool.tasks, (unsigned long long)pool.spawned,
+       pool.peak_threads, pool.peak_queued);
+
+  /* Wait for the USB completion engine to terminate */
+  NOTE("Shutting down USB completion engine");
+  usb_stop_events(usb_sock);
+
+  /* Write out what has been traced so far */
+  if (TRACE_ENABLED())
+    trace_dump();
 
   /* TCP clean-up */
   if (g_options.tcp_socket!= NULL)
     tcp_close(g_options.tcp_socket);
   if (g_options.tcp6_socket!= NULL)
     tcp_close(g_options.tcp6_socket);
+  if (g_options.unix_socket != NULL)
+    tcp_close(g_options.unix_socket);
 
  cleanup_usb:
   /* USB clean-up and final reset of the printer */
   if (usb_sock != NULL)
     usb_close(usb_sock);
+  g_options.usb_sock = NULL;
   return;
 }
 
@@ -743,6 +1062,54 @@ static uint16_t strto16dec(const char *str)
   return (uint16_t)val;
 }
 
+/* Parses the comma-separated idle=, request= and response= limits of the
+   --timeouts option. Returns 0 on success. */
+static int parse_timeouts(const char *spec)
+{
+  char *copy = strdup(spec);
+  char *saveptr = NULL;
+  int status = 0;
+
+  if (copy == NULL)
+    return -1;
+
+  for (char *item = strtok_r(copy, ",", &saveptr); item != NULL;
+       item = strtok_r(NULL, ",", &saveptr)) {
+    char *value = strchr(item, '=');
+    char *end;
+    uint32_t *timeout;
+    if (value == NULL) {
+      ERR("Timeouts: Setting \"%s\" has no value", item);
+      status = -1;
+      break;
+    }
+    *value++ = '\0';
+
+    if (strcmp(item, "idle") == 0)
+      timeout = &g_options.idle_timeout;
+    else if (strcmp(item, "request") == 0)
+      timeout = &g_options.request_timeout;
+    else if (strcmp(item, "response") == 0)
+      timeout = &g_options.response_timeout;
+    else {
+      ERR("Timeouts: Unknown setting \"%s\"", item);
+      status = -1;
+      break;
+    }
+
+    long seconds = strtol(value, &end, 10);
+    if (end == value || *end != '\0' || seconds < 0) {
+      ERR("Timeouts: Invalid %s timeout \"%s\"", item, value);
+      status = -1;
+      break;
+    }
+    *timeout = (uint32_t)seconds;
+  }
+
+  free(copy);
+  return status;
+}
+
 int main(int argc, char *argv[])
 {
   int c;
@@ -762,6 +1129,18 @@ int main(int argc, char *argv[])
     {"verbose",      no_argument,       0,  'q' },
     {"no-fork",      no_argument,       0,  'n' },
     {"no-broadcast", no_argument,       0,  'B' },
+    {"trace",        required_argument, 0,  'T' },
+    {"fake-printer", required_argument, 0,  'F' },
+    {"status-file",  required_argument, 0,  'S' },
+    {"unix-socket",  required_argument, 0,  'U' },
+    {"max-threads",  required_argument, 0,  'M' },
+    {"max-waiting",  required_argument, 0,  'W' },
+    {"backlog",      required_argument, 0,  'Q' },
+    {"rate-limit",   required_argument, 0,  'L' },
+    {"timeouts",     required_argument, 0,  't' },
+    {"thread-stack", required_argument, 0,  'k' },
+    {"cpus",         required_argument, 0,  'C' },
+    {"sched",        required_argument, 0,  'R' },
     {"help",         no_argument,       0,  'h' },
     {NULL,           0,                 0,  0   }
   };
@@ -774,8 +1153,19 @@ int main(int argc, char *argv[])
   g_options.product_id = 0;
   g_options.bus = 0;
   g_options.device = 0;
-
-  while ((c = getopt_long(argc, argv, "qnhdp:P:i:s:lv:m:B",
+  g_options.trace_file = NULL;
+  g_options.fake_printer = NULL;
+  g_options.status_file = NULL;
+  g_options.unix_socket_path = NULL;
+  g_options.max_threads = POOL_DEFAULT_MAX_THREADS;
+  g_options.max_waiting = USB_DEFAULT_MAX_WAITING;
+  g_options.listen_backlog = HTTP_MAX_PENDING_CONNS;
+  g_options.thread_stack_size = POOL_DEFAULT_STACK_KIB * 1024;
+  g_options.idle_timeout = default_idle_timeout;
+  g_options.request_timeout = default_request_timeout;
+  g_options.response_timeout = default_response_timeout;
+
+  while ((c = getopt_long(argc, argv, "qnhdp:P:i:s:lv:m:BT:F:S:U:M:W:Q:L:t:k:C:R:",
 			  long_options, &option_index)) != -1) {
     switch (c) {
     case '?':
@@ -851,6 +1241,75 @@ int main(int argc, char *argv[])
     case 'B':
       g_options.nobroadcast = 1;
       break;
+    case 'T':
+      g_options.trace_file = strdup(optarg);
+      break;
+    case 'F':
+      g_options.fake_printer = strdup(optarg);
+      break;
+    case 'S':
+      g_options.status_file = strdup(optarg);
+      break;
+    case 'U':
+      g_options.unix_socket_path = strdup(optarg);
+      break;
+    case 'M':
+      {
+	long threads = atol(optarg);
+	/* Every connection takes two threads */
+	if (threads < 2) {
+	  ERR("The maximum number of threads must be at least 2");
+	  return 4;
+	}
+	g_options.max_threads = (uint32_t)threads;
+	break;
+      }
+    case 'W':
+      {
+	long waiting = atol(optarg);
+	if (waiting < 0) {
+	  ERR("The maximum number of waiting connections must be non-negative");
+	  return 4;
+	}
+	g_options.max_waiting = (uint32_t)waiting;
+	break;
+      }
+    case 'Q':
+      {
+	long backlog = atol(optarg);
+	if (backlog < 0) {
+	  ERR("The connection backlog must be non-negative");
+	  return 4;
+	}
+	g_options.listen_backlog = (int)backlog;
+	break;
+      }
+    case 'L':
+      if (ratelimit_parse(optarg))
+	return 5;
+      break;
+    case 't':
+      if (parse_timeouts(optarg))
+	return 5;
+      break;
+    case 'k':
+      {
+	long kib = atol(optarg);
+	if (kib < 0) {
+	  ERR("Thread stack size must be non-negative");
+	  return 4;
+	}
+	g_options.thread_stack_size = (size_t)kib * 1024;
+	break;
+      }
+    case 'C':
+      if (affinity_parse_cpus(optarg))
+	return 5;
+      break;
+    case 'R':
+      if (affinity_parse_sched(optarg))
+	return 5;
+      break;
     }
   }
 
@@ -893,10 +1352,59 @@ int main(int argc, char *argv[])
 	   "  -n           No-fork mode\n"
 	   "  --no-broadcast\n"
 	   "  -B           No-broadcast mode, do not DNS-SD-broadcast\n"
-	   , argv[0], argv[0], argv[0]);
+	   "  --trace <file>\n"
+	   "  -T <file>    Record per-connection timing and write it to <file> in\n"
+	   "               Chrome trace-event format on SIGUSR1 and on shutdown\n"
+	   "  --fake-printer <spec>\n"
+	   "  -F <spec>    Talk to an emulated IPP-over-USB printer instead of a real\n"
+	   "               one, for benchmarking. <spec> is a comma-separated list of\n"
+	   "               interfaces=<n>, bandwidth=<B/s>, latency=<usec>,\n"
+	   "               think=<msec> and script=<file>, e.g. \"interfaces=3\"\n"
+	   "  --status-file <file>\n"
+	   "  -S <file>    Write startup phase timings and other status as JSON to\n"
+	   "               <file> once the printer is advertised and on SIGUSR1\n"
+	   "  --unix-socket <path>\n"
+	   "  -U <path>    Also accept local clients on the Unix domain socket <path>,\n"
+	   "               or in the abstract namespace if <path> starts with @\n"
+	   "  --max-threads <n>\n"
+	   "  -M <n>       Maximum number of worker threads, two per connection\n"
+	   "               (default: %u)\n"
+	   "  --max-waiting <n>\n"
+	   "  -W <n>       Connections which may wait for a busy printer, others\n"
+	   "               are answered with 503 Service Unavailable (default: %u)\n"
+	   "  --backlog <n>\n"
+	   "  -Q <n>       Connections the kernel queues before they are accepted\n"
+	   "               (default: %u)\n"
+	   "  --rate-limit <spec>\n"
+	   "  -L <spec>    Limit the requests per second of each client, e.g.\n"
+	   "               \"query=5/10,job=1,delay=500\": 5 queries per second\n"
+	   "               with bursts of 10, one job per second, shared fairly\n"
+	   "               among the active clients, and queries refused with 429\n"
+	   "               when they would have to wait more than 500 ms\n"
+	   "  --timeouts <spec>\n"
+	   "  -t <spec>    Seconds a client may stay quiet before its connection is\n"
+	   "               closed, 0 for no limit, e.g. \"idle=%u,request=%u,\n"
+	   "               response=%u\" (the defaults): between requests, in the\n"
+	   "               middle of one and while the printer owes a response\n"
+	   "  --thread-stack <KiB>\n"
+	   "  -k <KiB>     Stack size of the worker threads, 0 for the system\n"
+	   "               default (default: %u)\n"
+	   "  --cpus <role>=<cpus>\n"
+	   "  -C <role>=<cpus> Run the threads of <role> on the given CPUs, e.g.\n"
+	   "               usb=2 or worker=0-1,3. <role> is usb for the USB event\n"
+	   "               thread or worker for the relay threads\n"
+	   "  --sched <role>=<policy>\n"
+	   "  -R <role>=<policy> Scheduling of the threads of <role>: fifo:<priority>,\n"
+	   "               rr:<priority>, nice:<n> or other\n"
+	   , argv[0], argv[0], argv[0], POOL_DEFAULT_MAX_THREADS,
+	   USB_DEFAULT_MAX_WAITING, HTTP_MAX_PENDING_CONNS,
+	   default_idle_timeout, default_request_timeout,
+	   default_response_timeout, POOL_DEFAULT_STACK_KIB);
     return 0;
   }
 
+  /* Startup timing is measured from here */
+  status_init();
   start_daemon();
   NOTE("ippusbxd completed successfully");
   return 0;
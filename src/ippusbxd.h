@@ -2,6 +2,7 @@
 
 #include <libusb.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdint.h>
 
 #include "tcp.h"
@@ -14,9 +15,19 @@ struct service_thread_param {
   struct usb_sock_t *usb_sock;
   /* Represents a connection to a specific USB interface. */
   struct usb_conn_t *usb_conn;
-  pthread_t thread_handle;
   uint32_t thread_num;
+  /* Posted by the printer thread when it is done, takes the place of joining
+     it now that it runs on a pool worker. */
+  sem_t *done;
+  /* Slot of this thread in the session table */
+  uint32_t session_id;
+  /* Slot of the thread which accepted the connection, shared by both
+     threads serving it */
+  uint32_t conn_id;
   pthread_cond_t *cond;
+  /* Sends the client's requests to the printer, shared by both threads so
+     that the printer thread can move it to another interface. */
+  struct usb_writer *writer;
 };
 
 struct libusb_callback_data {
@@ -29,21 +40,48 @@ struct libusb_callback_data {
    * overloading the printer with read requests when there is nothing to read.
    */
   int *empty_response;
+  /* Set if the transfer failed in a way which leaves the interface
+     unusable for this connection. */
+  int *transfer_failed;
+  /* Reads in a row which timed out without any data */
+  int *idle_timeouts;
   uint32_t thread_num;
+  uint32_t conn_id;
   struct tcp_conn_t *tcp;
+  struct usb_conn_t *usb_conn;
   /* The contents of the response from the printer. */
   struct http_packet_t *pkt;
   pthread_mutex_t *read_inflight_mutex;
   pthread_cond_t *read_inflight_cond;
+  /* Time the transfer was submitted, for tracing. */
+  uint64_t submit_time;
+  /* Set to the time the transfer completed, so that the printer thread can
+     tell how long it took to wake up. */
+  uint64_t *completed_at;
 };
 
 /* Constants */
 
+/* Workers a connection occupies, one for each direction */
+#define CONN_WORKERS 2
+
 /* Times to wait in milliseconds before sending another read request to the
    printer. */
 const int initial_backoff = 100;
 const int maximum_backoff = 1000;
 
+/* How often in milliseconds the threads of a connection look at its state
+   while it holds an interface, and while it holds none. */
+const int busy_poll_interval = 100;
+const int idle_poll_interval = 1000;
+
+/* Default limits in seconds on how long a client may stay quiet between
+   transactions, in the middle of sending a request and while waiting for
+   the printer's response. */
+const uint32_t default_idle_timeout = 30;
+const uint32_t default_request_timeout = 30;
+const uint32_t default_response_timeout = 300;
+
 /* Function prototypes */
 
 /* Handles connection requests and
@@ -75,22 +113,17 @@ int allocate_socket_connection(struct service_thread_param *param);
    the connection. */
 int setup_socket_connection(struct service_thread_param *param);
 
-/* Attempts to create a new usb_conn_t and assign it to |param| by acquiring an
-   available usb interface. Returns 0 if the creation of the connection struct
-   was successful, and non-zero if there was an error attempting to acquire the
-   interface. */
-int setup_usb_connection(struct usb_sock_t *usb_sock,
-                         struct service_thread_param *param);
-
-/* Attempts to register a new communication thread to execute the function
-   |routine| with the given |params|. Returns 0 if successful, and a non-zero
-   value otherwise. */
+/* Attempts to register a new communication thread and to hand it to the
+   worker pool to execute the function |routine| with the given |params|.
+   Returns 0 if successful, 1 if there is no free slot in the session table
+   or the pool's queue is full. */
 int setup_communication_thread(void *(*routine)(void *),
                                struct service_thread_param *param);
 
 /* Creates a new libusb_callback_data struct with the given paramaters. */
 struct libusb_callback_data *setup_libusb_callback_data(
     struct http_packet_t *pkt, int *read_inflight, int *empty_response,
+    int *transfer_failed, int *idle_timeouts, uint64_t *completed_at,
     struct service_thread_param *thread_param,
     pthread_mutex_t *read_inflight_mutex);
 
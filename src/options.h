@@ -13,6 +13,7 @@
  * limitations under the License. */
 
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 #include <pthread.h>
 
@@ -30,6 +31,19 @@ struct options {
   uint16_t real_port;
   char *interface;
   enum log_target log_destination;
+  char *trace_file;
+  char *status_file;
+  char *unix_socket_path;
+  char *fake_printer;
+  uint32_t max_threads;
+  uint32_t max_waiting;
+  int listen_backlog;
+  /* Seconds a connection may stay quiet in each transaction state before
+     it is closed, 0 for no limit */
+  uint32_t idle_timeout;
+  uint32_t request_timeout;
+  uint32_t response_timeout;
+  size_t thread_stack_size;
 
   /* Behavior */
   int help_mode;
@@ -49,8 +63,10 @@ struct options {
   int terminate;
   dnssd_t *dnssd_data;
   pthread_t usb_event_thread_handle;
+  struct usb_sock_t *usb_sock;
   struct tcp_sock_t *tcp_socket;
   struct tcp_sock_t *tcp6_socket;
+  struct tcp_sock_t *unix_socket;
 };
 
 extern struct options g_options;
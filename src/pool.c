@@ -0,0 +1,304 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <time.h>
+
+#include "affinity.h"
+#include "logging.h"
+#include "pool.h"
+
+#define POOL_QUEUE_MASK (POOL_QUEUE_SIZE - 1)
+
+/* Bounded multi-producer multi-consumer queue after Dmitry Vyukov. The
+   sequence number of a cell tells whether it is free for the producer at
+   that position or holds work for the consumer at that position. */
+struct pool_cell {
+  uint32_t seq;
+  void *(*routine)(void *);
+  void *arg;
+};
+
+static struct pool_cell pool_cells[POOL_QUEUE_SIZE];
+static uint32_t pool_enqueue_pos = 0;
+static uint32_t pool_dequeue_pos = 0;
+
+/* Counts queued work, idle workers sleep on it */
+static sem_t pool_items;
+static pthread_attr_t pool_attr;
+static uint32_t pool_min_threads = 0;
+static uint32_t pool_max_threads = 0;
+
+static uint32_t pool_threads = 0;
+static uint32_t pool_idle = 0;
+static uint32_t pool_queued = 0;
+static uint32_t pool_reserved = 0;
+static uint32_t pool_peak_threads = 0;
+static uint32_t pool_peak_queued = 0;
+static uint64_t pool_spawned = 0;
+static uint64_t pool_tasks = 0;
+
+static uint32_t pool_load(uint32_t *value)
+{
+  return __sync_fetch_and_add(value, 0);
+}
+
+static void pool_raise_peak(uint32_t *peak, uint32_t value)
+{
+  uint32_t old = pool_load(peak);
+  while (value > old && !__sync_bool_compare_and_swap(peak, old, value))
+    old = pool_load(peak);
+}
+
+static int pool_push(void *(*routine)(void *), void *arg)
+{
+  uint32_t pos = pool_load(&pool_enqueue_pos);
+  struct pool_cell *cell;
+
+  for (;;) {
+    cell = pool_cells + (pos & POOL_QUEUE_MASK);
+    int32_t diff = (int32_t)(pool_load(&cell->seq) - pos);
+    if (diff == 0) {
+      if (__sync_bool_compare_and_swap(&pool_enqueue_pos, pos, pos + 1))
+        break;
+      pos = pool_load(&pool_enqueue_pos);
+    } else if (diff < 0) {
+      /* The consumer one lap behind has not taken its work yet */
+      return -1;
+    } else {
+      pos = pool_load(&pool_enqueue_pos);
+    }
+  }
+
+  cell->routine = routine;
+  cell->arg = arg;
+  __sync_synchronize();
+  cell->seq = pos + 1;
+  return 0;
+}
+
+static int pool_pop(void *(**routine)(void *), void **arg)
+{
+  uint32_t pos = pool_load(&pool_dequeue_pos);
+  struct pool_cell *cell;
+
+  for (;;) {
+    cell = pool_cells + (pos & POOL_QUEUE_MASK);
+    int32_t diff = (int32_t)(pool_load(&cell->seq) - (pos + 1));
+    if (diff == 0) {
+      if (__sync_bool_compare_and_swap(&pool_dequeue_pos, pos, pos + 1))
+        break;
+      pos = pool_load(&pool_dequeue_pos);
+    } else if (diff < 0) {
+      return -1;
+    } else {
+      pos = pool_load(&pool_dequeue_pos);
+    }
+  }
+
+  *routine = cell->routine;
+  *arg = cell->arg;
+  __sync_synchronize();
+  cell->seq = pos + POOL_QUEUE_SIZE;
+  return 0;
+}
+
+/* Lets the calling worker exit if there are more than the minimum */
+static int pool_retire(void)
+{
+  uint32_t threads = pool_load(&pool_threads);
+  while (threads > pool_min_threads) {
+    if (__sync_bool_compare_and_swap(&pool_threads, threads, threads - 1))
+      return 1;
+    threads = pool_load(&pool_threads);
+  }
+  return 0;
+}
+
+static int pool_spawn(void);
+
+/* A connection thread gets cancelled when it does not terminate by itself
+   on shutdown, which takes its worker with it. Work still queued must get
+   to run all the same, it only exits once it sees the termination flag. */
+static void pool_worker_cancelled(void *user_data)
+{
+  (void)user_data;
+  __sync_fetch_and_sub(&pool_threads, 1);
+  if (pool_load(&pool_queued) > pool_load(&pool_idle))
+    pool_spawn();
+}
+
+/* Returns 1 if work was handed to the calling worker, 0 on timeout */
+static int pool_wait(void)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += POOL_IDLE_TIMEOUT;
+
+  __sync_fetch_and_add(&pool_idle, 1);
+  int got = 0;
+  for (;;) {
+    if (sem_timedwait(&pool_items, &deadline) == 0) {
+      got = 1;
+      break;
+    }
+    if (errno != EINTR)
+      break;
+  }
+  __sync_fetch_and_sub(&pool_idle, 1);
+
+  /* Work queued after the timeout but before the idle count dropped was
+     not given an extra worker, so it has to be picked up here. */
+  if (!got && sem_trywait(&pool_items) == 0)
+    got = 1;
+  return got;
+}
+
+static void *pool_worker(void *user_data)
+{
+  (void)user_data;
+  void *(*routine)(void *);
+  void *arg;
+
+  /* Only the connection threads themselves may be cancelled */
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+  affinity_apply(THREAD_ROLE_WORKER);
+
+  for (;;) {
+    if (!pool_wait()) {
+      if (pool_retire())
+        break;
+      continue;
+    }
+
+    /* The semaphore is only posted once the work is in the queue, but
+       another worker may be between the two steps of taking a cell */
+    while (pool_pop(&routine, &arg))
+      sched_yield();
+    __sync_fetch_and_sub(&pool_queued, 1);
+    __sync_fetch_and_add(&pool_tasks, 1);
+
+    pthread_cleanup_push(pool_worker_cancelled, NULL);
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    routine(arg);
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+    pthread_setcanceltype(PTHREAD_CANCEL_DEFERRED, NULL);
+    pthread_cleanup_pop(0);
+  }
+
+  return NULL;
+}
+
+static int pool_spawn(void)
+{
+  uint32_t threads = pool_load(&pool_threads);
+  do {
+    if (threads >= pool_max_threads)
+      return -1;
+  } while (!__sync_bool_compare_and_swap(&pool_threads, threads, threads + 1));
+  pool_raise_peak(&pool_peak_threads, threads + 1);
+
+  pthread_t handle;
+  int status = pthread_create(&handle, &pool_attr, &pool_worker, NULL);
+  if (status) {
+    ERR("Failed to spawn worker thread, error %d", status);
+    __sync_fetch_and_sub(&pool_threads, 1);
+    return -1;
+  }
+  __sync_fetch_and_add(&pool_spawned, 1);
+  return 0;
+}
+
+int pool_init(uint32_t min_threads, uint32_t max_threads, size_t stack_size)
+{
+  for (uint32_t i = 0; i < POOL_QUEUE_SIZE; i++)
+    pool_cells[i].seq = i;
+  if (sem_init(&pool_items, 0, 0)) {
+    ERR("Failed to create worker pool semaphore");
+    return -1;
+  }
+
+  pthread_attr_init(&pool_attr);
+  pthread_attr_setdetachstate(&pool_attr, PTHREAD_CREATE_DETACHED);
+  if (stack_size != 0) {
+    if (stack_size < (size_t)PTHREAD_STACK_MIN)
+      stack_size = (size_t)PTHREAD_STACK_MIN;
+    if (pthread_attr_setstacksize(&pool_attr, stack_size))
+      WARN("Stack size of %zu bytes rejected, using the default", stack_size);
+  }
+
+  pool_max_threads = max_threads > 0 ? max_threads : 1;
+  pool_min_threads = min_threads < pool_max_threads ? min_threads
+                                                    : pool_max_threads;
+  for (uint32_t i = 0; i < pool_min_threads; i++)
+    if (pool_spawn())
+      return -1;
+
+  pthread_attr_getstacksize(&pool_attr, &stack_size);
+  NOTE("Worker pool: %u to %u threads, %zu KiB stacks", pool_min_threads,
+       pool_max_threads, stack_size / 1024);
+  return 0;
+}
+
+int pool_submit(void *(*routine)(void *), void *arg)
+{
+  if (pool_push(routine, arg)) {
+    ERR("Worker pool queue is full");
+    return 1;
+  }
+  uint32_t queued = __sync_add_and_fetch(&pool_queued, 1);
+  pool_raise_peak(&pool_peak_queued, queued);
+  sem_post(&pool_items);
+
+  /* Workers run a connection each until it closes, so there is one more
+     needed whenever there is more work than idle workers. Hitting the
+     maximum leaves the work queued until a worker frees up. */
+  if (queued > pool_load(&pool_idle))
+    pool_spawn();
+  return 0;
+}
+
+int pool_reserve(uint32_t count)
+{
+  uint32_t reserved = pool_load(&pool_reserved);
+  do {
+    if (reserved + count > pool_max_threads)
+      return 1;
+  } while (!__sync_bool_compare_and_swap(&pool_reserved, reserved,
+                                         reserved + count));
+  return 0;
+}
+
+void pool_unreserve(uint32_t count)
+{
+  __sync_fetch_and_sub(&pool_reserved, count);
+}
+
+void pool_get_stats(struct pool_stats *stats)
+{
+  stats->threads = pool_load(&pool_threads);
+  stats->idle = pool_load(&pool_idle);
+  stats->queued = pool_load(&pool_queued);
+  stats->reserved = pool_load(&pool_reserved);
+  stats->peak_threads = pool_load(&pool_peak_threads);
+  stats->peak_queued = pool_load(&pool_peak_queued);
+  stats->spawned = __sync_fetch_and_add(&pool_spawned, 0);
+  stats->tasks = __sync_fetch_and_add(&pool_tasks, 0);
+}
@@ -0,0 +1,64 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Pool of worker threads running the connection threads. A few workers are
+   started up front, more are added while every worker is busy, up to the
+   maximum, and workers idle for POOL_IDLE_TIMEOUT seconds exit again down
+   to the minimum. Work is handed over through a fixed-size lock-free
+   queue. */
+
+/* Slots in the hand-over queue, must be a power of 2 */
+#define POOL_QUEUE_SIZE 256
+
+/* Seconds a worker above the minimum waits for work before it exits */
+#define POOL_IDLE_TIMEOUT 30
+
+#define POOL_DEFAULT_MIN_THREADS 2
+#define POOL_DEFAULT_MAX_THREADS 64
+#define POOL_DEFAULT_STACK_KIB 256
+
+struct pool_stats {
+  uint32_t threads;
+  uint32_t idle;
+  uint32_t queued;
+  uint32_t reserved;
+  uint32_t peak_threads;
+  uint32_t peak_queued;
+  uint64_t spawned;
+  uint64_t tasks;
+};
+
+/* Starts |min_threads| workers with stacks of |stack_size| bytes, or the
+   system default if 0. Returns 0 on success. */
+int pool_init(uint32_t min_threads, uint32_t max_threads, size_t stack_size);
+
+/* Queues |routine| to be run with |arg| on a worker. Returns 0 on success
+   and 1 if the queue is full. */
+int pool_submit(void *(*routine)(void *), void *arg);
+
+/* Work which blocks until other work it submits has run, such as the two
+   halves of a connection, has to reserve the workers for all of it before
+   submitting any, or the pool can fill up with work waiting for work which
+   never gets a worker. Reserves |count| of the maximum number of workers.
+   Returns 0 on success and 1 if not that many are left. */
+int pool_reserve(uint32_t count);
+
+/* Gives back workers reserved with pool_reserve(). */
+void pool_unreserve(uint32_t count);
+
+void pool_get_stats(struct pool_stats *stats);
@@ -0,0 +1,249 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "logging.h"
+#include "options.h"
+#include "ratelimit.h"
+#include "tcp.h"
+
+struct ratelimit_config {
+  /* Requests per second, 0 if not limited */
+  double rate;
+  double burst;
+};
+
+struct ratelimit_client {
+  /* Empty while the slot is unused */
+  char key[TCP_PEER_MAX];
+  uint64_t last_seen;
+  double tokens[RATELIMIT_NUM_CLASSES];
+  uint64_t refilled[RATELIMIT_NUM_CLASSES];
+};
+
+static const char *ratelimit_class_names[RATELIMIT_NUM_CLASSES] = {
+  "query", "job"
+};
+
+static struct ratelimit_config ratelimit_configs[RATELIMIT_NUM_CLASSES];
+static uint32_t ratelimit_delay_ms = RATELIMIT_DEFAULT_DELAY_MS;
+
+static struct ratelimit_client ratelimit_clients[RATELIMIT_MAX_CLIENTS];
+static uint64_t ratelimit_delayed = 0;
+static uint64_t ratelimit_refused = 0;
+static pthread_mutex_t ratelimit_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int ratelimit_parse(const char *spec)
+{
+  char *copy = strdup(spec);
+  char *saveptr = NULL;
+  int status = 0;
+
+  if (copy == NULL)
+    return -1;
+
+  for (char *item = strtok_r(copy, ",", &saveptr); item != NULL;
+       item = strtok_r(NULL, ",", &saveptr)) {
+    char *value = strchr(item, '=');
+    char *end;
+    if (value == NULL) {
+      ERR("Rate limit: Setting \"%s\" has no value", item);
+      status = -1;
+      break;
+    }
+    *value++ = '\0';
+
+    if (strcmp(item, "delay") == 0) {
+      long delay = strtol(value, &end, 10);
+      if (end == value || *end != '\0' || delay < 0) {
+        ERR("Rate limit: Invalid delay \"%s\"", value);
+        status = -1;
+        break;
+      }
+      ratelimit_delay_ms = (uint32_t)delay;
+      continue;
+    }
+
+    int class;
+    for (class = 0; class < RATELIMIT_NUM_CLASSES; class++)
+      if (strcmp(item, ratelimit_class_names[class]) == 0)
+        break;
+    if (class == RATELIMIT_NUM_CLASSES) {
+      ERR("Rate limit: Unknown setting \"%s\"", item);
+      status = -1;
+      break;
+    }
+
+    struct ratelimit_config *config = ratelimit_configs + class;
+    config->rate = strtod(value, &end);
+    config->burst = config->rate < 1 ? 1 : config->rate;
+    if (*end == '/') {
+      char *burst = end + 1;
+      config->burst = strtod(burst, &end);
+      if (end == burst)
+        config->burst = -1;
+    }
+    if (end == value || *end != '\0' || config->rate < 0 ||
+        config->burst < 1) {
+      ERR("Rate limit: Invalid rate \"%s\" for %s requests", value,
+          ratelimit_class_names[class]);
+      status = -1;
+      break;
+    }
+  }
+
+  free(copy);
+  return status;
+}
+
+int ratelimit_enabled(void)
+{
+  for (int class = 0; class < RATELIMIT_NUM_CLASSES; class++)
+    if (ratelimit_configs[class].rate > 0)
+      return 1;
+  return 0;
+}
+
+/* Returns the slot of |key|, taking over the least recently seen one if it
+   has none. Called with ratelimit_mutex held. */
+static struct ratelimit_client *ratelimit_lookup(const char *key,
+                                                 uint64_t now)
+{
+  struct ratelimit_client *oldest = ratelimit_clients;
+
+  for (int i = 0; i < RATELIMIT_MAX_CLIENTS; i++) {
+    struct ratelimit_client *client = ratelimit_clients + i;
+    if (strcmp(client->key, key) == 0)
+      return client;
+    if (client->last_seen < oldest->last_seen)
+      oldest = client;
+  }
+
+  /* A new client starts with full buckets */
+  snprintf(oldest->key, sizeof(oldest->key), "%s", key);
+  for (int class = 0; class < RATELIMIT_NUM_CLASSES; class++) {
+    oldest->tokens[class] = ratelimit_configs[class].burst;
+    oldest->refilled[class] = now;
+  }
+  return oldest;
+}
+
+/* Number of clients which sent requests recently. Called with
+   ratelimit_mutex held. */
+static uint32_t ratelimit_active(uint64_t now)
+{
+  uint64_t window = (uint64_t)RATELIMIT_ACTIVE_SEC * 1000000;
+  uint32_t active = 0;
+
+  for (int i = 0; i < RATELIMIT_MAX_CLIENTS; i++) {
+    struct ratelimit_client *client = ratelimit_clients + i;
+    if (client->key[0] != '\0' && now - client->last_seen < window)
+      active++;
+  }
+  return active;
+}
+
+/* Takes a token from the bucket of |class| of |key|. Returns 0 if there
+   was one, otherwise the milliseconds until there will be. */
+static uint32_t ratelimit_take(const char *key, enum ratelimit_class class)
+{
+  struct ratelimit_config *config = ratelimit_configs + class;
+  uint64_t now = affinity_now();
+  uint32_t wait_ms = 0;
+
+  pthread_mutex_lock(&ratelimit_mutex);
+  struct ratelimit_client *client = ratelimit_lookup(key, now);
+  client->last_seen = now;
+
+  /* Every active client refills at an equal share of the rate */
+  double rate = config->rate / ratelimit_active(now);
+  double tokens = client->tokens[class] +
+                  rate * (double)(now - client->refilled[class]) / 1e6;
+  if (tokens > config->burst)
+    tokens = config->burst;
+  client->refilled[class] = now;
+
+  if (tokens >= 1)
+    tokens -= 1;
+  else
+    wait_ms = (uint32_t)((1 - tokens) * 1000 / rate) + 1;
+  client->tokens[class] = tokens;
+  pthread_mutex_unlock(&ratelimit_mutex);
+  return wait_ms;
+}
+
+int ratelimit_admit(const char *client, enum ratelimit_class class,
+                    int can_refuse, uint32_t *retry_after)
+{
+  uint32_t waited = 0;
+
+  if (ratelimit_configs[class].rate <= 0)
+    return 0;
+
+  for (;;) {
+    uint32_t wait_ms = ratelimit_take(client, class);
+    if (wait_ms == 0)
+      break;
+    if (waited + wait_ms > ratelimit_delay_ms) {
+      if (can_refuse) {
+        NOTE("Rate limit: Refusing %s request from %s",
+             ratelimit_class_names[class], client);
+        pthread_mutex_lock(&ratelimit_mutex);
+        ratelimit_refused++;
+        pthread_mutex_unlock(&ratelimit_mutex);
+        *retry_after = (wait_ms + 999) / 1000;
+        return -1;
+      }
+      /* Part of the request may already be with the printer, it goes
+         ahead after the delay at the latest */
+      if (waited >= ratelimit_delay_ms)
+        break;
+      wait_ms = ratelimit_delay_ms - waited;
+    }
+    /* Wake up now and then so that shutting down is not held up */
+    if (wait_ms > 100)
+      wait_ms = 100;
+    usleep(wait_ms * 1000);
+    waited += wait_ms;
+    if (g_options.terminate)
+      return 0;
+  }
+
+  if (waited) {
+    NOTE("Rate limit: Delayed %s request from %s by %u ms",
+         ratelimit_class_names[class], client, waited);
+    pthread_mutex_lock(&ratelimit_mutex);
+    ratelimit_delayed++;
+    pthread_mutex_unlock(&ratelimit_mutex);
+  }
+  return 0;
+}
+
+void ratelimit_get_stats(struct ratelimit_stats *stats)
+{
+  uint64_t now = affinity_now();
+
+  pthread_mutex_lock(&ratelimit_mutex);
+  stats->clients = ratelimit_active(now);
+  stats->delayed = ratelimit_delayed;
+  stats->refused = ratelimit_refused;
+  pthread_mutex_unlock(&ratelimit_mutex);
+}
@@ -0,0 +1,63 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <stdint.h>
+
+/* Per-client request rate limiting. Every client, identified by its address
+   or, on the Unix domain socket, by its uid, has a token bucket per class
+   of request. The rate configured for a class is the printer's: it is
+   shared between the clients which sent requests within the last
+   RATELIMIT_ACTIVE_SEC seconds, so that no client gets more than its fair
+   share however often it polls. */
+
+enum ratelimit_class {
+  /* Idempotent requests such as status queries and web pages */
+  RATELIMIT_QUERY,
+  /* Everything else, print and scan jobs in particular */
+  RATELIMIT_JOB,
+  RATELIMIT_NUM_CLASSES
+};
+
+/* Clients tracked at once, the least recently seen one makes way */
+#define RATELIMIT_MAX_CLIENTS 64
+#define RATELIMIT_ACTIVE_SEC 10
+/* How long a request is delayed at most before it is refused instead */
+#define RATELIMIT_DEFAULT_DELAY_MS 1000
+
+struct ratelimit_stats {
+  uint32_t clients;
+  uint64_t delayed;
+  uint64_t refused;
+};
+
+/* Parses a comma-separated list of "<class>=<rate>[/<burst>]", with class
+   "query" or "job" and rate in requests per second, and "delay=<msec>",
+   e.g. "query=5/10,delay=500". A class without a rate is not limited, the
+   burst defaults to one second's worth of requests. Returns 0 on
+   success. */
+int ratelimit_parse(const char *spec);
+
+/* Returns non-zero if any class is limited. */
+int ratelimit_enabled(void);
+
+/* Lets a request of |class| from |client| go ahead, after waiting for a
+   token if need be, and returns 0. If |can_refuse| is set and the wait
+   would be longer than the configured delay, returns non-zero instead and
+   sets |retry_after| to the seconds until the next token. A request which
+   cannot be refused is held back for at most the delay. */
+int ratelimit_admit(const char *client, enum ratelimit_class class,
+                    int can_refuse, uint32_t *retry_after);
+
+void ratelimit_get_stats(struct ratelimit_stats *stats);
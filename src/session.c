@@ -0,0 +1,221 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "logging.h"
+#include "session.h"
+
+/* Slot ids carry the slot index in the low bits and a generation counter,
+   bumped on every reuse of the slot, in the high bits. An id held on to
+   after its connection went away therefore never matches the slot's next
+   user. */
+#define SESSION_INDEX_BITS 16
+#define SESSION_INDEX_MASK ((1u << SESSION_INDEX_BITS) - 1)
+
+struct session_slot {
+  /* SESSION_ID_NONE while the slot is free */
+  uint32_t id;
+  uint32_t generation;
+  uint32_t thread_num;
+  /* Worker running the thread, valid once |is_started| is set */
+  pthread_t thread_handle;
+  int is_started;
+  /* Set once session_cancel_one() cancelled the thread, so that the next
+     call moves on to another one */
+  int is_cancelled;
+  /* Whether this thread started the connection, the partner thread only
+     holds a slot so that it can be cancelled on shutdown */
+  int is_connection;
+  char peer[TCP_PEER_MAX];
+  int interface;
+  uint64_t start_ms;
+  uint64_t bytes_to_printer;
+  uint64_t bytes_to_client;
+};
+
+static struct session_slot session_slots[SESSION_MAX];
+/* Stack of free slot indices */
+static uint32_t session_free[SESSION_MAX];
+static uint32_t session_num_free = 0;
+static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t session_now_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+/* The slot |id| refers to, NULL if |id| is stale or was never handed out */
+static struct session_slot *session_lookup(uint32_t id)
+{
+  uint32_t index = (id & SESSION_INDEX_MASK) - 1;
+  if (id == SESSION_ID_NONE || index >= SESSION_MAX)
+    return NULL;
+  struct session_slot *slot = session_slots + index;
+  return __sync_fetch_and_add(&slot->id, 0) == id ? slot : NULL;
+}
+
+void session_init(void)
+{
+  pthread_mutex_lock(&session_mutex);
+  memset(session_slots, 0, sizeof(session_slots));
+  /* Hand out the low indices first */
+  for (uint32_t i = 0; i < SESSION_MAX; i++)
+    session_free[i] = SESSION_MAX - 1 - i;
+  session_num_free = SESSION_MAX;
+  pthread_mutex_unlock(&session_mutex);
+}
+
+uint32_t session_register(uint32_t thread_num, const struct tcp_conn_t *tcp,
+                          uint32_t *conn_id)
+{
+  pthread_mutex_lock(&session_mutex);
+  if (session_num_free == 0) {
+    pthread_mutex_unlock(&session_mutex);
+    ERR("Registering thread #%u: All %u connection slots are taken",
+        thread_num, SESSION_MAX);
+    return SESSION_ID_NONE;
+  }
+
+  uint32_t index = session_free[--session_num_free];
+  struct session_slot *slot = session_slots + index;
+  /* The index is stored off by one so that no id is SESSION_ID_NONE */
+  slot->generation = (slot->generation + 1) & SESSION_INDEX_MASK;
+  if (slot->generation == 0)
+    slot->generation = 1;
+  uint32_t id = (slot->generation << SESSION_INDEX_BITS) | (index + 1);
+
+  slot->thread_num = thread_num;
+  slot->is_started = 0;
+  slot->is_cancelled = 0;
+  slot->is_connection = *conn_id == SESSION_ID_NONE;
+  snprintf(slot->peer, sizeof(slot->peer), "%s",
+           tcp != NULL ? tcp->peer : "");
+  slot->interface = -1;
+  slot->start_ms = session_now_ms();
+  slot->bytes_to_printer = 0;
+  slot->bytes_to_client = 0;
+  __sync_synchronize();
+  slot->id = id;
+  if (slot->is_connection)
+    *conn_id = id;
+  uint32_t count = SESSION_MAX - session_num_free;
+  pthread_mutex_unlock(&session_mutex);
+
+  NOTE("Registering thread #%u, %u threads running", thread_num, count);
+  return id;
+}
+
+void session_unregister(uint32_t id)
+{
+  pthread_mutex_lock(&session_mutex);
+  struct session_slot *slot = session_lookup(id);
+  if (slot == NULL) {
+    pthread_mutex_unlock(&session_mutex);
+    ERR("Unregistering thread: Cannot unregister, id %#x not found", id);
+    return;
+  }
+  uint32_t thread_num = slot->thread_num;
+  slot->id = SESSION_ID_NONE;
+  session_free[session_num_free++] = (uint32_t)(slot - session_slots);
+  uint32_t count = SESSION_MAX - session_num_free;
+  pthread_mutex_unlock(&session_mutex);
+
+  NOTE("Unregistering thread #%u, %u threads running", thread_num, count);
+}
+
+void session_started(uint32_t id)
+{
+  pthread_mutex_lock(&session_mutex);
+  struct session_slot *slot = session_lookup(id);
+  if (slot != NULL) {
+    slot->thread_handle = pthread_self();
+    slot->is_started = 1;
+  }
+  pthread_mutex_unlock(&session_mutex);
+}
+
+uint32_t session_count(void)
+{
+  pthread_mutex_lock(&session_mutex);
+  uint32_t count = SESSION_MAX - session_num_free;
+  pthread_mutex_unlock(&session_mutex);
+  return count;
+}
+
+void session_cancel_one(void)
+{
+  pthread_mutex_lock(&session_mutex);
+  for (uint32_t i = 0; i < SESSION_MAX; i++) {
+    struct session_slot *slot = session_slots + i;
+    if (slot->id == SESSION_ID_NONE || !slot->is_started ||
+        slot->is_cancelled)
+      continue;
+    NOTE("Thread #%u did not terminate, canceling it now ...",
+         slot->thread_num);
+    pthread_cancel(slot->thread_handle);
+    slot->is_cancelled = 1;
+    break;
+  }
+  pthread_mutex_unlock(&session_mutex);
+}
+
+void session_set_interface(uint32_t conn_id, int interface)
+{
+  struct session_slot *slot = session_lookup(conn_id);
+  if (slot != NULL)
+    slot->interface = interface;
+}
+
+void session_add_bytes(uint32_t conn_id, size_t to_printer, size_t to_client)
+{
+  /* Called for every packet relayed, so no lock; the counters are only
+     ever added to */
+  struct session_slot *slot = session_lookup(conn_id);
+  if (slot == NULL)
+    return;
+  if (to_printer)
+    __sync_fetch_and_add(&slot->bytes_to_printer, (uint64_t)to_printer);
+  if (to_client)
+    __sync_fetch_and_add(&slot->bytes_to_client, (uint64_t)to_client);
+}
+
+size_t session_snapshot(struct session_info *out, size_t max)
+{
+  size_t n = 0;
+  uint64_t now = session_now_ms();
+
+  pthread_mutex_lock(&session_mutex);
+  for (uint32_t i = 0; i < SESSION_MAX && n < max; i++) {
+    struct session_slot *slot = session_slots + i;
+    if (slot->id == SESSION_ID_NONE || !slot->is_connection)
+      continue;
+    struct session_info *info = out + n++;
+    info->id = slot->id;
+    info->thread_num = slot->thread_num;
+    memcpy(info->peer, slot->peer, sizeof(info->peer));
+    info->interface = slot->interface;
+    info->bytes_to_printer = __sync_fetch_and_add(&slot->bytes_to_printer, 0);
+    info->bytes_to_client = __sync_fetch_and_add(&slot->bytes_to_client, 0);
+    info->age_ms = now - slot->start_ms;
+  }
+  pthread_mutex_unlock(&session_mutex);
+
+  return n;
+}
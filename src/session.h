@@ -0,0 +1,75 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tcp.h"
+
+/* Number of preallocated slots. Every thread serving a connection takes
+   one, so this is twice the number of concurrent clients. */
+#define SESSION_MAX 1024
+
+/* Never handed out, marks a parameter block which is not registered */
+#define SESSION_ID_NONE 0
+
+/* One live client connection, as reported by session_snapshot() */
+struct session_info {
+  uint32_t id;
+  uint32_t thread_num;
+  char peer[TCP_PEER_MAX];
+  /* USB interface serving the connection, -1 while none is acquired */
+  int interface;
+  uint64_t bytes_to_printer;
+  uint64_t bytes_to_client;
+  uint64_t age_ms;
+};
+
+/* Sets up the free list. Must be called before the first registration. */
+void session_init(void);
+
+/* Takes a free slot for thread |thread_num| and returns the slot's id. If |*conn_id| is
+   SESSION_ID_NONE the thread starts a new connection with the client on
+   |tcp|, and |*conn_id| is set to the new id; the partner thread passes the
+   same |conn_id| and so shares that connection's counters. Returns
+   SESSION_ID_NONE when all slots are taken. O(1). */
+uint32_t session_register(uint32_t thread_num, const struct tcp_conn_t *tcp,
+                          uint32_t *conn_id);
+
+/* Called by the thread of slot |id| once it runs on a worker, from then on
+   it can be cancelled by session_cancel_one(). */
+void session_started(uint32_t id);
+
+/* Releases the slot of |id|. Stale ids are ignored. O(1). */
+void session_unregister(uint32_t id);
+
+/* Number of registered threads */
+uint32_t session_count(void);
+
+/* Cancels one started thread, used on shutdown for the threads which did
+   not terminate by themselves. Every thread is cancelled only once, later
+   calls move on to the next one. Threads still waiting for a worker are left
+   alone, they see the termination flag as soon as they run. */
+void session_cancel_one(void);
+
+/* Per connection bookkeeping, keyed by |param->conn_id|. Stale ids are
+   ignored. */
+void session_set_interface(uint32_t conn_id, int interface);
+void session_add_bytes(uint32_t conn_id, size_t to_printer, size_t to_client);
+
+/* Copies up to |max| live connections into |out| and returns how many were
+   copied. */
+size_t session_snapshot(struct session_info *out, size_t max);
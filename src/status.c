@@ -0,0 +1,280 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "affinity.h"
+#include "logging.h"
+#include "options.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "session.h"
+#include "status.h"
+#include "trace.h"
+#include "usb.h"
+
+struct status_timing {
+  /* Microseconds since process start, 0 if not recorded */
+  uint64_t begin;
+  uint64_t end;
+};
+
+static const char *status_phase_names[STATUS_NUM_PHASES] = {
+  "usb_open",
+  "tcp_listen",
+  "dnssd_init",
+  "dnssd_register",
+  "ipp_probe",
+  "fax_probe",
+  "escl_probe",
+  "advertised",
+  "ready"
+};
+
+static struct timespec status_start_time;
+static struct status_timing status_timings[STATUS_NUM_PHASES];
+static int status_is_ready = 0;
+static sigset_t status_sigset;
+static pthread_t status_thread_handle;
+static pthread_mutex_t status_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Microseconds since status_init(), never 0 */
+static uint64_t status_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t usec = (int64_t)(now.tv_sec - status_start_time.tv_sec) * 1000000 +
+                 (now.tv_nsec - status_start_time.tv_nsec) / 1000;
+  return usec > 0 ? (uint64_t)usec : 1;
+}
+
+void status_init(void)
+{
+  clock_gettime(CLOCK_MONOTONIC, &status_start_time);
+  if (!TRACE_ENABLED() && g_options.status_file == NULL)
+    return;
+
+  /* SIGUSR1 gets handled synchronously by the status thread, so block it in
+     every thread spawned from now on. */
+  sigemptyset(&status_sigset);
+  sigaddset(&status_sigset, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &status_sigset, NULL);
+}
+
+static void *status_on_signal(void *user_data)
+{
+  (void)user_data;
+  int sig;
+
+  while (!g_options.terminate) {
+    if (sigwait(&status_sigset, &sig) != 0 || sig != SIGUSR1)
+      continue;
+    if (TRACE_ENABLED())
+      trace_dump();
+    if (g_options.status_file)
+      status_write();
+  }
+
+  return NULL;
+}
+
+void status_start(void)
+{
+  if (!TRACE_ENABLED() && g_options.status_file == NULL)
+    return;
+
+  if (pthread_create(&status_thread_handle, NULL, &status_on_signal, NULL)) {
+    ERR("Failed to start status thread");
+    return;
+  }
+  pthread_detach(status_thread_handle);
+}
+
+void status_phase_begin(enum status_phase phase)
+{
+  pthread_mutex_lock(&status_mutex);
+  if (!status_is_ready) {
+    status_timings[phase].begin = status_now();
+    status_timings[phase].end = 0;
+  }
+  pthread_mutex_unlock(&status_mutex);
+}
+
+void status_phase_end(enum status_phase phase)
+{
+  pthread_mutex_lock(&status_mutex);
+  if (!status_is_ready)
+    status_timings[phase].end = status_now();
+  pthread_mutex_unlock(&status_mutex);
+}
+
+void status_ready(void)
+{
+  char line[512];
+  size_t len = 0;
+
+  pthread_mutex_lock(&status_mutex);
+  if (status_is_ready) {
+    pthread_mutex_unlock(&status_mutex);
+    return;
+  }
+  status_timings[STATUS_PHASE_READY].end = status_now();
+  status_is_ready = 1;
+
+  /* Durations for the stages, time since start for the milestones */
+  for (int i = 0; i < STATUS_NUM_PHASES; i++) {
+    struct status_timing *t = status_timings + i;
+    if (t->end == 0 || len >= sizeof(line))
+      continue;
+    len += (size_t)snprintf(line + len, sizeof(line) - len, " %s=%.1fms",
+                            status_phase_names[i],
+                            (t->end - t->begin) / 1000.0);
+  }
+  pthread_mutex_unlock(&status_mutex);
+
+  NOTE("Startup:%s", line);
+  if (g_options.status_file)
+    status_write();
+}
+
+/* Writes |str| as a JSON string */
+static void status_write_string(FILE *out, const char *str)
+{
+  fputc('"', out);
+  for (; *str != '\0'; str++) {
+    unsigned char c = (unsigned char)*str;
+    if (c == '"' || c == '\\')
+      fprintf(out, "\\%c", c);
+    else if (c < 0x20)
+      fprintf(out, "\\u%04x", c);
+    else
+      fputc(c, out);
+  }
+  fputc('"', out);
+}
+
+int status_write(void)
+{
+  struct status_timing timings[STATUS_NUM_PHASES];
+  char path[4096];
+  int ready;
+
+  if (g_options.status_file == NULL)
+    return -1;
+
+  pthread_mutex_lock(&status_mutex);
+  memcpy(timings, status_timings, sizeof(timings));
+  ready = status_is_ready;
+  pthread_mutex_unlock(&status_mutex);
+
+  /* Written next to the final name and moved over it, so readers never see
+     a partial file. */
+  snprintf(path, sizeof(path), "%s.tmp", g_options.status_file);
+  FILE *out = fopen(path, "w");
+  if (out == NULL) {
+    ERR("Failed to open status file %s", path);
+    return -1;
+  }
+
+  fprintf(out, "{\"pid\":%d,\"port\":%u,", (int)getpid(),
+          g_options.real_port);
+  if (g_options.unix_socket != NULL) {
+    fprintf(out, "\"unix_socket\":");
+    status_write_string(out, g_options.unix_socket_path);
+    fprintf(out, ",");
+  }
+  fprintf(out, "\"uptime_ms\":%.1f,\n", status_now() / 1000.0);
+  fprintf(out, "\"startup\":{\"ready\":%s,\"phases\":{", ready ? "true"
+                                                               : "false");
+  int first = 1;
+  for (int i = 0; i < STATUS_NUM_PHASES; i++) {
+    if (timings[i].end == 0)
+      continue;
+    fprintf(out, "%s\n\"%s\":{\"start_ms\":%.3f,\"end_ms\":%.3f}",
+            first ? "" : ",", status_phase_names[i],
+            timings[i].begin / 1000.0, timings[i].end / 1000.0);
+    first = 0;
+  }
+  struct pool_stats pool;
+  pool_get_stats(&pool);
+  fprintf(out, "\n}},\n\"pool\":{\"threads\":%u,\"idle\":%u,\"queued\":%u,"
+          "\"reserved\":%u,\"peak_threads\":%u,\"peak_queued\":%u,"
+          "\"spawned\":%llu,\"tasks\":%llu},", pool.threads, pool.idle,
+          pool.queued, pool.reserved, pool.peak_threads, pool.peak_queued,
+          (unsigned long long)pool.spawned, (unsigned long long)pool.tasks);
+  struct usb_admission_stats admission = {0, 0, 0};
+  if (g_options.usb_sock != NULL)
+    usb_get_admission_stats(g_options.usb_sock, &admission);
+  fprintf(out, "\n\"admission\":{\"waiting\":%u,\"max_waiting\":%u,"
+          "\"refused\":%llu,\"hold_avg_ms\":%u},", admission.waiting,
+          g_options.max_waiting, (unsigned long long)admission.refused,
+          admission.hold_avg_ms);
+  struct ratelimit_stats rate;
+  ratelimit_get_stats(&rate);
+  fprintf(out, "\n\"rate_limit\":{\"enabled\":%s,\"clients\":%u,"
+          "\"delayed\":%llu,\"refused\":%llu},",
+          ratelimit_enabled() ? "true" : "false", rate.clients,
+          (unsigned long long)rate.delayed, (unsigned long long)rate.refused);
+  fprintf(out, "\n\"latency\":{");
+  for (int role = 0; role < THREAD_NUM_ROLES; role++) {
+    struct affinity_latency latency;
+    affinity_get_latency(role, &latency);
+    fprintf(out, "%s\n\"%s\":{\"count\":%llu,\"mean_usec\":%.1f,"
+            "\"max_usec\":%llu,\"buckets\":[", role ? "," : "",
+            affinity_role_name(role), (unsigned long long)latency.count,
+            latency.count ? (double)latency.sum_usec / latency.count : 0.0,
+            (unsigned long long)latency.max_usec);
+    for (int i = 0; i < AFFINITY_LATENCY_BUCKETS; i++) {
+      uint64_t bound = affinity_latency_bound(i);
+      if (bound == UINT64_MAX)
+        fprintf(out, "%s{\"le_usec\":null,\"count\":%llu}", i ? "," : "",
+                (unsigned long long)latency.buckets[i]);
+      else
+        fprintf(out, "%s{\"le_usec\":%llu,\"count\":%llu}", i ? "," : "",
+                (unsigned long long)bound,
+                (unsigned long long)latency.buckets[i]);
+    }
+    fprintf(out, "]}");
+  }
+  fprintf(out, "\n},\n\"connections\":[");
+
+  struct session_info *conns = calloc(SESSION_MAX, sizeof(*conns));
+  size_t num_conns = conns != NULL ? session_snapshot(conns, SESSION_MAX) : 0;
+  for (size_t i = 0; i < num_conns; i++) {
+    struct session_info *c = conns + i;
+    fprintf(out, "%s\n{\"id\":%u,\"thread\":%u,\"peer\":\"%s\","
+            "\"interface\":%d,\"bytes_to_printer\":%llu,"
+            "\"bytes_to_client\":%llu,\"age_ms\":%llu}",
+            i ? "," : "", c->id, c->thread_num, c->peer, c->interface,
+            (unsigned long long)c->bytes_to_printer,
+            (unsigned long long)c->bytes_to_client,
+            (unsigned long long)c->age_ms);
+  }
+  free(conns);
+  fprintf(out, "\n]}\n");
+
+  if (fclose(out) != 0 || rename(path, g_options.status_file) != 0) {
+    ERR("Failed to write status file %s", g_options.status_file);
+    unlink(path);
+    return -1;
+  }
+  return 0;
+}
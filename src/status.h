@@ -0,0 +1,56 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <stdint.h>
+
+#include "options.h"
+
+/* Stages of getting from process start to a printer usable through DNS-SD.
+   The probe stages overlap, they run in parallel. */
+enum status_phase {
+  STATUS_PHASE_USB_OPEN,
+  STATUS_PHASE_TCP_LISTEN,
+  STATUS_PHASE_DNSSD_INIT,
+  STATUS_PHASE_DNSSD_REGISTER,
+  STATUS_PHASE_IPP_PROBE,
+  STATUS_PHASE_FAX_PROBE,
+  STATUS_PHASE_ESCL_PROBE,
+  /* Milestones, only their end is recorded */
+  STATUS_PHASE_ADVERTISED,
+  STATUS_PHASE_READY,
+  STATUS_NUM_PHASES
+};
+
+/* Records the start time and, if there is a trace or status file to write,
+   blocks SIGUSR1 so that it can be picked up by the status thread. Must be
+   called after option parsing and before any thread is created. */
+void status_init(void);
+
+/* Starts the thread which, on SIGUSR1, writes the trace file if tracing is
+   on and the status file if one was given with --status-file. */
+void status_start(void);
+
+/* Mark the beginning and the end of |phase|. Phases are only recorded up to
+   the point where the daemon is ready. */
+void status_phase_begin(enum status_phase phase);
+void status_phase_end(enum status_phase phase);
+
+/* Marks the daemon ready, logs the phase timings on a single line and
+   writes the status file. Later calls do nothing. */
+void status_ready(void);
+
+/* Writes the status as JSON to the file given with --status-file. Returns 0
+   on success. */
+int status_write(void);
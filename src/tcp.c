@@ -20,12 +20,16 @@
 #include <pthread.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <ifaddrs.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <net/if.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <stddef.h>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -97,7 +101,7 @@ struct tcp_sock_t *tcp_open(uint16_t port, char* interface)
   }
 
   /* Let kernel over-accept max number of connections */
-  if (listen(this->sd, HTTP_MAX_PENDING_CONNS) < 0) {
+  if (listen(this->sd, g_options.listen_backlog) < 0) {
     ERR("IPv4 listen failed on socket");
     goto error;
   }
@@ -182,7 +186,7 @@ struct tcp_sock_t *tcp6_open(uint16_t port, char* interface)
   }
 
   /* Let kernel over-accept max number of connections */
-  if (listen(this->sd, HTTP_MAX_PENDING_CONNS) < 0) {
+  if (listen(this->sd, g_options.listen_backlog) < 0) {
     ERR("IPv6 listen failed on socket");
     goto error;
   }
@@ -199,9 +203,115 @@ struct tcp_sock_t *tcp6_open(uint16_t port, char* interface)
   return NULL;
 }
 
+/* Connects to the Unix domain socket at |addr| and returns the errno of the
+   attempt, 0 if something accepts connections there. */
+static int tcp_unix_probe(const struct sockaddr_un *addr, socklen_t addr_size)
+{
+  int sd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sd < 0)
+    return errno;
+  int status = 0;
+  if (connect(sd, (const struct sockaddr *)addr, addr_size) < 0)
+    status = errno;
+  close(sd);
+  return status;
+}
+
+struct tcp_sock_t *tcp_unix_open(const char *path)
+{
+  struct sockaddr_un addr;
+  socklen_t addr_size;
+  int is_abstract = path[0] == '@';
+  size_t len = strlen(path);
+
+  struct tcp_sock_t *this = calloc(1, sizeof *this);
+  if (this == NULL) {
+    ERR("Unix: callocing this failed");
+    goto error;
+  }
+
+  this->sd = -1;
+  if (len < 2 && is_abstract) {
+    ERR("Unix: abstract socket name %s is empty", path);
+    goto error;
+  }
+  if (len >= sizeof(addr.sun_path)) {
+    ERR("Unix: socket path %s is too long", path);
+    goto error;
+  }
+
+  memset(&addr, 0, sizeof addr);
+  addr.sun_family = AF_UNIX;
+  if (is_abstract) {
+    /* Abstract names start with a NUL byte and are not NUL terminated */
+    memcpy(addr.sun_path + 1, path + 1, len - 1);
+    addr_size = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + len);
+  } else {
+    memcpy(addr.sun_path, path, len);
+    addr_size = sizeof addr;
+
+    /* A socket file left behind by an earlier instance would make bind()
+       fail, but refuse to remove anything else, or a socket somebody still
+       listens on */
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+      if (!S_ISSOCK(st.st_mode)) {
+        ERR("Unix: %s exists and is not a socket", path);
+        goto error;
+      }
+      if (tcp_unix_probe(&addr, addr_size) != ECONNREFUSED) {
+        ERR("Unix: %s is in use", path);
+        goto error;
+      }
+      unlink(path);
+    }
+  }
+
+  this->sd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (this->sd < 0) {
+    ERR("Unix socket open failed");
+    goto error;
+  }
+
+  NOTE("Unix: Binding to %s", path);
+  if (bind(this->sd, (struct sockaddr *)&addr, addr_size) < 0) {
+    ERR("Unix bind to %s failed: %s", path, strerror(errno));
+    goto error;
+  }
+  if (!is_abstract) {
+    this->unix_path = strdup(path);
+    /* Reachable by every local user, just like the loopback port */
+    if (chmod(path, 0666) < 0)
+      WARN("Unix: could not make %s accessible: %s", path, strerror(errno));
+  }
+
+  if (listen(this->sd, g_options.listen_backlog) < 0) {
+    ERR("Unix listen failed on socket");
+    goto error;
+  }
+
+  return this;
+
+ error:
+  if (this != NULL) {
+    if (this->sd != -1)
+      close(this->sd);
+    if (this->unix_path != NULL) {
+      unlink(this->unix_path);
+      free(this->unix_path);
+    }
+    free(this);
+  }
+  return NULL;
+}
+
 void tcp_close(struct tcp_sock_t *this)
 {
   close(this->sd);
+  if (this->unix_path != NULL) {
+    unlink(this->unix_path);
+    free(this->unix_path);
+  }
   free(this);
 }
 
@@ -222,43 +332,33 @@ uint16_t tcp_port_number_get(struct tcp_sock_t *sock)
   return 0;
 }
 
-struct http_packet_t *tcp_packet_get(struct tcp_conn_t *tcp)
+ssize_t tcp_recv(struct tcp_conn_t *tcp, uint8_t *buffer, size_t length)
 {
-  /* Allocate packet for incoming message. */
-  struct http_packet_t *pkt = packet_new();
-  if (pkt == NULL) {
-    ERR("failed to create packet for incoming tcp message");
-    goto error;
-  }
-
-  struct timeval tv;
-  tv.tv_sec = 3;
-  tv.tv_usec = 0;
-  if (setsockopt(tcp->sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))) {
-    ERR("TCP: Setting options for tcp connection socket failed");
-    goto error;
-  }
-
-  ssize_t gotten_size = recv(tcp->sd, pkt->buffer, pkt->buffer_capacity, 0);
+  ssize_t gotten_size = recv(tcp->sd, buffer, length, 0);
 
   if (gotten_size < 0) {
     int errno_saved = errno;
     ERR("recv failed with err %d:%s", errno_saved, strerror(errno_saved));
     tcp->is_closed = 1;
-    goto error;
+    return -1;
   }
 
   if (gotten_size == 0) {
     tcp->is_closed = 1;
   }
-
-  pkt->filled_size = gotten_size;
-  return pkt;
-
- error:
-  if (pkt != NULL)
-    packet_free(pkt);
-  return NULL;
+  size_t filled = (size_t)gotten_size;
+
+  /* Take what else is already queued so that it goes to the printer in one
+     large transfer. */
+  while (gotten_size > 0 && filled < length) {
+    gotten_size = recv(tcp->sd, buffer + filled, length - filled,
+                       MSG_DONTWAIT);
+    if (gotten_size == 0)
+      tcp->is_closed = 1;
+    else if (gotten_size > 0)
+      filled += (size_t)gotten_size;
+  }
+  return (ssize_t)filled;
 }
 
 int tcp_packet_send(struct tcp_conn_t *conn, struct http_packet_t *pkt)
@@ -291,8 +391,48 @@ int tcp_packet_send(struct tcp_conn_t *conn, struct http_packet_t *pkt)
 }
 
 
+/* Fills in |peer| and |client| of |conn| */
+static void tcp_format_peer(struct tcp_conn_t *conn,
+                            const struct sockaddr_storage *peer)
+{
+  char host[INET6_ADDRSTRLEN];
+
+  if (peer->ss_family == AF_INET) {
+    const struct sockaddr_in *in = (const struct sockaddr_in *)peer;
+    if (inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host)) != NULL) {
+      snprintf(conn->peer, sizeof(conn->peer), "%s:%u", host,
+               ntohs(in->sin_port));
+      snprintf(conn->client, sizeof(conn->client), "%s", host);
+      return;
+    }
+  } else if (peer->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)peer;
+    if (inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host)) != NULL) {
+      snprintf(conn->peer, sizeof(conn->peer), "[%s]:%u", host,
+               ntohs(in6->sin6_port));
+      snprintf(conn->client, sizeof(conn->client), "[%s]", host);
+      return;
+    }
+  } else if (peer->ss_family == AF_UNIX) {
+    /* Local clients have no address worth showing, name the process */
+    struct ucred cred;
+    socklen_t cred_size = sizeof(cred);
+    if (getsockopt(conn->sd, SOL_SOCKET, SO_PEERCRED, &cred,
+                   &cred_size) == 0) {
+      snprintf(conn->peer, sizeof(conn->peer), "local pid %d uid %u",
+               (int)cred.pid, (unsigned)cred.uid);
+      snprintf(conn->client, sizeof(conn->client), "local uid %u",
+               (unsigned)cred.uid);
+      return;
+    }
+  }
+  snprintf(conn->peer, sizeof(conn->peer), "unknown");
+  snprintf(conn->client, sizeof(conn->client), "unknown");
+}
+
 struct tcp_conn_t *tcp_conn_select(struct tcp_sock_t *sock,
-				   struct tcp_sock_t *sock6)
+				   struct tcp_sock_t *sock6,
+				   struct tcp_sock_t *sock_unix)
 {
   struct tcp_conn_t *conn = calloc(1, sizeof *conn);
   if (conn == NULL) {
@@ -313,6 +453,11 @@ struct tcp_conn_t *tcp_conn_select(struct tcp_sock_t *sock,
     if (sock6->sd > nfds)
       nfds = sock6->sd;
   }
+  if (sock_unix) {
+    FD_SET(sock_unix->sd, &rfds);
+    if (sock_unix->sd > nfds)
+      nfds = sock_unix->sd;
+  }
   if (nfds == 0) {
     ERR("No valid TCP socket supplied.");
     goto error;
@@ -325,12 +470,17 @@ struct tcp_conn_t *tcp_conn_select(struct tcp_sock_t *sock,
     ERR("Failed to open tcp connection");
     goto error;
   }
+  struct sockaddr_storage peer;
+  socklen_t peer_size = sizeof(peer);
   if (sock && FD_ISSET(sock->sd, &rfds)) {
-    conn->sd = accept(sock->sd, NULL, NULL);
+    conn->sd = accept(sock->sd, (struct sockaddr *)&peer, &peer_size);
     NOTE ("Using IPv4");
   } else if (sock6 && FD_ISSET(sock6->sd, &rfds)) {
-    conn->sd = accept(sock6->sd, NULL, NULL);
+    conn->sd = accept(sock6->sd, (struct sockaddr *)&peer, &peer_size);
     NOTE ("Using IPv6");
+  } else if (sock_unix && FD_ISSET(sock_unix->sd, &rfds)) {
+    conn->sd = accept(sock_unix->sd, (struct sockaddr *)&peer, &peer_size);
+    NOTE ("Using Unix domain socket");
   } else {
     ERR("select failed");
     goto error;
@@ -339,6 +489,15 @@ struct tcp_conn_t *tcp_conn_select(struct tcp_sock_t *sock,
     ERR("accept failed");
     goto error;
   }
+  tcp_format_peer(conn, &peer);
+
+  /* Reads only follow a poll for data, this just keeps a misbehaving
+     socket from blocking the thread for good */
+  struct timeval tv;
+  tv.tv_sec = 3;
+  tv.tv_usec = 0;
+  if (setsockopt(conn->sd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)))
+    WARN("TCP: Setting the receive timeout for %s failed", conn->peer);
 
   /* Attempt to initialize the connection's mutex. */
   if (pthread_mutex_init(&conn->mutex, NULL))
@@ -361,44 +520,225 @@ void tcp_conn_close(struct tcp_conn_t *conn)
   shutdown(conn->sd, SHUT_RDWR);
 
   close(conn->sd);
+  for (uint32_t i = 0; i < conn->writer_depth; i++)
+    packet_free(conn->writer[(conn->writer_head + i) % TCP_WRITER_MAX_DEPTH]);
   pthread_mutex_destroy(&conn->mutex);
   free(conn);
 }
 
-/* Poll the tcp socket to determine if it is ready to transmit data. */
-int poll_tcp_socket(struct tcp_conn_t *tcp)
+void tcp_conn_abort(struct tcp_conn_t *conn)
+{
+  conn->is_closed = 1;
+  shutdown(conn->sd, SHUT_RDWR);
+}
+
+static uint64_t tcp_now_ms(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+void tcp_conn_refuse(struct tcp_conn_t *conn, uint32_t retry_after)
+{
+  static const char body[] = "The printer is busy, please try again later.\n";
+  char response[256];
+  uint8_t discard[1024];
+  size_t discarded = 0;
+  ssize_t n;
+
+  /* Unread request data would make the close reset the connection, which
+     may discard the response before the client read it */
+  while (discarded < TCP_REFUSE_MAX_DISCARD &&
+         (n = recv(conn->sd, discard, sizeof(discard), MSG_DONTWAIT)) > 0)
+    discarded += (size_t)n;
+
+  int length = snprintf(response, sizeof(response),
+                        "HTTP/1.1 503 Service Unavailable\r\n"
+                        "Retry-After: %u\r\n"
+                        "Content-Type: text/plain\r\n"
+                        "Content-Length: %zu\r\n"
+                        "Connection: close\r\n"
+                        "\r\n"
+                        "%s", retry_after, sizeof(body) - 1, body);
+  if (send(conn->sd, response, (size_t)length,
+           MSG_NOSIGNAL | MSG_DONTWAIT) != length)
+    NOTE("TCP: could not send the 503 response to %s", conn->peer);
+  shutdown(conn->sd, SHUT_WR);
+  conn->is_closed = 1;
+
+  /* Stops once the client closed its end, went quiet or used up what it
+     is allowed */
+  uint64_t deadline = tcp_now_ms() + TCP_REFUSE_WAIT_MS;
+  int timeout = TCP_REFUSE_WAIT_MS;
+  while (timeout > 0 && discarded < TCP_REFUSE_MAX_DISCARD &&
+         tcp_wait_readable(conn, timeout) &&
+         (n = recv(conn->sd, discard, sizeof(discard), MSG_DONTWAIT)) > 0) {
+    discarded += (size_t)n;
+    uint64_t now = tcp_now_ms();
+    timeout = now < deadline ? (int)(deadline - now) : 0;
+    if (timeout > TCP_REFUSE_QUIET_MS)
+      timeout = TCP_REFUSE_QUIET_MS;
+  }
+}
+
+int tcp_writer_push(struct tcp_conn_t *conn, struct http_packet_t *pkt)
+{
+  pthread_mutex_lock(&conn->mutex);
+  int status = tcp_writer_push_locked(conn, pkt);
+  pthread_mutex_unlock(&conn->mutex);
+  return status;
+}
+
+int tcp_writer_push_locked(struct tcp_conn_t *conn, struct http_packet_t *pkt)
+{
+  if (conn->writer_depth == TCP_WRITER_MAX_DEPTH)
+    return -1;
+  conn->writer[(conn->writer_head + conn->writer_depth) %
+               TCP_WRITER_MAX_DEPTH] = pkt;
+  conn->writer_depth++;
+  return 0;
+}
+
+int tcp_writer_send(struct tcp_conn_t *conn, const uint8_t *data,
+                    size_t length)
+{
+  size_t sent = 0;
+  int status = 0;
+
+  pthread_mutex_lock(&conn->mutex);
+  /* Nothing else is being written while the queue is empty */
+  if (conn->writer_depth == 0) {
+    ssize_t n = send(conn->sd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n > 0)
+      sent = (size_t)n;
+  }
+  /* The last slot is left to the read from the printer in flight, which
+     was only submitted while there was room for its data */
+  if (sent < length && conn->writer_depth >= TCP_WRITER_MAX_DEPTH - 1) {
+    status = -1;
+  } else if (sent < length) {
+    struct http_packet_t *pkt = packet_new();
+    if (pkt == NULL || length - sent > pkt->buffer_capacity) {
+      if (pkt != NULL)
+        packet_free(pkt);
+      status = -1;
+    } else {
+      memcpy(pkt->buffer, data + sent, length - sent);
+      pkt->filled_size = length - sent;
+      status = tcp_writer_push_locked(conn, pkt);
+      if (status)
+        packet_free(pkt);
+    }
+  }
+  pthread_mutex_unlock(&conn->mutex);
+  return status;
+}
+
+void tcp_writer_lock(struct tcp_conn_t *conn)
+{
+  pthread_mutex_lock(&conn->mutex);
+}
+
+void tcp_writer_unlock(struct tcp_conn_t *conn)
+{
+  pthread_mutex_unlock(&conn->mutex);
+}
+
+ssize_t tcp_writer_flush(struct tcp_conn_t *conn)
+{
+  size_t total = 0;
+  ssize_t status = 0;
+
+  /* Only one thread flushes, so the head stays put while the lock is
+     dropped for sending; pushes only ever add at the tail. */
+  pthread_mutex_lock(&conn->mutex);
+  while (conn->writer_depth > 0 && !conn->is_closed) {
+    struct http_packet_t *pkt = conn->writer[conn->writer_head];
+    size_t offset = conn->writer_sent;
+    pthread_mutex_unlock(&conn->mutex);
+
+    ssize_t sent = send(conn->sd, pkt->buffer + offset,
+                        pkt->filled_size - offset,
+                        MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    pthread_mutex_lock(&conn->mutex);
+    if (sent < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        break;
+      if (errno == EPIPE)
+        conn->is_closed = 1;
+      else {
+        ERR("Failed to sent data over TCP");
+        status = -1;
+      }
+      break;
+    }
+
+    total += (size_t)sent;
+    conn->writer_sent += (size_t)sent;
+    if (conn->writer_sent >= pkt->filled_size) {
+      conn->writer_head = (conn->writer_head + 1) % TCP_WRITER_MAX_DEPTH;
+      conn->writer_depth--;
+      conn->writer_sent = 0;
+      packet_free(pkt);
+    }
+  }
+  if (total)
+    conn->is_active = 1;
+  pthread_mutex_unlock(&conn->mutex);
+
+  if (total)
+    NOTE("TCP: sent %lu bytes", total);
+  return status < 0 ? status : (ssize_t)total;
+}
+
+uint32_t tcp_writer_depth(struct tcp_conn_t *conn)
+{
+  pthread_mutex_lock(&conn->mutex);
+  uint32_t depth = conn->writer_depth;
+  pthread_mutex_unlock(&conn->mutex);
+  return depth;
+}
+
+void tcp_writer_wait(struct tcp_conn_t *conn, int timeout)
+{
+  struct pollfd poll_fd;
+  poll_fd.fd = conn->sd;
+  poll_fd.events = POLLOUT;
+  poll(&poll_fd, 1, timeout);
+}
+
+int poll_tcp_socket(struct tcp_conn_t *tcp, int timeout)
 {
   struct pollfd poll_fd;
   poll_fd.fd = tcp->sd;
   poll_fd.events = POLLIN;
   const int nfds = 1;
-  const int timeout = 5000;  /* 5 seconds. */
 
   int result = poll(&poll_fd, nfds, timeout);
   if (result < 0) {
     ERR("poll failed with error %d:%s", errno, strerror(errno));
     tcp->is_closed = 1;
-  } else if (result == 0) {
-    /* In the case where the poll timed out, check to see whether or not data
-     * has recently been sent from the printer along the socket. If so, then we
-     * keep the connection alive an reset the is_active flag. Otherwise, close
-     * the connection. */
-    if (get_is_active(tcp)) {
-      set_is_active(tcp, 0);
-    } else {
-      tcp->is_closed = 1;
-    }
-  } else {
-    if (poll_fd.revents != POLLIN) {
-      ERR("poll returned an unexpected event");
-      tcp->is_closed = 1;
-      return -1;
-    }
+  } else if (result > 0 && !(poll_fd.revents & POLLIN)) {
+    /* Hung up or reset by the client, with nothing left to read */
+    NOTE("TCP: %s: poll returned events 0x%x", tcp->peer, poll_fd.revents);
+    tcp->is_closed = 1;
+    return -1;
   }
 
   return result;
 }
 
+int tcp_wait_readable(struct tcp_conn_t *tcp, int timeout)
+{
+  struct pollfd poll_fd;
+  poll_fd.fd = tcp->sd;
+  poll_fd.events = POLLIN;
+  return poll(&poll_fd, 1, timeout) > 0;
+}
+
 int get_is_active(struct tcp_conn_t *tcp)
 {
   pthread_mutex_lock(&tcp->mutex);
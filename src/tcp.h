@@ -24,38 +24,113 @@
 
 #include "http.h"
 
+/* Default length of the kernel's queue of connections not accepted yet
+   (--backlog) */
 #define HTTP_MAX_PENDING_CONNS 0
 #define BUFFER_STEP (1 << 13)
 #define BUFFER_STEP_RATIO (2)
 #define BUFFER_INIT_RATIO (1)
 #define BUFFER_MAX (1 << 20)
 
+/* Packets from the printer waiting to be written to a client. The printer
+   thread stops reading from the printer while this many are queued. */
+#define TCP_WRITER_MAX_DEPTH 16
+
+/* A refused client's request may still be on its way. Closing the
+   connection before it arrived would reset it and with it the 503, so its
+   request is read until nothing more follows within TCP_REFUSE_QUIET_MS,
+   in milliseconds. This happens on the accept thread, so a client which
+   keeps sending is cut off after TCP_REFUSE_WAIT_MS in total or
+   TCP_REFUSE_MAX_DISCARD bytes, whichever comes first. */
+#define TCP_REFUSE_WAIT_MS 100
+#define TCP_REFUSE_QUIET_MS 10
+#define TCP_REFUSE_MAX_DISCARD (64 * 1024)
+
+/* Room for "[<IPv6 address>]:<port>" */
+#define TCP_PEER_MAX (INET6_ADDRSTRLEN + 8)
+
 struct tcp_sock_t {
   int sd;
   struct sockaddr_in6 info;
   socklen_t info_size;
+  /* File system path of a Unix domain socket, removed again on close */
+  char *unix_path;
 };
 
 struct tcp_conn_t {
   int sd;
   int is_closed;
+  /* Set whenever printer output is queued or written to the client */
   int is_active;
   pthread_mutex_t mutex;
+  /* Address of the client, as recorded at accept() time */
+  char peer[TCP_PEER_MAX];
+  /* The same without the port, or the uid of a local client, telling
+     clients rather than connections apart */
+  char client[TCP_PEER_MAX];
+  /* Writer queue, a ring of packets protected by |mutex|. |writer_sent|
+     bytes of the first one have already gone out. */
+  struct http_packet_t *writer[TCP_WRITER_MAX_DEPTH];
+  uint32_t writer_head;
+  uint32_t writer_depth;
+  size_t writer_sent;
 };
 
 struct tcp_sock_t *tcp_open(uint16_t, char* interface);
 struct tcp_sock_t *tcp6_open(uint16_t, char* interface);
+/* Listens on the Unix domain socket |path|, or on the abstract socket
+   |path| + 1 if it starts with '@'. A stale socket file is replaced. */
+struct tcp_sock_t *tcp_unix_open(const char *path);
 void tcp_close(struct tcp_sock_t *);
 uint16_t tcp_port_number_get(struct tcp_sock_t *);
 
 struct tcp_conn_t *tcp_conn_select(struct tcp_sock_t *sock,
-				   struct tcp_sock_t *sock6);
+				   struct tcp_sock_t *sock6,
+				   struct tcp_sock_t *sock_unix);
 void tcp_conn_close(struct tcp_conn_t *);
+/* Marks |conn| closed and shuts the socket down so that both threads of the
+   connection stop, without freeing anything. */
+void tcp_conn_abort(struct tcp_conn_t *);
+/* Answers the client with 503 Service Unavailable and a Retry-After of
+   |retry_after| seconds without blocking, then shuts the connection down
+   for writing and discards the request, see TCP_REFUSE_WAIT_MS. The
+   connection still has to be closed. */
+void tcp_conn_refuse(struct tcp_conn_t *, uint32_t retry_after);
 
-struct http_packet_t *tcp_packet_get(struct tcp_conn_t *);
+/* Waits for data from the client and reads up to |length| bytes of it into
+   |buffer|, taking whatever has already arrived beyond the first read.
+   Returns the number of bytes read or -1. */
+ssize_t tcp_recv(struct tcp_conn_t *, uint8_t *buffer, size_t length);
 int tcp_packet_send(struct tcp_conn_t *, struct http_packet_t *);
 
-int poll_tcp_socket(struct tcp_conn_t *tcp);
+/* Queues |pkt| to be written to the client and takes ownership of it.
+   Never blocks, so it can be called from the USB completion engine.
+   Returns -1 if the queue is full. */
+int tcp_writer_push(struct tcp_conn_t *, struct http_packet_t *pkt);
+/* The same for callers which queue a packet together with other changes,
+   holding the queue with tcp_writer_lock(). */
+int tcp_writer_push_locked(struct tcp_conn_t *, struct http_packet_t *pkt);
+void tcp_writer_lock(struct tcp_conn_t *);
+/* Writes |length| bytes of |data|, at most one packet's worth, to the
+   client after everything queued, right away if the queue is empty.
+   Whatever the socket does not take is queued, but never into the last
+   free slot, which belongs to the printer's data. Returns 0 on success. */
+int tcp_writer_send(struct tcp_conn_t *, const uint8_t *data, size_t length);
+void tcp_writer_unlock(struct tcp_conn_t *);
+/* Writes as much of the queue as the socket takes without blocking.
+   Returns the number of bytes written or -1 on a write error. */
+ssize_t tcp_writer_flush(struct tcp_conn_t *);
+uint32_t tcp_writer_depth(struct tcp_conn_t *);
+/* Waits up to |timeout| milliseconds for the socket to take more data. */
+void tcp_writer_wait(struct tcp_conn_t *, int timeout);
+
+/* Waits up to |timeout| milliseconds for data from the client. Returns 1
+   if some arrived, 0 on timeout and -1 once the connection is gone. How
+   long a client may stay quiet is left to the caller. */
+int poll_tcp_socket(struct tcp_conn_t *tcp, int timeout);
+/* Returns non-zero if data from the client arrives within |timeout|
+   milliseconds. */
+int tcp_wait_readable(struct tcp_conn_t *tcp, int timeout);
 
 int get_is_active(struct tcp_conn_t *tcp);
 void set_is_active(struct tcp_conn_t *tcp, int val);
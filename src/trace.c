@@ -0,0 +1,157 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "options.h"
+#include "trace.h"
+
+struct trace_event {
+  /* Sequence number of the event, used by the dump to skip slots which are
+     being overwritten at the same moment. */
+  uint64_t seq;
+  uint64_t ts;
+  uint64_t dur;
+  uint64_t bytes;
+  const char *name;
+  uint32_t thread_num;
+  char phase;
+};
+
+static struct trace_event *trace_events = NULL;
+static uint64_t trace_next = 0;
+
+static uint64_t trace_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+static void trace_record(uint32_t thread_num, const char *name, char phase,
+                         uint64_t ts, uint64_t dur, size_t bytes)
+{
+  uint64_t seq = __sync_fetch_and_add(&trace_next, 1);
+  struct trace_event *ev = trace_events + (seq % TRACE_MAX_EVENTS);
+
+  /* Invalidate the slot while it is being filled. */
+  ev->seq = UINT64_MAX;
+  __sync_synchronize();
+  ev->ts = ts;
+  ev->dur = dur;
+  ev->bytes = bytes;
+  ev->name = name;
+  ev->thread_num = thread_num;
+  ev->phase = phase;
+  __sync_synchronize();
+  ev->seq = seq;
+}
+
+int trace_init(void)
+{
+  trace_events = calloc(TRACE_MAX_EVENTS, sizeof(*trace_events));
+  if (trace_events == NULL) {
+    ERR("Failed to allocate trace buffer");
+    return -1;
+  }
+
+  NOTE("Tracing enabled, send SIGUSR1 to write %s", g_options.trace_file);
+  return 0;
+}
+
+uint64_t trace_begin(void)
+{
+  if (trace_events == NULL)
+    return 0;
+  return trace_now();
+}
+
+void trace_span(uint32_t thread_num, const char *name, uint64_t start,
+                size_t bytes)
+{
+  if (trace_events == NULL || start == 0)
+    return;
+  uint64_t now = trace_now();
+  trace_record(thread_num, name, 'X', start, now - start, bytes);
+}
+
+void trace_instant(uint32_t thread_num, const char *name)
+{
+  if (trace_events == NULL)
+    return;
+  trace_record(thread_num, name, 'i', trace_now(), 0, 0);
+}
+
+int trace_dump(void)
+{
+  if (trace_events == NULL)
+    return -1;
+
+  FILE *out = fopen(g_options.trace_file, "w");
+  if (out == NULL) {
+    ERR("Failed to open trace file %s", g_options.trace_file);
+    return -1;
+  }
+
+  uint64_t end = trace_next;
+  uint64_t begin = end > TRACE_MAX_EVENTS ? end - TRACE_MAX_EVENTS : 0;
+  uint64_t written = 0;
+  int pid = (int)getpid();
+  int first = 1;
+
+  fprintf(out, "{\"traceEvents\":[");
+  for (uint64_t seq = begin; seq < end; seq++) {
+    volatile struct trace_event *slot =
+        trace_events + (seq % TRACE_MAX_EVENTS);
+    /* The copy only counts if the slot held the same event before and
+       after it was taken. */
+    if (slot->seq != seq)
+      continue;
+    __sync_synchronize();
+    struct trace_event ev;
+    ev.ts = slot->ts;
+    ev.dur = slot->dur;
+    ev.bytes = slot->bytes;
+    ev.name = slot->name;
+    ev.thread_num = slot->thread_num;
+    ev.phase = slot->phase;
+    __sync_synchronize();
+    if (slot->seq != seq)
+      continue;
+
+    fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"ippusbxd\",\"ph\":\"%c\","
+            "\"ts\":%llu,\"pid\":%d,\"tid\":%u",
+            first ? "" : ",", ev.name, ev.phase, (unsigned long long)ev.ts,
+            pid, ev.thread_num);
+    if (ev.phase == 'X')
+      fprintf(out, ",\"dur\":%llu,\"args\":{\"bytes\":%llu}",
+              (unsigned long long)ev.dur, (unsigned long long)ev.bytes);
+    else
+      fprintf(out, ",\"s\":\"t\"");
+    fprintf(out, "}");
+    first = 0;
+    written++;
+  }
+  fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+  fclose(out);
+
+  NOTE("Wrote %llu trace events to %s",
+       (unsigned long long)written, g_options.trace_file);
+  return 0;
+}
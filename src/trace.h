@@ -0,0 +1,50 @@
+/* Copyright (C) 2014 Daniel Dressler and contributors
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License. */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "options.h"
+
+/* Number of events kept in memory. Once the buffer is full the oldest events
+   get overwritten. */
+#define TRACE_MAX_EVENTS (1 << 16)
+
+/* Tracing is switched on by giving a trace file with --trace. */
+#define TRACE_ENABLED() (g_options.trace_file != NULL)
+
+/* Allocates the event buffer. The trace file gets written on SIGUSR1 by the
+   status thread, see status.h. The buffer is never freed, as the detached
+   status thread and the relay threads may still use it while the daemon
+   exits. Returns 0 on success. */
+int trace_init(void);
+
+/* Returns a timestamp to be passed to trace_span() once the traced operation
+   has completed, or 0 if tracing is off. */
+uint64_t trace_begin(void);
+
+/* Records a span which started at |start| and ends now. |thread_num| is the
+   number of the communication thread the span belongs to, |name| must be a
+   string literal and |bytes| is the amount of data the operation moved. */
+void trace_span(uint32_t thread_num, const char *name, uint64_t start,
+                size_t bytes);
+
+/* Records a point-in-time event. */
+void trace_instant(uint32_t thread_num, const char *name);
+
+/* Writes all buffered events to the trace file in Chrome trace-event format,
+   which can be loaded into chrome://tracing or Perfetto. Returns 0 on
+   success. */
+int trace_dump(void);
@@ -13,21 +13,27 @@
  * limitations under the License. */
 
 #define  _XOPEN_SOURCE 600
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <time.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 
 #include <libusb.h>
 
 #include "options.h"
+#include "affinity.h"
 #include "dnssd.h"
 #include "logging.h"
 #include "http.h"
 #include "tcp.h"
 #include "usb.h"
+#include "fake_printer.h"
 
 #define IGNORE(x) (void)(x)
 
@@ -182,7 +188,8 @@ static void try_detach_kernel_driver(struct usb_sock_t *usb,
 }
 
 static int try_claim_usb_interface(struct usb_sock_t *usb,
-                                   struct usb_interface *uf) {
+                                   struct usb_interface *uf)
+{
   /* Claim the whole interface */
   int status = 0;
   do {
@@ -207,10 +214,30 @@ static int try_claim_usb_interface(struct usb_sock_t *usb,
   return 0;
 }
 
-struct usb_sock_t *usb_open()
+static int usb_libusb_claim(struct usb_sock_t *usb, struct usb_interface *uf)
+{
+  /* Try to make the kernel release the usb interface. */
+  try_detach_kernel_driver(usb, uf);
+
+  /* Try to claim the usb interface. */
+  if (try_claim_usb_interface(usb, uf)) {
+    ERR("Failed to claim usb interface #%d", uf->interface_number);
+    return -1;
+  }
+
+  /* Select the IPP-USB alt setting of the interface. */
+  if (libusb_set_interface_alt_setting(
+          usb->printer, uf->libusb_interface_index, uf->interface_alt)) {
+    ERR("Failed to set alt setting for interface #%d",
+        uf->interface_number);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int usb_libusb_open(struct usb_sock_t *usb)
 {
-  int status_lock;
-  struct usb_sock_t *usb = calloc(1, sizeof *usb);
   int status = 1;
   usb->device_id = NULL;
   status = libusb_init(&usb->context);
@@ -393,40 +420,27 @@ struct usb_sock_t *usb_open()
 	const struct libusb_endpoint_descriptor *end;
 	end = &alt->endpoint[end_i];
 
-	usb->max_packet_size = end->wMaxPacketSize;
+	/* Bits 11 and 12 only matter for isochronous and interrupt
+	   endpoints. */
+	uint16_t max_packet = end->wMaxPacketSize & 0x7ff;
 
 	/* High bit set means endpoint
 	   is an INPUT or IN endpoint. */
 	uint8_t address = end->bEndpointAddress;
-	if (address & 0x80)
+	if (address & 0x80) {
 	  uf->endpoint_in = address;
-	else
+	  uf->max_packet_in = max_packet;
+	} else {
 	  uf->endpoint_out = address;
+	  uf->max_packet_out = max_packet;
+	}
       }
+      NOTE("Interface #%d: IN endpoint 0x%02x, %u byte packets, OUT endpoint 0x%02x, %u byte packets",
+	   interf_num, uf->endpoint_in, uf->max_packet_in, uf->endpoint_out,
+	   uf->max_packet_out);
 
-      status_lock = sem_init(&uf->lock, 0, 1);
-      if (status_lock != 0) {
-	ERR("Failed to create interface lock #%d",
-	    interf_num);
-	goto error;
-      }
-
-      /* Try to make the kernel release the usb interface. */
-      try_detach_kernel_driver(usb, uf);
-
-      /* Try to claim the usb interface. */
-      if (try_claim_usb_interface(usb, uf)) {
-        ERR("Failed to claim usb interface #%d", uf->interface_number);
-        goto error;
-      }
-
-      /* Select the IPP-USB alt setting of the interface. */
-      if (libusb_set_interface_alt_setting(
-              usb->printer, uf->libusb_interface_index, uf->interface_alt)) {
-        ERR("Failed to set alt setting for interface #%d",
-            uf->interface_number);
+      if (usb_libusb_claim(usb, uf))
         goto error;
-      }
 
       break;
     }
@@ -434,6 +448,267 @@ struct usb_sock_t *usb_open()
   libusb_free_config_descriptor(config);
   libusb_free_device_list(device_list, 1);
 
+  return 0;
+
+ error:
+  if (device_list != NULL)
+    libusb_free_device_list(device_list, 1);
+ error_usbinit:
+  if (usb->context != NULL)
+    libusb_exit(usb->context);
+  if (usb->interfaces != NULL)
+    free(usb->interfaces);
+  usb->interfaces = NULL;
+  return -1;
+}
+
+static void usb_libusb_stop_events(struct usb_sock_t *usb);
+
+static void usb_libusb_close(struct usb_sock_t *usb)
+{
+  usb_libusb_stop_events(usb);
+
+  /* Release interfaces */
+  for (uint32_t i = 0; i < usb->num_interfaces; i++) {
+    int number = usb->interfaces[i].interface_number;
+    libusb_release_interface(usb->printer, number);
+  }
+
+  NOTE("Resetting printer ...");
+  libusb_reset_device(usb->printer);
+  NOTE("Reset completed.");
+  NOTE("Closing device handle...");
+  libusb_close(usb->printer);
+  NOTE("Closed device handle.");
+
+  if (usb->context != NULL)
+    libusb_exit(usb->context);
+}
+
+/* Transfer buffers ==-----------------------------------------------== */
+
+/* Buffers of each size kept for reuse. */
+#define USB_BUFFER_KEEP 64
+/* Room in front of every buffer for its header. Heap buffers are
+   allocated on a cache line boundary, device memory on a page boundary, so
+   the buffer itself is aligned to a cache line as well. */
+#define USB_BUFFER_HEADER 64
+
+struct usb_buffer_header {
+  struct usb_buffer_header *next;
+  struct usb_buffer_pool *pool;
+  size_t size;
+  int is_dev_mem;
+};
+
+struct usb_buffer_class {
+  size_t size;
+  struct usb_buffer_header *free_list;
+  uint32_t num_free;
+};
+
+struct usb_buffer_pool {
+  pthread_mutex_t mutex;
+  struct usb_sock_t *usb;
+  struct usb_buffer_class classes[2];
+  /* Buffers handed out and not freed yet. A pool closed while some are
+     still out, e.g. in the queue of a connection cancelled at shutdown,
+     goes away with the last of them. */
+  uint32_t num_out;
+  int closed;
+  /* Cleared once device memory could not be had. */
+  int use_dev_mem;
+  uint64_t num_dev_mem;
+  uint64_t num_heap;
+  uint64_t num_reused;
+};
+
+static int usb_buffer_pool_init(struct usb_sock_t *usb)
+{
+  struct usb_buffer_pool *pool = calloc(1, sizeof(*pool));
+  if (pool == NULL) {
+    ERR("Failed to alloc transfer buffer pool");
+    return -1;
+  }
+  pthread_mutex_init(&pool->mutex, NULL);
+  pool->usb = usb;
+  pool->classes[0].size = USB_IN_TRANSFER_SIZE;
+  pool->classes[1].size = USB_OUT_TRANSFER_SIZE;
+  pool->use_dev_mem = usb->transport->dev_mem_alloc != NULL;
+  usb->buffer_pool = pool;
+  return 0;
+}
+
+/* Releases a buffer for good. Device memory goes with the device once
+   the pool is closed. */
+static void usb_buffer_release(struct usb_buffer_pool *pool,
+                               struct usb_buffer_header *header)
+{
+  if (!header->is_dev_mem)
+    free(header);
+  else if (!pool->closed)
+    pool->usb->transport->dev_mem_free(pool->usb, (uint8_t *)header,
+                                       header->size + USB_BUFFER_HEADER);
+}
+
+static void usb_buffer_pool_free(struct usb_buffer_pool *pool)
+{
+  pthread_mutex_destroy(&pool->mutex);
+  free(pool);
+}
+
+/* Must run while the device is still open, as device memory belongs to
+   it. */
+static void usb_buffer_pool_destroy(struct usb_sock_t *usb)
+{
+  struct usb_buffer_pool *pool = usb->buffer_pool;
+  if (pool == NULL)
+    return;
+  usb->buffer_pool = NULL;
+
+  NOTE("Transfer buffers: %llu in device memory, %llu on the heap, %llu reused",
+       (unsigned long long)pool->num_dev_mem,
+       (unsigned long long)pool->num_heap,
+       (unsigned long long)pool->num_reused);
+  pthread_mutex_lock(&pool->mutex);
+  for (int i = 0; i < 2; i++) {
+    struct usb_buffer_header *header = pool->classes[i].free_list;
+    while (header != NULL) {
+      struct usb_buffer_header *next = header->next;
+      usb_buffer_release(pool, header);
+      header = next;
+    }
+    pool->classes[i].free_list = NULL;
+    pool->classes[i].num_free = 0;
+  }
+  pool->closed = 1;
+  uint32_t num_out = pool->num_out;
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (num_out == 0)
+    usb_buffer_pool_free(pool);
+  else
+    NOTE("Transfer buffers: %u still in use, released as they come back",
+         num_out);
+}
+
+uint8_t *usb_buffer_alloc(struct usb_sock_t *usb, size_t length)
+{
+  struct usb_buffer_pool *pool = usb->buffer_pool;
+  struct usb_buffer_class *class = NULL;
+  struct usb_buffer_header *header = NULL;
+
+  for (int i = 0; i < 2 && class == NULL; i++)
+    if (length <= pool->classes[i].size)
+      class = pool->classes + i;
+  size_t size = class != NULL ? class->size : length;
+
+  pthread_mutex_lock(&pool->mutex);
+  if (class != NULL && class->free_list != NULL) {
+    header = class->free_list;
+    class->free_list = header->next;
+    class->num_free--;
+    pool->num_reused++;
+    pool->num_out++;
+    pthread_mutex_unlock(&pool->mutex);
+    return (uint8_t *)header + USB_BUFFER_HEADER;
+  }
+
+  if (pool->use_dev_mem) {
+    header = (struct usb_buffer_header *)usb->transport->dev_mem_alloc(
+        usb, size + USB_BUFFER_HEADER);
+    if (header == NULL) {
+      NOTE("Device memory is not available, using heap transfer buffers");
+      pool->use_dev_mem = 0;
+    } else {
+      header->is_dev_mem = 1;
+      pool->num_dev_mem++;
+    }
+  }
+  if (header == NULL) {
+    void *memory;
+    if (posix_memalign(&memory, USB_BUFFER_HEADER,
+                       size + USB_BUFFER_HEADER)) {
+      pthread_mutex_unlock(&pool->mutex);
+      ERR("Failed to alloc transfer buffer");
+      return NULL;
+    }
+    header = memory;
+    header->is_dev_mem = 0;
+    pool->num_heap++;
+  }
+  pool->num_out++;
+  pthread_mutex_unlock(&pool->mutex);
+
+  header->pool = pool;
+  header->size = size;
+  return (uint8_t *)header + USB_BUFFER_HEADER;
+}
+
+void usb_buffer_free(struct usb_sock_t *usb, uint8_t *buffer)
+{
+  IGNORE(usb);
+  if (buffer == NULL)
+    return;
+  struct usb_buffer_header *header =
+      (struct usb_buffer_header *)(buffer - USB_BUFFER_HEADER);
+  /* The pool stays around for as long as any of its buffers is out, even
+     after |usb| was closed. */
+  struct usb_buffer_pool *pool = header->pool;
+
+  pthread_mutex_lock(&pool->mutex);
+  pool->num_out--;
+  if (pool->closed) {
+    usb_buffer_release(pool, header);
+    int is_last = pool->num_out == 0;
+    pthread_mutex_unlock(&pool->mutex);
+    if (is_last)
+      usb_buffer_pool_free(pool);
+    return;
+  }
+  for (int i = 0; i < 2; i++) {
+    struct usb_buffer_class *class = pool->classes + i;
+    if (header->size == class->size && class->num_free < USB_BUFFER_KEEP) {
+      header->next = class->free_list;
+      class->free_list = header;
+      class->num_free++;
+      pthread_mutex_unlock(&pool->mutex);
+      return;
+    }
+  }
+  usb_buffer_release(pool, header);
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+struct usb_sock_t *usb_open()
+{
+  int status_lock;
+  struct usb_sock_t *usb = calloc(1, sizeof *usb);
+  if (usb == NULL) {
+    ERR("Failed to alloc usb socket");
+    return NULL;
+  }
+
+  usb->transport = g_options.fake_printer != NULL ? &usb_fake_transport
+                                                  : &usb_libusb_transport;
+  NOTE("Using %s USB transport", usb->transport->name);
+  if (usb->transport->open(usb)) {
+    free(usb);
+    return NULL;
+  }
+
+  if (usb_buffer_pool_init(usb))
+    goto error;
+
+  for (uint32_t i = 0; i < usb->num_interfaces; i++) {
+    status_lock = sem_init(&usb->interfaces[i].lock, 0, 1);
+    if (status_lock != 0) {
+      ERR("Failed to create interface lock #%d",
+	  usb->interfaces[i].interface_number);
+      goto error;
+    }
+  }
+
   /* Pour interfaces into pool ==--------------------------------------== */
   usb->num_avail = usb->num_interfaces;
   usb->interface_pool = calloc(usb->num_avail,
@@ -464,40 +739,26 @@ struct usb_sock_t *usb_open()
   return usb;
 
  error:
-  if (device_list != NULL)
-    libusb_free_device_list(device_list, 1);
- error_usbinit:
-  if (usb != NULL) {
-    if (usb->context != NULL)
-      libusb_exit(usb->context);
-    if (usb->interfaces != NULL)
-      free(usb->interfaces);
-    if (usb->interface_pool != NULL)
-      free(usb->interface_pool);
-    free(usb);
-  }
+  usb_buffer_pool_destroy(usb);
+  usb->transport->close(usb);
+  if (usb->interfaces != NULL)
+    free(usb->interfaces);
+  if (usb->interface_pool != NULL)
+    free(usb->interface_pool);
+  free(usb);
   return NULL;
 }
 
 void usb_close(struct usb_sock_t *usb)
 {
-  /* Release interfaces */
-  for (uint32_t i = 0; i < usb->num_interfaces; i++) {
-    int number = usb->interfaces[i].interface_number;
-    libusb_release_interface(usb->printer, number);
-    sem_destroy(&usb->interfaces[i].lock);
-  }
+  usb_stop_events(usb);
+  usb_buffer_pool_destroy(usb);
+  usb->transport->close(usb);
 
-  NOTE("Resetting printer ...");
-  libusb_reset_device(usb->printer);
-  NOTE("Reset completed.");
-  NOTE("Closing device handle...");
-  libusb_close(usb->printer);
-  NOTE("Closed device handle.");
+  for (uint32_t i = 0; i < usb->num_interfaces; i++)
+    sem_destroy(&usb->interfaces[i].lock);
 
   if (usb != NULL) {
-    if (usb->context != NULL)
-      libusb_exit(usb->context);
     sem_destroy(&usb->num_staled_lock);
     if (usb->interfaces != NULL)
       free(usb->interfaces);
@@ -509,7 +770,7 @@ void usb_close(struct usb_sock_t *usb)
   return;
 }
 
-int usb_can_callback(struct usb_sock_t *usb)
+static int usb_libusb_can_hotplug(struct usb_sock_t *usb)
 {
   IGNORE(usb);
 
@@ -556,6 +817,8 @@ static int LIBUSB_CALL usb_exit_on_unplug(libusb_context *context,
       tcp_close(g_options.tcp_socket);
     if (g_options.tcp6_socket!= NULL)
       tcp_close(g_options.tcp6_socket);
+    if (g_options.unix_socket != NULL)
+      tcp_close(g_options.unix_socket);
 
     exit(0);
   }
@@ -563,32 +826,156 @@ static int LIBUSB_CALL usb_exit_on_unplug(libusb_context *context,
   return 0;
 }
 
-static void *usb_pump_events(void *user_data)
+/* libusb's file descriptors plus an eventfd for wake-ups, polled by the
+   completion engine itself so that it can be woken. */
+struct usb_libusb_events {
+  int wake_fd;
+  /* Set by libusb's notifiers when its file descriptors changed */
+  int stale;
+  struct pollfd *fds;
+  nfds_t num_fds;
+};
+
+static void usb_libusb_wake_events(struct usb_sock_t *usb)
 {
-  IGNORE(user_data);
+  struct usb_libusb_events *events = usb->transport_data;
+  uint64_t one = 1;
 
-  NOTE("USB unplug event observer thread starting");
+  if (events != NULL && write(events->wake_fd, &one, sizeof(one)) < 0)
+    ERR("Failed to wake the USB completion engine");
+}
 
-  while (!g_options.terminate) {
-    /* NOTE: This is a blocking call so
-       no need for sleep() */
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 500000;
-    libusb_handle_events_timeout_completed(NULL, &tv, NULL);
+static void LIBUSB_CALL usb_libusb_pollfd_added(int fd, short flags,
+                                                void *user_data)
+{
+  struct usb_sock_t *usb = user_data;
+  struct usb_libusb_events *events = usb->transport_data;
+  IGNORE(fd);
+  IGNORE(flags);
+
+  __sync_lock_test_and_set(&events->stale, 1);
+  usb_libusb_wake_events(usb);
+}
+
+static void LIBUSB_CALL usb_libusb_pollfd_removed(int fd, void *user_data)
+{
+  usb_libusb_pollfd_added(fd, 0, user_data);
+}
+
+/* Rebuilds the poll set, the wake-up eventfd goes first */
+static int usb_libusb_load_pollfds(struct usb_sock_t *usb)
+{
+  struct usb_libusb_events *events = usb->transport_data;
+  const struct libusb_pollfd **pollfds = libusb_get_pollfds(usb->context);
+  nfds_t num = 0;
+
+  if (pollfds == NULL) {
+    ERR("Failed to get the file descriptors of libusb");
+    return -1;
+  }
+  while (pollfds[num] != NULL)
+    num++;
+
+  struct pollfd *fds = realloc(events->fds, (num + 1) * sizeof(*fds));
+  if (fds == NULL) {
+    ERR("Failed to alloc space for libusb's file descriptors");
+    libusb_free_pollfds(pollfds);
+    return -1;
+  }
+  fds[0].fd = events->wake_fd;
+  fds[0].events = POLLIN;
+  for (nfds_t i = 0; i < num; i++) {
+    fds[i + 1].fd = pollfds[i]->fd;
+    fds[i + 1].events = pollfds[i]->events;
   }
+  events->fds = fds;
+  events->num_fds = num + 1;
+  libusb_free_pollfds(pollfds);
+  return 0;
+}
 
-  NOTE("USB unplug event observer thread terminating");
+static int usb_libusb_start_events(struct usb_sock_t *usb)
+{
+  struct usb_libusb_events *events = calloc(1, sizeof(*events));
+  if (events == NULL) {
+    ERR("Failed to alloc space for the USB completion engine");
+    return -1;
+  }
+  events->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (events->wake_fd < 0) {
+    ERR("Failed to create the USB completion engine's eventfd");
+    free(events);
+    return -1;
+  }
+  usb->transport_data = events;
+
+  libusb_set_pollfd_notifiers(usb->context, &usb_libusb_pollfd_added,
+                              &usb_libusb_pollfd_removed, usb);
+  if (usb_libusb_load_pollfds(usb)) {
+    libusb_set_pollfd_notifiers(usb->context, NULL, NULL, NULL);
+    usb->transport_data = NULL;
+    close(events->wake_fd);
+    free(events);
+    return -1;
+  }
+  return 0;
+}
 
-  return NULL;
+static void usb_libusb_stop_events(struct usb_sock_t *usb)
+{
+  struct usb_libusb_events *events = usb->transport_data;
+  if (events == NULL)
+    return;
+
+  libusb_set_pollfd_notifiers(usb->context, NULL, NULL, NULL);
+  usb->transport_data = NULL;
+  close(events->wake_fd);
+  free(events->fds);
+  free(events);
 }
 
-void usb_register_callback(struct usb_sock_t *usb)
+static void usb_libusb_handle_events(struct usb_sock_t *usb,
+                                    struct timeval *tv)
 {
-  IGNORE(usb);
+  struct usb_libusb_events *events = usb->transport_data;
+  struct timeval zero = { 0, 0 };
+  struct timeval next;
+
+  if (__sync_lock_test_and_set(&events->stale, 0))
+    usb_libusb_load_pollfds(usb);
+
+  /* libusb may need to run sooner than |tv| to expire transfer timeouts on
+     platforms where they are not backed by a file descriptor. */
+  int timeout = (int)(tv->tv_sec * 1000 + tv->tv_usec / 1000);
+  if (libusb_get_next_timeout(usb->context, &next) == 1) {
+    int due = (int)(next.tv_sec * 1000 + (next.tv_usec + 999) / 1000);
+    if (due < timeout)
+      timeout = due;
+  }
 
+  tv->tv_sec = timeout / 1000;
+  tv->tv_usec = (timeout % 1000) * 1000;
+
+  int ready = poll(events->fds, events->num_fds, timeout);
+  if (ready < 0 && errno != EINTR) {
+    ERR("Polling libusb's file descriptors failed");
+    return;
+  }
+  if (ready > 0 && (events->fds[0].revents & POLLIN)) {
+    uint64_t count;
+    if (read(events->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+      ERR("Failed to read the USB completion engine's eventfd");
+  }
+
+  /* Completions, hotplug events and expired timeouts alike are dispatched
+     from here, without blocking any further. */
+  libusb_handle_events_timeout_completed(usb->context, &zero, NULL);
+}
+
+static int usb_libusb_register_hotplug(struct usb_sock_t *usb)
+{
   int status =
-    libusb_hotplug_register_callback(NULL,
+    libusb_hotplug_register_callback(usb->context,
 				     LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
 				     /* Note: libusb's enum has no default value
 					a bug has been filled with libusb.
@@ -604,20 +991,253 @@ void usb_register_callback(struct usb_sock_t *usb)
 				     &usb_exit_on_unplug,
 				     NULL,
 				     NULL);
-  if (status == LIBUSB_SUCCESS) {
-    pthread_create(&(g_options.usb_event_thread_handle), NULL, &usb_pump_events, NULL);
+  return status == LIBUSB_SUCCESS ? 0 : -1;
+}
+
+static int usb_libusb_bulk_out(struct usb_conn_t *conn, uint8_t *data,
+                               int length, int *transferred,
+                               unsigned int timeout)
+{
+  return libusb_bulk_transfer(conn->parent->printer,
+			      conn->interface->endpoint_out,
+			      data, length, transferred, timeout);
+}
+
+static int usb_libusb_bulk_in(struct usb_conn_t *conn, uint8_t *data,
+                              int length, int *transferred,
+                              unsigned int timeout)
+{
+  return libusb_bulk_transfer(conn->parent->printer,
+			      conn->interface->endpoint_in,
+			      data, length, transferred, timeout);
+}
+
+static int usb_libusb_recover(struct usb_sock_t *usb, struct usb_interface *uf,
+                              int step)
+{
+  int status;
+
+  switch (step) {
+  case USB_RECOVER_CLEAR_HALT:
+    status = libusb_clear_halt(usb->printer, uf->endpoint_in);
+    if (status == 0)
+      status = libusb_clear_halt(usb->printer, uf->endpoint_out);
+    break;
+  case USB_RECOVER_ALT_SETTING:
+    libusb_release_interface(usb->printer, uf->interface_number);
+    status = usb_libusb_claim(usb, uf) ? LIBUSB_ERROR_OTHER : 0;
+    break;
+  default:
+    /* Interfaces stay claimed and keep their alt settings across the
+       reset, unless the device has to be enumerated again. */
+    status = libusb_reset_device(usb->printer);
+    if (status == LIBUSB_ERROR_NOT_FOUND) {
+      ERR("Printer has to be re-enumerated after the reset, exiting");
+      g_options.terminate = 1;
+    }
+  }
+
+  if (status < 0) {
+    ERR("Interface #%u: Recovery failed: %s", uf->interface_number,
+        libusb_error_name(status));
+    return -1;
+  }
+  return 0;
+}
+
+static uint8_t *usb_libusb_dev_mem_alloc(struct usb_sock_t *usb,
+                                         size_t length)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+  return libusb_dev_mem_alloc(usb->printer, length);
+#else
+  IGNORE(usb);
+  IGNORE(length);
+  return NULL;
+#endif
+}
+
+static void usb_libusb_dev_mem_free(struct usb_sock_t *usb, uint8_t *buffer,
+                                    size_t length)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+  libusb_dev_mem_free(usb->printer, buffer, length);
+#else
+  IGNORE(usb);
+  IGNORE(buffer);
+  IGNORE(length);
+#endif
+}
+
+static int usb_libusb_submit_in(struct usb_conn_t *conn,
+                                struct libusb_transfer *transfer)
+{
+  IGNORE(conn);
+
+  return libusb_submit_transfer(transfer);
+}
+
+static int usb_libusb_cancel_in(struct usb_conn_t *conn,
+                                struct libusb_transfer *transfer)
+{
+  IGNORE(conn);
+
+  return libusb_cancel_transfer(transfer);
+}
+
+const struct usb_transport usb_libusb_transport = {
+  "libusb",
+  usb_libusb_open,
+  usb_libusb_close,
+  usb_libusb_claim,
+  usb_libusb_bulk_out,
+  usb_libusb_bulk_in,
+  usb_libusb_submit_in,
+  usb_libusb_cancel_in,
+  usb_libusb_can_hotplug,
+  usb_libusb_register_hotplug,
+  usb_libusb_start_events,
+  usb_libusb_handle_events,
+  usb_libusb_wake_events,
+  usb_libusb_recover,
+  usb_libusb_dev_mem_alloc,
+  usb_libusb_dev_mem_free
+};
+
+int usb_can_callback(struct usb_sock_t *usb)
+{
+  return usb->transport->can_hotplug(usb);
+}
+
+static void *usb_pump_events(void *user_data)
+{
+  struct usb_sock_t *usb = user_data;
+
+  NOTE("USB completion engine starting");
+  affinity_apply(THREAD_ROLE_USB);
+
+  while (!g_options.terminate && !usb->events_stop) {
+    /* NOTE: This is a blocking call so
+       no need for sleep() */
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = 500000;
+    uint64_t start = affinity_now();
+    usb->transport->handle_events(usb, &tv);
+
+    /* How far past the deadline of the wait it actually did this thread
+       got the CPU back, which is what transfer completions see as well.
+       Woken up by an event before it, the thread was not late. */
+    uint64_t deadline =
+        start + (uint64_t)tv.tv_sec * 1000000 + (uint64_t)tv.tv_usec;
+    uint64_t now = affinity_now();
+    affinity_record_latency(THREAD_ROLE_USB, now > deadline ? now - deadline
+                                                            : 0);
+  }
+
+  NOTE("USB completion engine terminating");
+
+  return NULL;
+}
+
+int usb_start_events(struct usb_sock_t *usb)
+{
+  if (usb->transport->start_events(usb))
+    return -1;
+  if (pthread_create(&(g_options.usb_event_thread_handle), NULL,
+                     &usb_pump_events, usb)) {
+    ERR("Failed to start the USB completion engine");
+    return -1;
+  }
+  usb->events_started = 1;
+  return 0;
+}
+
+void usb_stop_events(struct usb_sock_t *usb)
+{
+  if (!usb->events_started)
+    return;
+  usb->events_stop = 1;
+  usb->transport->wake_events(usb);
+  pthread_join(g_options.usb_event_thread_handle, NULL);
+  usb->events_started = 0;
+}
+
+void usb_register_callback(struct usb_sock_t *usb)
+{
+  /* The unplug notification arrives through the completion engine like
+     any other event. */
+  if (usb->transport->register_hotplug(usb) == 0)
     NOTE("Registered unplug callback");
-  } else
+  else
     ERR("Failed to register unplug callback");
 }
 
+int usb_admit(struct usb_sock_t *usb, uint32_t *retry_after)
+{
+  int admitted;
+
+  sem_wait(&usb->pool_manage_lock);
+  admitted = usb->num_waiting < usb->num_avail + g_options.max_waiting;
+  if (admitted)
+    usb->num_waiting++;
+  else
+    usb->num_refused++;
+  sem_post(&usb->pool_manage_lock);
+
+  if (admitted)
+    return 0;
+  *retry_after = usb_retry_after(usb);
+  return -1;
+}
+
+void usb_admit_done(struct usb_sock_t *usb)
+{
+  sem_wait(&usb->pool_manage_lock);
+  usb->num_waiting--;
+  sem_post(&usb->pool_manage_lock);
+}
+
+uint32_t usb_retry_after(struct usb_sock_t *usb)
+{
+  sem_wait(&usb->pool_manage_lock);
+  uint32_t hold_ms = usb->hold_avg_ms;
+  uint32_t ahead = usb->num_waiting > usb->num_avail
+                       ? usb->num_waiting - usb->num_avail : 0;
+  uint32_t in_service = usb->num_interfaces - usb->num_staled;
+  sem_post(&usb->pool_manage_lock);
+
+  /* Every interface in service frees up once per average hold time, the
+     ones waiting already get served first */
+  if (in_service == 0)
+    return USB_RETRY_AFTER_MAX;
+  uint64_t ms = (uint64_t)hold_ms * (ahead + 1) / in_service;
+  uint64_t seconds = (ms + 999) / 1000;
+  if (seconds < USB_RETRY_AFTER_MIN)
+    return USB_RETRY_AFTER_MIN;
+  if (seconds > USB_RETRY_AFTER_MAX)
+    return USB_RETRY_AFTER_MAX;
+  return (uint32_t)seconds;
+}
+
+void usb_get_admission_stats(struct usb_sock_t *usb,
+                             struct usb_admission_stats *stats)
+{
+  sem_wait(&usb->pool_manage_lock);
+  stats->waiting = usb->num_waiting;
+  stats->refused = usb->num_refused;
+  stats->hold_avg_ms = usb->hold_avg_ms;
+  sem_post(&usb->pool_manage_lock);
+}
+
 struct usb_conn_t *usb_conn_acquire(struct usb_sock_t *usb)
 {
   int i;
 
   if (usb->num_avail <= 0) {
     NOTE("All USB interfaces busy, waiting ...");
-    for (i = 0; i < 30 && usb->num_avail <= 0; i ++) {
+    for (i = 0; i < USB_ACQUIRE_TIMEOUT_MS / 100 && usb->num_avail <= 0;
+         i ++) {
       if (g_options.terminate)
 	return NULL;
       usleep(100000);
@@ -633,12 +1253,20 @@ struct usb_conn_t *usb_conn_acquire(struct usb_sock_t *usb)
     ERR("Failed to alloc space for usb connection");
     return NULL;
   }
+  conn->is_tracking = 1;
+  http_framer_init(&conn->response, 1);
 
   sem_wait(&usb->pool_manage_lock);
   {
     conn->parent = usb;
 
-    uint32_t slot = usb->num_taken;
+    /* Another thread may have taken the last one, or it may have been
+       quarantined meanwhile. */
+    if (usb->num_avail == 0) {
+      ERR("No free USB interface left");
+      goto acquire_error;
+    }
+    uint32_t slot = usb->num_avail - 1;
 
     conn->interface_index = usb->interface_pool[slot];
     conn->interface = usb->interfaces + conn->interface_index;
@@ -655,6 +1283,7 @@ struct usb_conn_t *usb_conn_acquire(struct usb_sock_t *usb)
     /* Take successfully acquired interface from the pool */
     usb->num_taken++;
     usb->num_avail--;
+    conn->acquired_at = affinity_now();
   }
   sem_post(&usb->pool_manage_lock);
   return conn;
@@ -666,50 +1295,188 @@ struct usb_conn_t *usb_conn_acquire(struct usb_sock_t *usb)
   return NULL;
 }
 
+static const char *usb_recovery_name(int step)
+{
+  switch (step) {
+  case USB_RECOVER_CLEAR_HALT:
+    return "clearing the endpoint halts";
+  case USB_RECOVER_ALT_SETTING:
+    return "reselecting the alt setting";
+  default:
+    return "resetting the device";
+  }
+}
+
+/* Puts |uf| back into the pool after a successful recovery. Must be called
+   with pool_manage_lock held. */
+static void usb_restore_interface(struct usb_sock_t *usb,
+                                  struct usb_interface *uf)
+{
+  uf->is_quarantined = 0;
+  uf->fault_score = 0;
+  uf->recovery = USB_RECOVER_CLEAR_HALT;
+  uf->num_recoveries++;
+  usb->num_staled--;
+  usb->interface_pool[usb->num_avail++] = (uint32_t)(uf - usb->interfaces);
+  NOTE("Interface #%u: Recovered, back in the pool", uf->interface_number);
+}
+
+/* Works through the recovery steps of every quarantined interface. A device
+   reset, which would break the transfers of the other interfaces, is held
+   back until no interface is in use; the next release retries then. */
+static void usb_recover(struct usb_sock_t *usb)
+{
+  /* One thread recovers at a time, the others go on. */
+  if (sem_trywait(&usb->num_staled_lock))
+    return;
+
+  for (uint32_t i = 0; i < usb->num_interfaces && !g_options.terminate; i++) {
+    struct usb_interface *uf = usb->interfaces + i;
+
+    sem_wait(&usb->pool_manage_lock);
+    while (uf->is_quarantined && uf->recovery != USB_RECOVER_RESET) {
+      /* Nobody else touches a quarantined interface, its own recovery
+         steps can run without holding up the pool. */
+      int step = uf->recovery;
+      sem_post(&usb->pool_manage_lock);
+      NOTE("Interface #%u: Recovering by %s", uf->interface_number,
+           usb_recovery_name(step));
+      int status = usb->transport->recover(usb, uf, step);
+      sem_wait(&usb->pool_manage_lock);
+      if (status == 0)
+        usb_restore_interface(usb, uf);
+      else
+        uf->recovery++;
+    }
+
+    if (uf->is_quarantined && usb->num_taken == 0) {
+      /* Keeping the pool locked keeps new connections off the device until
+         the reset is done. */
+      WARN("Interface #%u: Recovering by %s", uf->interface_number,
+           usb_recovery_name(USB_RECOVER_RESET));
+      if (usb->transport->recover(usb, uf, USB_RECOVER_RESET) == 0) {
+        for (uint32_t j = 0; j < usb->num_interfaces; j++)
+          if (usb->interfaces[j].is_quarantined)
+            usb_restore_interface(usb, usb->interfaces + j);
+      } else if (usb->num_staled == usb->num_interfaces) {
+        ERR("No usable USB interface left, giving up");
+        g_options.terminate = 1;
+      }
+    }
+    sem_post(&usb->pool_manage_lock);
+  }
+
+  sem_post(&usb->num_staled_lock);
+}
+
+static int usb_conn_drain(struct usb_conn_t *conn);
+
 void usb_conn_release(struct usb_conn_t *conn)
 {
   struct usb_sock_t *usb = conn->parent;
+  struct usb_interface *uf = conn->interface;
+
+  /* The next connection must not get the rest of this one's responses. An
+     interface which cannot be drained is recovered instead. */
+  int undrained = !conn->is_staled && usb_conn_drain(conn);
+  int quarantine = conn->is_staled || undrained ||
+                   uf->fault_score >= CONN_STALE_THRESHHOLD;
+
+  uint64_t held_ms = (affinity_now() - conn->acquired_at) / 1000;
   sem_wait(&usb->pool_manage_lock);
   {
-    /* Return usb interface to pool */
     usb->num_taken--;
-    usb->num_avail++;
-    uint32_t slot = usb->num_taken;
-    usb->interface_pool[slot] = conn->interface_index;
+    /* Moving average over roughly the last eight connections, seeded with
+       the first one */
+    if (usb->hold_avg_ms == 0)
+      usb->hold_avg_ms = held_ms > 0 ? (uint32_t)held_ms : 1;
+    else
+      usb->hold_avg_ms = (uint32_t)((usb->hold_avg_ms * 7ull + held_ms) / 8);
+    if (quarantine) {
+      /* Keep the interface out of the pool until it has been recovered */
+      WARN("Interface #%u: Quarantined after %u faults", uf->interface_number,
+           uf->num_faults);
+      uf->is_quarantined = 1;
+      /* Clearing a halt succeeds on an endpoint which is not halted and
+         leaves the unread response where it is, only reselecting the alt
+         setting or a reset flush it. */
+      if (undrained && uf->recovery < USB_RECOVER_ALT_SETTING)
+        uf->recovery = USB_RECOVER_ALT_SETTING;
+      usb->num_staled++;
+    } else {
+      /* Return usb interface to pool */
+      usb->interface_pool[usb->num_avail++] = conn->interface_index;
+    }
 
     /* Release our interface lock */
-    sem_post(&conn->interface->lock);
+    sem_post(&uf->lock);
     free(conn);
   }
   sem_post(&usb->pool_manage_lock);
+
+  if (usb->num_staled)
+    usb_recover(usb);
 }
 
-int usb_conn_packet_send(struct usb_conn_t *conn, struct http_packet_t *pkt)
+int usb_conn_report(struct usb_conn_t *conn, uint32_t fault)
+{
+  struct usb_interface *uf = conn->interface;
+
+  if (fault == 0) {
+    uint32_t score = uf->fault_score;
+    while (score > 0 && !conn->is_staled) {
+      uint32_t seen = __sync_val_compare_and_swap(&uf->fault_score, score,
+                                                  score - 1);
+      if (seen == score)
+        break;
+      score = seen;
+    }
+    return conn->is_staled;
+  }
+
+  __sync_add_and_fetch(&uf->num_faults, 1);
+  if (__sync_add_and_fetch(&uf->fault_score, fault) >= CONN_STALE_THRESHHOLD)
+    conn->is_staled = 1;
+  return conn->is_staled;
+}
+
+/* Returns |max_packet|, or the smallest bulk packet size if the descriptor
+   did not give one. */
+static size_t usb_packet_size(uint16_t max_packet)
+{
+  return max_packet ? max_packet : 64;
+}
+
+/* Sends |length| bytes of |data| in a single logical transfer. A |length| of
+   0 sends a zero-length packet. */
+static int usb_conn_send(struct usb_conn_t *conn, uint8_t *data,
+                         size_t length)
 {
   int size_sent = 0;
   const int timeout = 1000; /* 1 sec */
   int num_timeouts = 0;
   size_t sent = 0;
-  size_t pending = pkt->filled_size;
-  while (pending > 0 && !g_options.terminate) {
+  size_t pending = length;
+  int zlp = length == 0;
+  while ((pending > 0 || zlp) && !g_options.terminate) {
     int to_send = (int)pending;
 
-    NOTE("P %p: USB: want to send %d bytes", pkt, to_send);
-    int status = libusb_bulk_transfer(conn->parent->printer,
-				      conn->interface->endpoint_out,
-				      pkt->buffer + sent, to_send,
-				      &size_sent, timeout);
+    NOTE("P %p: USB: want to send %d bytes", data, to_send);
+    int status = conn->parent->transport->bulk_out(conn,
+						   data + sent, to_send,
+						   &size_sent, timeout);
     if (status == LIBUSB_ERROR_NO_DEVICE) {
       ERR("P %p: Printer has been disconnected",
-	  pkt);
+	  data);
       return -1;
     }
     if (status == LIBUSB_ERROR_TIMEOUT) {
-      NOTE("P %p: USB: send timed out, retrying", pkt);
+      NOTE("P %p: USB: send timed out, retrying", data);
 
       if (num_timeouts++ > PRINTER_CRASH_TIMEOUT_RECEIVE) {
 	ERR("P %p: Usb send fully timed out",
-	    pkt);
+	    data);
+	usb_conn_report(conn, USB_FAULT_TIMEOUT);
 	return -1;
       }
 
@@ -722,23 +1489,654 @@ int usb_conn_packet_send(struct usb_conn_t *conn, struct http_packet_t *pkt)
 	continue;
     } else if (status < 0) {
       ERR("P %p: USB: send failed with status %s",
-	  pkt, libusb_error_name(status));
+	  data, libusb_error_name(status));
+      usb_conn_report(conn, status == LIBUSB_ERROR_PIPE ? USB_FAULT_STALL :
+			    status == LIBUSB_ERROR_OVERFLOW ? USB_FAULT_OVERFLOW :
+			    USB_FAULT_ERROR);
       return -1;
     }
     if (size_sent < 0) {
       ERR("P %p: Unexpected negative size_sent",
-	  pkt);
+	  data);
       return -1;
     }
 
+    zlp = 0;
     pending -= (size_t) size_sent;
     sent += (size_t) size_sent;
-    NOTE("P %p: USB: sent %d bytes", pkt, size_sent);
+    NOTE("P %p: USB: sent %d bytes", data, size_sent);
+  }
+  NOTE("P %p: USB: sent %zu bytes in total", data, sent);
+  usb_conn_report(conn, 0);
+  return 0;
+}
+
+/* Sends |length| bytes that end a request, terminated with a zero-length
+   packet if they fill their last packet, as the printer would otherwise
+   wait for more. */
+static int usb_conn_send_message(struct usb_conn_t *conn, uint8_t *data,
+                                 size_t length)
+{
+  if (usb_conn_send(conn, data, length))
+    return -1;
+  if (length % usb_packet_size(conn->interface->max_packet_out) == 0) {
+    NOTE("P %p: USB: message ends on a packet boundary, sending a zero-length packet",
+         data);
+    return usb_conn_send(conn, data, 0);
+  }
+  return 0;
+}
+
+int usb_conn_packet_send(struct usb_conn_t *conn, struct http_packet_t *pkt)
+{
+  usb_conn_track_request(conn, pkt->filled_size >= 5 &&
+                               memcmp(pkt->buffer, "HEAD ", 5) == 0);
+  return usb_conn_send_message(conn, pkt->buffer, pkt->filled_size);
+}
+
+/* IN transfers are a multiple of the packet size, so that a short packet
+   ends a transfer only at the end of a response. */
+static size_t usb_conn_in_capacity(struct usb_conn_t *conn)
+{
+  size_t max_packet = usb_packet_size(conn->interface->max_packet_in);
+  return USB_IN_TRANSFER_SIZE - USB_IN_TRANSFER_SIZE % max_packet;
+}
+
+static void usb_packet_release(struct http_packet_t *pkt)
+{
+  usb_buffer_free(pkt->owner, pkt->buffer);
+}
+
+struct http_packet_t *usb_conn_packet_new(struct usb_conn_t *conn)
+{
+  struct http_packet_t *pkt = calloc(1, sizeof(*pkt));
+  if (pkt == NULL) {
+    ERR("failed to alloc packet");
+    return NULL;
+  }
+  pkt->buffer = usb_buffer_alloc(conn->parent, USB_IN_TRANSFER_SIZE);
+  if (pkt->buffer == NULL) {
+    free(pkt);
+    return NULL;
+  }
+
+  pkt->buffer_capacity = usb_conn_in_capacity(conn);
+  pkt->release = usb_packet_release;
+  pkt->owner = conn->parent;
+  return pkt;
+}
+
+void usb_conn_track_request(struct usb_conn_t *conn, int is_head)
+{
+  uint64_t bit = 1ULL << (conn->requests_sent % 64);
+  if (is_head)
+    __sync_fetch_and_or(&conn->head_requests, bit);
+  else
+    __sync_fetch_and_and(&conn->head_requests, ~bit);
+  __sync_add_and_fetch(&conn->requests_sent, 1);
+}
+
+void usb_conn_stop_tracking(struct usb_conn_t *conn)
+{
+  if (conn->is_tracking)
+    NOTE("Interface #%u: Lost track of the responses", conn->interface_index);
+  conn->is_tracking = 0;
+}
+
+void usb_conn_track_response(struct usb_conn_t *conn, const uint8_t *data,
+                             size_t len)
+{
+  struct http_framer *framer = &conn->response;
+
+  while (len > 0 && conn->is_tracking) {
+    /* Whether a body follows depends on the request answered. */
+    if (framer->state == HTTP_FRAMER_HEADERS)
+      framer->no_body =
+          !!(conn->head_requests & (1ULL << (conn->responses_seen % 64)));
+
+    size_t used = http_framer_feed(framer, data, len);
+    data += used;
+    len -= used;
+    if (framer->state == HTTP_FRAMER_ERROR) {
+      NOTE("Interface #%u: Lost track of the responses",
+           conn->interface_index);
+      conn->is_tracking = 0;
+    } else if (http_framer_done(framer)) {
+      /* Interim responses precede the final one. */
+      if (framer->status >= 200)
+        conn->responses_seen++;
+      http_framer_init(framer, 1);
+    }
+  }
+}
+
+/* Returns non-zero if every response has been read in full. */
+static int usb_conn_is_idle(const struct usb_conn_t *conn)
+{
+  return conn->is_tracking && conn->requests_sent == conn->responses_seen &&
+         conn->response.state == HTTP_FRAMER_HEADERS &&
+         conn->response.head_len == 0;
+}
+
+/* Reads and discards what the printer still sends for the requests of
+   |conn|. Returns 0 if the interface was left clean. */
+static int usb_conn_drain(struct usb_conn_t *conn)
+{
+  struct usb_sock_t *usb = conn->parent;
+
+  if (usb_conn_is_idle(conn) || g_options.terminate)
+    return 0;
+
+  uint8_t *buffer = usb_buffer_alloc(usb, USB_IN_TRANSFER_SIZE);
+  if (buffer == NULL)
+    return -1;
+
+  uint64_t start = affinity_now();
+  uint64_t deadline = start + USB_DRAIN_MAX_MS * 1000;
+  size_t drained = 0;
+  int status = -1;
+  NOTE("Interface #%u: Draining, %u of %u responses read",
+       conn->interface_index, conn->responses_seen, conn->requests_sent);
+
+  while (!g_options.terminate) {
+    if (usb_conn_is_idle(conn)) {
+      status = 0;
+      break;
+    }
+    uint64_t now = affinity_now();
+    if (now >= deadline) {
+      WARN("Interface #%u: Printer still sending after %d ms, giving up",
+           conn->interface_index, USB_DRAIN_MAX_MS);
+      break;
+    }
+    uint64_t left = (deadline - now) / 1000;
+    unsigned int timeout = left < USB_DRAIN_QUIET_MS ? (unsigned int)left + 1
+                                                     : USB_DRAIN_QUIET_MS;
+
+    int transferred = 0;
+    int result = usb->transport->bulk_in(conn, buffer,
+                                         (int)usb_conn_in_capacity(conn),
+                                         &transferred, timeout);
+    if (transferred > 0) {
+      usb_conn_track_response(conn, buffer, (size_t)transferred);
+      drained += (size_t)transferred;
+      continue;
+    }
+    if (result == LIBUSB_ERROR_TIMEOUT) {
+      /* The printer has nothing more to say, whether or not that is the
+         end of a response. */
+      status = 0;
+      break;
+    }
+    if (result < 0) {
+      ERR("Interface #%u: Draining failed: %s", conn->interface_index,
+          libusb_error_name(result));
+      usb_conn_report(conn, result == LIBUSB_ERROR_NO_DEVICE ? 0 :
+                            USB_FAULT_ERROR);
+      break;
+    }
+  }
+
+  NOTE("Interface #%u: Drained %zu bytes in %llu ms", conn->interface_index,
+       drained, (unsigned long long)((affinity_now() - start) / 1000));
+  usb_buffer_free(usb, buffer);
+  return status;
+}
+
+int usb_writer_init(struct usb_writer *writer, struct usb_sock_t *usb)
+{
+  writer->usb = usb;
+  writer->conn = NULL;
+  writer->reading = 0;
+  writer->filled = 0;
+  writer->scanned = 0;
+  writer->partial_sent = 0;
+  writer->framing = 1;
+  http_framer_init(&writer->framer, 0);
+  writer->replayable = 1;
+  writer->replay = NULL;
+  writer->replay_len = 0;
+  writer->num_replay = 0;
+  writer->replay_first = 0;
+  writer->gated = 0;
+  writer->admitted = 0;
+  writer->sending = 0;
+  writer->replaying = 0;
+  writer->buffer = usb_buffer_alloc(writer->usb, USB_OUT_TRANSFER_SIZE);
+  if (writer->buffer == NULL)
+    return -1;
+  pthread_mutex_init(&writer->mutex, NULL);
+  pthread_cond_init(&writer->cond, NULL);
+  pthread_mutex_init(&writer->read_lock, NULL);
+  return 0;
+}
+
+void usb_writer_gate(struct usb_writer *writer)
+{
+  writer->gated = 1;
+}
+
+void usb_writer_free(struct usb_writer *writer)
+{
+  usb_buffer_free(writer->usb, writer->buffer);
+  writer->buffer = NULL;
+  free(writer->replay);
+  writer->replay = NULL;
+  pthread_mutex_destroy(&writer->read_lock);
+  pthread_cond_destroy(&writer->cond);
+  pthread_mutex_destroy(&writer->mutex);
+}
+
+size_t usb_writer_pending(const struct usb_writer *writer)
+{
+  return writer->filled;
+}
+
+/* Drops the first |length| bytes of the buffer after they have been sent. */
+static void usb_writer_consume(struct usb_writer *writer, size_t length)
+{
+  memmove(writer->buffer, writer->buffer + length, writer->filled - length);
+  writer->filled -= length;
+  writer->scanned -= length;
+}
+
+/* Drops the kept requests which have been answered. */
+static void usb_writer_trim(struct usb_writer *writer)
+{
+  uint32_t answered = writer->conn->responses_seen;
+  uint32_t drop = 0;
+
+  while (drop < writer->num_replay && writer->replay_first + drop < answered)
+    drop++;
+  if (drop == 0)
+    return;
+
+  size_t bytes = writer->replay_ends[drop - 1];
+  memmove(writer->replay, writer->replay + bytes, writer->replay_len - bytes);
+  writer->replay_len -= bytes;
+  writer->num_replay -= drop;
+  for (uint32_t i = 0; i < writer->num_replay; i++) {
+    writer->replay_ends[i] = writer->replay_ends[i + drop] - bytes;
+    writer->replay_is_head[i] = writer->replay_is_head[i + drop];
+  }
+  writer->replay_first += drop;
+}
+
+/* Keeps a copy of the complete request about to be sent, if it can be
+   replayed. */
+static void usb_writer_keep(struct usb_writer *writer, const uint8_t *data,
+                            size_t len, int is_head)
+{
+  struct usb_conn_t *conn = writer->conn;
+
+  usb_writer_trim(writer);
+  /* Once everything has been answered earlier requests no longer matter. */
+  if (writer->num_replay == 0 &&
+      conn->responses_seen == conn->requests_sent) {
+    writer->replayable = 1;
+    writer->replay_len = 0;
+    writer->replay_first = conn->requests_sent;
+  }
+  if (!writer->replayable)
+    return;
+
+  if (!http_framer_is_idempotent(&writer->framer) ||
+      writer->num_replay == USB_REPLAY_MAX_REQUESTS ||
+      writer->replay_len + len > USB_REPLAY_MAX_SIZE) {
+    writer->replayable = 0;
+    writer->num_replay = 0;
+    writer->replay_len = 0;
+    return;
+  }
+  if (writer->replay == NULL) {
+    writer->replay = malloc(USB_REPLAY_MAX_SIZE);
+    if (writer->replay == NULL) {
+      writer->replayable = 0;
+      return;
+    }
   }
-  NOTE("P %p: USB: sent %d bytes in total", pkt, sent);
+
+  memcpy(writer->replay + writer->replay_len, data, len);
+  writer->replay_len += len;
+  writer->replay_ends[writer->num_replay] = writer->replay_len;
+  writer->replay_is_head[writer->num_replay] = is_head;
+  writer->num_replay++;
+}
+
+/* Waits until a replay has moved the writer to its new interface, with the
+   mutex released meanwhile. Called with the mutex held. */
+static void usb_writer_wait_replay(struct usb_writer *writer)
+{
+  while (writer->replaying)
+    pthread_cond_wait(&writer->cond, &writer->mutex);
+}
+
+/* Sends |length| bytes from the start of the buffer, a whole request if
+   |is_message| is set. The mutex is released meanwhile, so that a transfer
+   blocked on the printer does not hold up the thread reading its
+   responses. Only the thread feeding the writer changes the buffer. Called
+   with the mutex held. */
+static int usb_writer_send(struct usb_writer *writer, struct usb_conn_t *conn,
+                           size_t length, int is_message)
+{
+  writer->sending = 1;
+  pthread_mutex_unlock(&writer->mutex);
+  int status = is_message
+                   ? usb_conn_send_message(conn, writer->buffer, length)
+                   : usb_conn_send(conn, writer->buffer, length);
+  pthread_mutex_lock(&writer->mutex);
+  writer->sending = 0;
+  return status;
+}
+
+/* Returns non-zero if the request being parsed may not go out yet. */
+static int usb_writer_is_held(const struct usb_writer *writer)
+{
+  return writer->framing && writer->gated && !writer->admitted;
+}
+
+static int usb_writer_flush_locked(struct usb_writer *writer)
+{
+  if (writer->filled == 0)
+    return 0;
+  if (usb_writer_is_held(writer))
+    return USB_WRITER_HELD;
+  if (writer->conn == NULL)
+    return USB_WRITER_DETACHED;
+  if (usb_writer_send(writer, writer->conn, writer->filled, 0))
+    return -1;
+  writer->partial_sent += writer->filled;
+  writer->filled = 0;
+  writer->scanned = 0;
   return 0;
 }
 
+/* Sends every complete request in the buffer, then the packet-aligned part
+   of what is left. */
+static int usb_writer_process(struct usb_writer *writer)
+{
+  struct usb_conn_t *conn = writer->conn;
+
+  while (writer->framing) {
+    if (!http_framer_done(&writer->framer)) {
+      if (writer->scanned == writer->filled)
+        break;
+      writer->scanned += http_framer_feed(&writer->framer,
+                                          writer->buffer + writer->scanned,
+                                          writer->filled - writer->scanned);
+      if (writer->framer.state == HTTP_FRAMER_ERROR) {
+        WARN("Could not parse the request stream, no longer aggregating transfers");
+        writer->framing = 0;
+        writer->replayable = 0;
+        if (conn != NULL)
+          conn->is_tracking = 0;
+      }
+      continue;
+    }
+
+    if (usb_writer_is_held(writer))
+      return USB_WRITER_HELD;
+    if (conn == NULL)
+      return USB_WRITER_DETACHED;
+    int is_head = strcmp(writer->framer.method, "HEAD") == 0;
+    /* Only a request which went out in one piece is kept. */
+    if (writer->partial_sent == 0)
+      usb_writer_keep(writer, writer->buffer, writer->scanned, is_head);
+    else
+      writer->replayable = 0;
+    usb_conn_track_request(conn, is_head);
+    if (usb_writer_send(writer, conn, writer->scanned, 1))
+      return -1;
+    usb_writer_consume(writer, writer->scanned);
+    writer->partial_sent = 0;
+    writer->admitted = 0;
+    http_framer_init(&writer->framer, 0);
+  }
+
+  if (!writer->framing)
+    return usb_writer_flush_locked(writer);
+
+  /* Without an interface the start of a request waits for the rest, as
+     long as there is room for it */
+  if (conn == NULL)
+    return writer->filled < USB_OUT_TRANSFER_SIZE
+               ? 0 : usb_writer_flush_locked(writer);
+  size_t max_packet = usb_packet_size(conn->interface->max_packet_out);
+  size_t aligned = writer->filled - writer->filled % max_packet;
+  if (aligned == 0)
+    return 0;
+  if (usb_writer_is_held(writer))
+    return USB_WRITER_HELD;
+  if (usb_writer_send(writer, conn, aligned, 0))
+    return -1;
+  usb_writer_consume(writer, aligned);
+  writer->partial_sent += aligned;
+  return 0;
+}
+
+uint8_t *usb_writer_space(struct usb_writer *writer, size_t *room)
+{
+  *room = USB_OUT_TRANSFER_SIZE - writer->filled;
+  return writer->buffer + writer->filled;
+}
+
+int usb_writer_commit(struct usb_writer *writer, size_t len)
+{
+  pthread_mutex_lock(&writer->mutex);
+  writer->filled += len;
+  /* Anything sent now has to follow the replayed requests */
+  usb_writer_wait_replay(writer);
+  int status = usb_writer_process(writer);
+  pthread_mutex_unlock(&writer->mutex);
+  return status;
+}
+
+int usb_writer_flush(struct usb_writer *writer)
+{
+  pthread_mutex_lock(&writer->mutex);
+  usb_writer_wait_replay(writer);
+  int status = usb_writer_flush_locked(writer);
+  pthread_mutex_unlock(&writer->mutex);
+  return status;
+}
+
+const struct http_framer *usb_writer_held(struct usb_writer *writer,
+                                          int *is_complete, int *can_refuse)
+{
+  pthread_mutex_lock(&writer->mutex);
+  *is_complete = http_framer_done(&writer->framer);
+  *can_refuse = *is_complete && writer->partial_sent == 0 &&
+                (writer->conn == NULL || usb_conn_is_idle(writer->conn));
+  pthread_mutex_unlock(&writer->mutex);
+  return &writer->framer;
+}
+
+void usb_writer_admit(struct usb_writer *writer, int refuse)
+{
+  pthread_mutex_lock(&writer->mutex);
+  /* A refused request never reaches the printer */
+  if (refuse && http_framer_done(&writer->framer) &&
+      writer->partial_sent == 0) {
+    usb_writer_consume(writer, writer->scanned);
+    http_framer_init(&writer->framer, 0);
+  } else {
+    writer->admitted = 1;
+  }
+  pthread_mutex_unlock(&writer->mutex);
+}
+
+/* Returns non-zero if the requests waiting for responses can be sent again
+   elsewhere without the client noticing. */
+static int usb_writer_can_replay(struct usb_writer *writer)
+{
+  struct usb_conn_t *conn = writer->conn;
+
+  if (conn == NULL)
+    return 0;
+  usb_writer_trim(writer);
+  return writer->replayable && conn->is_tracking &&
+         writer->partial_sent == 0 && writer->num_replay > 0 &&
+         writer->replay_first == conn->responses_seen &&
+         writer->replay_first + writer->num_replay == conn->requests_sent &&
+         conn->response.state == HTTP_FRAMER_HEADERS &&
+         conn->response.head_len == 0;
+}
+
+int usb_writer_replayable(struct usb_writer *writer)
+{
+  pthread_mutex_lock(&writer->mutex);
+  int replayable = usb_writer_can_replay(writer);
+  pthread_mutex_unlock(&writer->mutex);
+  return replayable;
+}
+
+int usb_writer_replay(struct usb_writer *writer)
+{
+  pthread_mutex_lock(&writer->mutex);
+  struct usb_conn_t *old = writer->conn;
+
+  /* A request on its way to the old interface cannot be taken back */
+  if (g_options.terminate || writer->sending ||
+      !usb_writer_can_replay(writer)) {
+    pthread_mutex_unlock(&writer->mutex);
+    return -1;
+  }
+  /* The kept requests stay as they are until the replay is done, nothing
+     else is sent meanwhile. */
+  writer->replaying = 1;
+  pthread_mutex_unlock(&writer->mutex);
+
+  struct usb_sock_t *usb = old->parent;
+  struct usb_conn_t *conn = NULL;
+  uint32_t retry_after;
+  if (usb_admit(usb, &retry_after) == 0) {
+    conn = usb_conn_acquire(usb);
+    usb_admit_done(usb);
+  }
+
+  int status = conn != NULL ? 0 : -1;
+  if (conn != NULL) {
+    NOTE("Interface #%u: Replaying %u requests on interface #%u",
+         old->interface_index, writer->num_replay, conn->interface_index);
+    size_t start = 0;
+    for (uint32_t i = 0; i < writer->num_replay && status == 0; i++) {
+      usb_conn_track_request(conn, writer->replay_is_head[i]);
+      status = usb_conn_send_message(conn, writer->replay + start,
+                                     writer->replay_ends[i] - start);
+      start = writer->replay_ends[i];
+    }
+    if (status) {
+      conn->is_staled = 1;
+      usb_conn_release(conn);
+    }
+  }
+
+  pthread_mutex_lock(&writer->mutex);
+  if (status == 0) {
+    pthread_mutex_lock(&writer->read_lock);
+    writer->conn = conn;
+    pthread_mutex_unlock(&writer->read_lock);
+    writer->replay_first = 0;
+  }
+  writer->replaying = 0;
+  pthread_cond_broadcast(&writer->cond);
+  pthread_mutex_unlock(&writer->mutex);
+  if (status)
+    return -1;
+
+  /* An interface which failed in the middle of an exchange is recovered
+     rather than drained. */
+  old->is_staled = 1;
+  usb_conn_release(old);
+  return 0;
+}
+
+enum usb_writer_state usb_writer_state(struct usb_writer *writer)
+{
+  enum usb_writer_state state = USB_WRITER_IDLE;
+
+  pthread_mutex_lock(&writer->mutex);
+  if (writer->filled > 0 || writer->partial_sent > 0)
+    state = USB_WRITER_REQUEST;
+  else if (writer->conn != NULL && !usb_conn_is_idle(writer->conn))
+    state = USB_WRITER_RESPONSE;
+  pthread_mutex_unlock(&writer->mutex);
+  return state;
+}
+
+struct usb_conn_t *usb_writer_begin_read(struct usb_writer *writer)
+{
+  struct usb_conn_t *conn = NULL;
+
+  /* An interface whose responses are not tracked never looks idle and is
+     read from all the time, as before */
+  pthread_mutex_lock(&writer->read_lock);
+  if (writer->conn != NULL && !usb_conn_is_idle(writer->conn)) {
+    conn = writer->conn;
+    writer->reading = 1;
+  }
+  pthread_mutex_unlock(&writer->read_lock);
+  return conn;
+}
+
+void usb_writer_end_read(struct usb_writer *writer)
+{
+  pthread_mutex_lock(&writer->read_lock);
+  writer->reading = 0;
+  pthread_mutex_unlock(&writer->read_lock);
+}
+
+int usb_writer_release_idle(struct usb_writer *writer)
+{
+  struct usb_conn_t *conn = NULL;
+
+  pthread_mutex_lock(&writer->mutex);
+  pthread_mutex_lock(&writer->read_lock);
+  if (writer->conn != NULL && writer->framing && !writer->reading &&
+      !writer->replaying &&
+      writer->filled == 0 && writer->partial_sent == 0 &&
+      usb_conn_is_idle(writer->conn)) {
+    conn = writer->conn;
+    writer->conn = NULL;
+    /* Nothing is waiting for a response, so nothing is left to replay */
+    writer->replayable = 1;
+    writer->replay_len = 0;
+    writer->num_replay = 0;
+  }
+  pthread_mutex_unlock(&writer->read_lock);
+  pthread_mutex_unlock(&writer->mutex);
+
+  if (conn == NULL)
+    return 0;
+  NOTE("Interface #%u: Released while the client is idle",
+       conn->interface_index);
+  usb_conn_release(conn);
+  return 1;
+}
+
+void usb_writer_attach(struct usb_writer *writer, struct usb_conn_t *conn)
+{
+  pthread_mutex_lock(&writer->mutex);
+  pthread_mutex_lock(&writer->read_lock);
+  writer->conn = conn;
+  pthread_mutex_unlock(&writer->read_lock);
+  writer->replay_first = conn->requests_sent;
+  /* Requests cannot be told apart once parsing gave up */
+  if (!writer->framing)
+    conn->is_tracking = 0;
+  pthread_mutex_unlock(&writer->mutex);
+}
+
+int usb_conn_read(struct usb_conn_t *conn, uint8_t *data, int length,
+                  int *transferred, unsigned int timeout)
+{
+  int status = conn->parent->transport->bulk_in(conn, data, length,
+                                                transferred, timeout);
+  if (*transferred > 0)
+    usb_conn_track_response(conn, data, (size_t)*transferred);
+  return status;
+}
+
 struct libusb_transfer *setup_async_read(struct usb_conn_t *conn,
                                          struct http_packet_t *pkt,
                                          libusb_transfer_cb_fn callback,
@@ -754,3 +2152,15 @@ struct libusb_transfer *setup_async_read(struct usb_conn_t *conn,
 
   return transfer;
 }
+
+int usb_conn_submit_read(struct usb_conn_t *conn,
+                         struct libusb_transfer *transfer)
+{
+  return conn->parent->transport->submit_in(conn, transfer);
+}
+
+int usb_conn_cancel_read(struct usb_conn_t *conn,
+                         struct libusb_transfer *transfer)
+{
+  return conn->parent->transport->cancel_in(conn, transfer);
+}
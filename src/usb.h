@@ -15,32 +15,157 @@
 #pragma once
 
 #include <libusb.h>
+#include <pthread.h>
 #include <semaphore.h>
+#include <sys/time.h>
+
+#include "http.h"
 
 /* In seconds */
 #define PRINTER_CRASH_TIMEOUT_RECEIVE (60 * 60 * 6)
 #define PRINTER_CRASH_TIMEOUT_ANSWER 5
 #define CONN_STALE_THRESHHOLD 5
 
+/* Weights of transfer faults in an interface's fault score. Each successful
+   transfer takes one point off again. Once the score reaches
+   CONN_STALE_THRESHHOLD the interface is quarantined: it leaves the pool
+   when its connection ends and only returns once it has been recovered. */
+#define USB_FAULT_STALL CONN_STALE_THRESHHOLD
+#define USB_FAULT_TIMEOUT CONN_STALE_THRESHHOLD
+#define USB_FAULT_ERROR 2
+#define USB_FAULT_OVERFLOW 2
+
+/* Recovery steps for a quarantined interface, tried in this order. Only the
+   last one affects the other interfaces and it waits until none of them is
+   in use. */
+enum usb_recovery {
+  USB_RECOVER_CLEAR_HALT,
+  USB_RECOVER_ALT_SETTING,
+  USB_RECOVER_RESET
+};
+
+/* Transfers are sized as the largest multiple of the endpoint's
+   wMaxPacketSize that fits, so that only the end of a message can produce a
+   short packet. */
+#define USB_IN_TRANSFER_SIZE (1 << 14)
+#define USB_OUT_TRANSFER_SIZE (1 << 16)
+/* How long, in milliseconds, an incomplete message shorter than a packet is
+   held back waiting for more data from the client before it is sent as a
+   short packet anyway. */
+#define USB_OUT_LINGER_MS 2
+
+/* When a connection ends before the printer finished its responses, what is
+   left is read and discarded before the interface goes back to the pool.
+   Draining stops once the printer has been quiet for USB_DRAIN_QUIET_MS and
+   gives up after USB_DRAIN_MAX_MS, in milliseconds. */
+#define USB_DRAIN_QUIET_MS 250
+#define USB_DRAIN_MAX_MS 3000
+
+/* Limits on the idempotent requests kept for sending them again on another
+   interface, see usb_writer_replay(). */
+#define USB_REPLAY_MAX_SIZE (1 << 14)
+#define USB_REPLAY_MAX_REQUESTS 8
+/* Reads in a row which time out without data before such requests are
+   replayed, as the interface is assumed to hang */
+#define USB_REPLAY_IDLE_READS 3
+
+/* Admission control: beyond the free interfaces at most this many client
+   connections wait for one by default (--max-waiting), for up to
+   USB_ACQUIRE_TIMEOUT_MS. Clients turned away are told to retry after an
+   estimate of when an interface frees up, clamped to
+   USB_RETRY_AFTER_MIN..USB_RETRY_AFTER_MAX seconds. */
+#define USB_DEFAULT_MAX_WAITING 16
+#define USB_ACQUIRE_TIMEOUT_MS 3000
+#define USB_RETRY_AFTER_MIN 1
+#define USB_RETRY_AFTER_MAX 60
+
 struct usb_interface {
   uint8_t interface_number;
   uint8_t libusb_interface_index;
   int interface_alt;
   uint8_t endpoint_in;
   uint8_t endpoint_out;
+  /* wMaxPacketSize of the two endpoints. */
+  uint16_t max_packet_in;
+  uint16_t max_packet_out;
   sem_t lock;
+
+  /* Health, see usb_conn_report(). */
+  uint32_t fault_score;
+  uint32_t num_faults;
+  uint32_t num_recoveries;
+  int is_quarantined;
+  /* Next enum usb_recovery step to try. */
+  int recovery;
 };
 
+struct usb_sock_t;
+struct usb_conn_t;
+
+/* Backend through which the USB device is reached. Transfers are described
+   with libusb's transfer struct and results are reported with libusb's status
+   codes whichever backend is in use. */
+struct usb_transport {
+  const char *name;
+  /* Finds the printer, fills in |interfaces| and |device_id| and claims every
+     IPP-USB interface. Returns 0 on success. */
+  int (*open)(struct usb_sock_t *usb);
+  /* Releases the interfaces, resets and closes the device. */
+  void (*close)(struct usb_sock_t *usb);
+  /* Claims |uf| and selects its IPP-USB alt setting. Returns 0 on success. */
+  int (*claim)(struct usb_sock_t *usb, struct usb_interface *uf);
+  /* Synchronous bulk OUT transfer. */
+  int (*bulk_out)(struct usb_conn_t *conn, uint8_t *data, int length,
+                  int *transferred, unsigned int timeout);
+  /* Synchronous bulk IN transfer, for callers without an event loop of
+     their own. */
+  int (*bulk_in)(struct usb_conn_t *conn, uint8_t *data, int length,
+                 int *transferred, unsigned int timeout);
+  /* Starts an asynchronous bulk IN transfer prepared by setup_async_read().
+     Its callback fires from within handle_events(). */
+  int (*submit_in)(struct usb_conn_t *conn, struct libusb_transfer *transfer);
+  /* Cancels a submitted IN transfer. The callback still fires, with status
+     LIBUSB_TRANSFER_CANCELLED. */
+  int (*cancel_in)(struct usb_conn_t *conn, struct libusb_transfer *transfer);
+  /* Returns non-zero if the backend can report the device going away. */
+  int (*can_hotplug)(struct usb_sock_t *usb);
+  /* Arranges for the daemon to exit when the device goes away. Returns 0 on
+     success. */
+  int (*register_hotplug)(struct usb_sock_t *usb);
+  /* Prepares for handle_events() being called in a loop by the completion
+     engine. Returns 0 on success. */
+  int (*start_events)(struct usb_sock_t *usb);
+  /* Waits up to |tv| for transfer completions and hotplug events and
+     dispatches them. Returns early on wake_events(). A backend which
+     waits for less than |tv| sets it to the time it waited for. */
+  void (*handle_events)(struct usb_sock_t *usb, struct timeval *tv);
+  /* Makes a concurrent handle_events() return. */
+  void (*wake_events)(struct usb_sock_t *usb);
+  /* Runs the enum usb_recovery |step| on |uf|. Returns 0 on success. */
+  int (*recover)(struct usb_sock_t *usb, struct usb_interface *uf, int step);
+  /* Allocates |length| bytes the device can reach without the kernel
+     copying them, or returns NULL. May itself be NULL. */
+  uint8_t *(*dev_mem_alloc)(struct usb_sock_t *usb, size_t length);
+  void (*dev_mem_free)(struct usb_sock_t *usb, uint8_t *buffer, size_t length);
+};
+
+extern const struct usb_transport usb_libusb_transport;
+
 struct usb_sock_t {
+  const struct usb_transport *transport;
+  /* Backend-private state. */
+  void *transport_data;
+
   libusb_context *context;
   libusb_device_handle *printer;
   char *device_id;
-  int max_packet_size;
 
   uint32_t num_interfaces;
   struct usb_interface *interfaces;
 
+  /* Quarantined interfaces, guarded by pool_manage_lock. */
   uint32_t num_staled;
+  /* Held while recovering interfaces. */
   sem_t num_staled_lock;
 
   sem_t pool_manage_lock;
@@ -48,27 +173,246 @@ struct usb_sock_t {
   uint32_t num_taken;
 
   uint32_t *interface_pool;
+
+  /* Admission control, guarded by pool_manage_lock: connections admitted
+     but not holding an interface yet, connections turned away, and the
+     moving average of how long an interface is held in milliseconds. */
+  uint32_t num_waiting;
+  uint64_t num_refused;
+  uint32_t hold_avg_ms;
+
+  /* Recycled transfer buffers, see usb_buffer_alloc(). */
+  struct usb_buffer_pool *buffer_pool;
+
+  /* Completion engine */
+  int events_started;
+  int events_stop;
 };
 
 struct usb_conn_t {
   struct usb_sock_t *parent;
   struct usb_interface *interface;
   uint32_t interface_index;
+  /* When the interface was taken from the pool, see affinity_now() */
+  uint64_t acquired_at;
+  /* Set once the interface has to be recovered before it is used again. */
   int is_staled;
+
+  /* Response boundaries, see usb_conn_track_request(). */
+  int is_tracking;
+  uint32_t requests_sent;
+  uint32_t responses_seen;
+  /* Bit n % 64 is set if request n was a HEAD request. */
+  uint64_t head_requests;
+  struct http_framer response;
 };
 
 struct usb_sock_t *usb_open(void);
 void usb_close(struct usb_sock_t *);
 
+/* Starts the thread dispatching transfer completions and hotplug events,
+   which must run for any asynchronous transfer to complete. Returns 0 on
+   success. */
+int usb_start_events(struct usb_sock_t *);
+/* Stops that thread and waits for it to exit. */
+void usb_stop_events(struct usb_sock_t *);
+
 int usb_can_callback(struct usb_sock_t *);
 void usb_register_callback(struct usb_sock_t *);
 
+/* Lets a client connection wait for an interface if one is free or fewer
+   than g_options.max_waiting connections wait for one already, and returns
+   0. Every admission is ended by usb_admit_done() once the connection got
+   its interface or gave up. Otherwise returns non-zero and sets
+   |retry_after|, see usb_retry_after(). */
+int usb_admit(struct usb_sock_t *, uint32_t *retry_after);
+void usb_admit_done(struct usb_sock_t *);
+/* Seconds after which an interface is likely to be free, estimated from
+   how long connections have been holding them. */
+uint32_t usb_retry_after(struct usb_sock_t *);
+
+struct usb_admission_stats {
+  uint32_t waiting;
+  uint64_t refused;
+  uint32_t hold_avg_ms;
+};
+void usb_get_admission_stats(struct usb_sock_t *, struct usb_admission_stats *);
+
+/* Waits up to USB_ACQUIRE_TIMEOUT_MS for a free interface. */
 struct usb_conn_t *usb_conn_acquire(struct usb_sock_t *);
+/* Returns the interface to the pool, or quarantines it and tries to recover
+   it if the connection left it unhealthy. */
 void usb_conn_release(struct usb_conn_t *);
+/* Records the outcome of a transfer on |conn|: 0 for success or one of the
+   USB_FAULT_* weights. Returns non-zero once the interface has to be
+   recovered, after which the connection should be ended. Safe to call from
+   transfer callbacks. */
+int usb_conn_report(struct usb_conn_t *, uint32_t fault);
+
+/* Requests and responses on a connection are tracked so that on release the
+   interface can be drained up to the end of the last response. The request
+   is recorded before it is sent, as its response may be read before the
+   send returns. */
+void usb_conn_track_request(struct usb_conn_t *, int is_head);
+/* Records |len| bytes read from the IN endpoint. */
+void usb_conn_track_response(struct usb_conn_t *, const uint8_t *data,
+                             size_t len);
+/* Gives up tracking the responses on |conn|, for when bytes read from it
+   could not be passed on. The interface is then recovered on release
+   instead of being handed on as it is. */
+void usb_conn_stop_tracking(struct usb_conn_t *);
 
+/* Transfer buffers come from device memory where the backend supports it,
+   so that usbfs maps them for DMA instead of copying every transfer through
+   the kernel, and from the heap otherwise. Sizes are rounded up to
+   USB_IN_TRANSFER_SIZE or USB_OUT_TRANSFER_SIZE, whose buffers are kept for
+   reuse. */
+uint8_t *usb_buffer_alloc(struct usb_sock_t *, size_t length);
+void usb_buffer_free(struct usb_sock_t *, uint8_t *buffer);
+
+/* Sends |pkt|, which holds one complete request, followed by a zero-length
+   packet if it ends on a packet boundary. */
 int usb_conn_packet_send(struct usb_conn_t *, struct http_packet_t *);
+/* Allocates a packet for a read from the IN endpoint, backed by a transfer
+   buffer. packet_free() returns the buffer. */
+struct http_packet_t *usb_conn_packet_new(struct usb_conn_t *);
+/* Blocking read of up to |length| bytes. Returns a libusb status code. */
+int usb_conn_read(struct usb_conn_t *, uint8_t *data, int length,
+                  int *transferred, unsigned int timeout);
+
+int usb_conn_submit_read(struct usb_conn_t *, struct libusb_transfer *);
+int usb_conn_cancel_read(struct usb_conn_t *, struct libusb_transfer *);
 
 struct libusb_transfer *setup_async_read(struct usb_conn_t *conn,
                                          struct http_packet_t *pkt,
                                          libusb_transfer_cb_fn callback,
                                          void *user_data, uint32_t timeout);
+
+/* Aggregates the request stream of one connection into large OUT transfers.
+   Every transfer either ends a request, terminated with a zero-length packet
+   when it is a multiple of the endpoint's packet size, or is such a multiple
+   itself, so the printer never sees a short packet in the middle of a
+   request. Between exchanges the writer can hand its interface back, see
+   usb_writer_release_idle(). */
+struct usb_writer {
+  /* Guards all of the writer against usb_writer_replay(). Never held across
+     a transfer. */
+  pthread_mutex_t mutex;
+  /* Set while a request goes out with |mutex| released, no replay starts
+     meanwhile. */
+  int sending;
+  /* Set while usb_writer_replay() moves the requests to another interface
+     with |mutex| released, |cond| is signalled once it is done. */
+  int replaying;
+  pthread_cond_t cond;
+  struct usb_sock_t *usb;
+  /* Guards |conn| and |reading| for the thread reading the responses.
+     Changing |conn| takes |mutex| first, then this. */
+  pthread_mutex_t read_lock;
+  /* NULL while no interface is held */
+  struct usb_conn_t *conn;
+  /* Set while a read from |conn| is in flight, see usb_writer_begin_read(). */
+  int reading;
+  uint8_t *buffer;
+  size_t filled;
+  /* Bytes of |buffer| already fed to |framer|. */
+  size_t scanned;
+  /* Bytes of the incomplete request at the start of |buffer| which have
+     already been sent. */
+  size_t partial_sent;
+  /* Cleared if the stream could not be parsed, after which data is passed
+     on as it comes. */
+  int framing;
+  struct http_framer framer;
+
+  /* Copies of the sent requests still waiting for their responses, kept for
+     as long as every one of them is idempotent and they fit. */
+  int replayable;
+  uint8_t *replay;
+  size_t replay_len;
+  uint32_t num_replay;
+  /* Number, on |conn|, of the first request in |replay|. */
+  uint32_t replay_first;
+  size_t replay_ends[USB_REPLAY_MAX_REQUESTS];
+  int replay_is_head[USB_REPLAY_MAX_REQUESTS];
+
+  /* Set if every request has to be admitted before its first byte goes
+     out, see usb_writer_admit(). */
+  int gated;
+  /* Set once the request being parsed was admitted */
+  int admitted;
+};
+
+/* Returned by usb_writer_commit() and usb_writer_flush() when they cannot
+   go on by themselves. The caller resolves the cause and calls them again,
+   without holding anything the writer's other users wait for. */
+enum usb_writer_status {
+  /* A request waits to be admitted, see usb_writer_held() */
+  USB_WRITER_HELD = 1,
+  /* Data has to go out but no interface is held, see usb_writer_attach() */
+  USB_WRITER_DETACHED
+};
+
+/* Starts out without an interface, the first request to go out needs
+   usb_writer_attach(). */
+int usb_writer_init(struct usb_writer *, struct usb_sock_t *);
+/* Holds every request from now on until usb_writer_admit() lets it go. */
+void usb_writer_gate(struct usb_writer *);
+void usb_writer_free(struct usb_writer *);
+/* Returns where the next bytes from the client go, with room for |*room|
+   bytes, so that they can be received in place. */
+uint8_t *usb_writer_space(struct usb_writer *, size_t *room);
+/* Takes |len| bytes written to usb_writer_space() and sends every complete
+   request and the packet-aligned part of an incomplete one. Returns 0 on
+   success, -1 on failure or a usb_writer_status. */
+int usb_writer_commit(struct usb_writer *, size_t len);
+/* Returns the number of bytes held back. */
+size_t usb_writer_pending(const struct usb_writer *);
+/* Sends whatever is held back, even if it ends in a short packet. Returns
+   the same as usb_writer_commit(). */
+int usb_writer_flush(struct usb_writer *);
+/* Returns the framer of the request held with USB_WRITER_HELD. Unless
+   |is_complete| is set the request has only been parsed in part, its first
+   bytes are about to go out. |can_refuse| is set if it is complete and the
+   printer owes no earlier response, so that it may be dropped. Only the
+   thread feeding the writer may use the framer. */
+const struct http_framer *usb_writer_held(struct usb_writer *,
+                                          int *is_complete, int *can_refuse);
+/* Lets the held request go out, or drops it if |refuse| is set and it may
+   be refused. The caller then answers it in place of the printer. */
+void usb_writer_admit(struct usb_writer *, int refuse);
+/* After a failed transfer, moves the writer to another free interface and
+   sends the requests still waiting for responses there. Only possible if
+   all of them are idempotent and kept, and none of their response has been
+   read yet, and none is being sent. The new interface is admitted like
+   that of a new request, see usb_admit(). Meanwhile, only sending more
+   requests waits. The old
+   interface is quarantined. Returns 0 on success, after which |conn| of
+   the writer is the new connection. */
+int usb_writer_replay(struct usb_writer *);
+/* Returns non-zero if usb_writer_replay() would find the outstanding
+   requests replayable. */
+int usb_writer_replayable(struct usb_writer *);
+
+/* Where the exchange on a writer stands: no request or response under
+   way, part of a request received, or responses outstanding. */
+enum usb_writer_state {
+  USB_WRITER_IDLE,
+  USB_WRITER_REQUEST,
+  USB_WRITER_RESPONSE
+};
+enum usb_writer_state usb_writer_state(struct usb_writer *);
+
+/* For the thread reading the responses: returns the connection which the
+   printer owes responses on and keeps it from being released until
+   usb_writer_end_read(), or NULL if nothing is outstanding. */
+struct usb_conn_t *usb_writer_begin_read(struct usb_writer *);
+void usb_writer_end_read(struct usb_writer *);
+
+/* Returns the interface to the pool if every request has been sent and
+   answered and no read is in flight, so that a client between requests
+   holds none. Returns non-zero if it did. */
+int usb_writer_release_idle(struct usb_writer *);
+/* Continues on the newly acquired |conn| once the interface was
+   released. */
+void usb_writer_attach(struct usb_writer *, struct usb_conn_t *conn);